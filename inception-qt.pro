@@ -180,12 +180,14 @@ HEADERS += src/qt/inceptiongui.h \
     src/chainparams.h \
     src/chainparamsseeds.h \
     src/checkpoints.h \
+    src/checkqueue.h \
     src/compat.h \
     src/coincontrol.h \
     src/sync.h \
     src/util.h \
     src/hash.h \
     src/uint256.h \
+    src/arith_uint256.h \
     src/kernel.h \
     src/scrypt.h \
     src/pbkdf2.h \
@@ -1,9 +1,25 @@
+// Copyright (c) 2009-2010 Satoshi Nakamoto
+// Copyright (c) 2009-2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
 #ifndef COIN_ARITH_UINT256_H
 #define COIN_ARITH_UINT256_H
 
+#include <stdexcept>
+#include <stdint.h>
+
 // Temporary for migration to opaque uint160/256
 #include "uint256.h"
 
+class uint_error : public std::runtime_error {
+public:
+    explicit uint_error(const std::string& str) : std::runtime_error(str) {}
+};
+
+/** 256-bit unsigned integer with the multiplication, division and compact
+ * target encoding needed by consensus code, without the heap allocations of
+ * CBigNum. Results wrap modulo 2^256.
+ */
 class arith_uint256 : public uint256 {
 public:
     arith_uint256() {}
@@ -11,9 +27,146 @@ public:
     arith_uint256(uint64_t b) : uint256(b) {}
     explicit arith_uint256(const std::string& str) : uint256(str) {}
     explicit arith_uint256(const std::vector<unsigned char>& vch) : uint256(vch) {}
+
+    arith_uint256& operator*=(uint32_t b32)
+    {
+        uint64_t carry = 0;
+        for (int i = 0; i < WIDTH; i++)
+        {
+            uint64_t n = carry + (uint64_t)b32 * pn[i];
+            pn[i] = n & 0xffffffff;
+            carry = n >> 32;
+        }
+        return *this;
+    }
+
+    arith_uint256& operator*=(const arith_uint256& b)
+    {
+        arith_uint256 a = *this;
+        *this = 0;
+        for (int j = 0; j < WIDTH; j++)
+        {
+            uint64_t carry = 0;
+            for (int i = 0; i + j < WIDTH; i++)
+            {
+                uint64_t n = carry + pn[i + j] + (uint64_t)a.pn[j] * b.pn[i];
+                pn[i + j] = n & 0xffffffff;
+                carry = n >> 32;
+            }
+        }
+        return *this;
+    }
+
+    arith_uint256& operator/=(const arith_uint256& b)
+    {
+        arith_uint256 div = b;     // make a copy, so we can shift.
+        arith_uint256 num = *this; // make a copy, so we can subtract.
+        *this = 0;                 // the quotient.
+        int num_bits = num.bits();
+        int div_bits = div.bits();
+        if (div_bits == 0)
+            throw uint_error("Division by zero");
+        if (div_bits > num_bits) // the result is certainly 0.
+            return *this;
+        int shift = num_bits - div_bits;
+        div <<= shift; // shift so that div and num align.
+        while (shift >= 0)
+        {
+            if (num >= div)
+            {
+                num -= div;
+                pn[shift / 32] |= (1U << (shift & 31)); // set a bit of the result.
+            }
+            div >>= 1; // shift back.
+            shift--;
+        }
+        // num now contains the remainder of the division.
+        return *this;
+    }
+
+    // Position of the highest bit set plus one, or zero if the value is zero
+    unsigned int bits() const
+    {
+        for (int pos = WIDTH - 1; pos >= 0; pos--)
+        {
+            if (pn[pos])
+            {
+                for (int bits = 31; bits > 0; bits--)
+                {
+                    if (pn[pos] & (1U << bits))
+                        return 32 * pos + bits + 1;
+                }
+                return 32 * pos + 1;
+            }
+        }
+        return 0;
+    }
+
+    /**
+     * The "compact" format is a representation of a whole number N using an
+     * unsigned 32bit number similar to a floating point format. The most
+     * significant 8 bits are the unsigned exponent of base 256, the lower 23
+     * bits are the mantissa and bit 24 (0x800000) is the sign of N.
+     * N = (-1^sign) * mantissa * 256^(exponent-3)
+     *
+     * This is the same encoding CBigNum uses, so values round trip the same
+     * way. A value that does not fit in 256 bits sets *pfOverflow, a negative
+     * one sets *pfNegative and the magnitude is returned.
+     */
+    arith_uint256& SetCompact(uint32_t nCompact, bool* pfNegative = NULL, bool* pfOverflow = NULL)
+    {
+        int nSize = nCompact >> 24;
+        uint32_t nWord = nCompact & 0x007fffff;
+        if (nSize <= 3)
+        {
+            nWord >>= 8 * (3 - nSize);
+            *this = nWord;
+        }
+        else
+        {
+            *this = nWord;
+            *this <<= 8 * (nSize - 3);
+        }
+        // CBigNum has no negative zero, so only a non-zero magnitude is negative
+        if (pfNegative)
+            *pfNegative = nWord != 0 && (nCompact & 0x00800000) != 0;
+        if (pfOverflow)
+            *pfOverflow = nWord != 0 && ((nSize > 34) ||
+                                         (nWord > 0xff && nSize > 33) ||
+                                         (nWord > 0xffff && nSize > 32));
+        return *this;
+    }
+
+    uint32_t GetCompact(bool fNegative = false) const
+    {
+        int nSize = (bits() + 7) / 8;
+        uint32_t nCompact = 0;
+        if (nSize <= 3)
+            nCompact = GetLow64() << 8 * (3 - nSize);
+        else
+        {
+            arith_uint256 bn = *this;
+            bn >>= 8 * (nSize - 3);
+            nCompact = bn.GetLow64();
+        }
+        // The 0x00800000 bit denotes the sign.
+        // Thus, if it is already set, divide the mantissa by 256 and increase the exponent.
+        if (nCompact & 0x00800000)
+        {
+            nCompact >>= 8;
+            nSize++;
+        }
+        nCompact |= nSize << 24;
+        nCompact |= (fNegative && (nCompact & 0x007fffff) ? 0x00800000 : 0);
+        return nCompact;
+    }
 };
 
+inline const arith_uint256 operator*(const arith_uint256& a, uint32_t b)              { return arith_uint256(a) *= b; }
+inline const arith_uint256 operator*(const arith_uint256& a, const arith_uint256& b)  { return arith_uint256(a) *= b; }
+inline const arith_uint256 operator/(const arith_uint256& a, const arith_uint256& b)  { return arith_uint256(a) /= b; }
+
 #define ArithToUint256(x) (x)
 #define UintToArith256(x) (x)
 
-#endif // COIN_UINT256_H
+#endif // COIN_ARITH_UINT256_H
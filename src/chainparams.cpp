@@ -62,8 +62,8 @@ public:
         vAlertPubKey = ParseHex("04aaffe2833752dcc3d98f335e9153237fa5aba5fa2d1d90090156c141535a3fc7bc671f83a754e11ab96311b1eb036b56fa2be9e03a1fe17b5074f54e21800836");
         nDefaultPort = 17000;
         nRPCPort = 17001;
-        bnProofOfWorkLimit = CBigNum(~uint256(0) >> 28);
-        bnProofOfStakeLimit = CBigNum(~uint256(0) >> 28);
+        bnProofOfWorkLimit = ~uint256(0) >> 28;
+        bnProofOfStakeLimit = ~uint256(0) >> 28;
 
         const char* pszTimestamp = "Jun 6, 2016 05:00:00 UTC: Inception";
         std::vector<CTxIn> vin;
@@ -140,8 +140,8 @@ public:
         pchMessageStart[2] = 0x43;
         pchMessageStart[3] = 0x54;
 
-        bnProofOfWorkLimit = CBigNum(~uint256(0) >> 16);
-        bnProofOfStakeLimit = CBigNum(~uint256(0) >> 16);
+        bnProofOfWorkLimit = ~uint256(0) >> 16;
+        bnProofOfStakeLimit = ~uint256(0) >> 16;
 
         vAlertPubKey = ParseHex("04e44761e96c9056be6b659c04b94fbfebeb5d5257fe028e80695c62f7c2f81f85d131a669df3be611393f454852a2d08c6314aad5ca3cbe5616262db3d4a6efac");
         nDefaultPort = 17100;
@@ -197,7 +197,7 @@ public:
         pchMessageStart[2] = 0x43;
         pchMessageStart[3] = 0x51;
 
-        bnProofOfWorkLimit = CBigNum(~uint256(0) >> 1);
+        bnProofOfWorkLimit = ~uint256(0) >> 1;
         genesis.nTime = 1462510800;
         genesis.nBits  = bnProofOfWorkLimit.GetCompact();
         genesis.nNonce = 3248;
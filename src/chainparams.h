@@ -6,7 +6,7 @@
 #ifndef COIN_CHAIN_PARAMS_H
 #define COIN_CHAIN_PARAMS_H
 
-#include "bignum.h"
+#include "arith_uint256.h"
 #include "uint256.h"
 #include "util.h"
 
@@ -74,10 +74,10 @@ public:
     int64_t TargetTimespan() const { return nTargetTimespan; }
     int LastPoWBlock() const { return nLastPoWBlock; }
     int FirstPoSBlock() const { return nFirstPoSBlock; }
-    const CBigNum& ProofOfWorkLimit() const { return bnProofOfWorkLimit; }
+    const arith_uint256& ProofOfWorkLimit() const { return bnProofOfWorkLimit; }
     int64_t ProofOfWorkReward() const { return nProofOfWorkReward; }
     int SubsidyHalvingInterval() const { return nSubsidyHalvingInterval; }
-    const CBigNum& ProofOfStakeLimit() const { return bnProofOfStakeLimit; }
+    const arith_uint256& ProofOfStakeLimit() const { return bnProofOfStakeLimit; }
     int64_t ProofOfStakeReward() const { return nProofOfStakeReward; }
     unsigned int ModifierInterval() const { return nModifierInterval; }
     unsigned int StakeMinAge() const { return nStakeMinAge; }
@@ -94,8 +94,8 @@ protected:
     vector<unsigned char> vAlertPubKey;
     int nDefaultPort;
     int nRPCPort;
-    CBigNum bnProofOfWorkLimit;
-    CBigNum bnProofOfStakeLimit;
+    arith_uint256 bnProofOfWorkLimit;
+    arith_uint256 bnProofOfStakeLimit;
     int nSubsidyHalvingInterval;
     string strNetworkID;
     string strDataDir;
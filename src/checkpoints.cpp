@@ -351,9 +351,14 @@ bool CSyncCheckpoint::RelayTo(CNode* pnode) const
     if (pnode->nVersion == 0)
         return false;
     // returns true if wasn't already sent
-    if (pnode->hashCheckpointKnown != hashCheckpoint)
+    bool fNew;
     {
+        LOCK(pnode->cs_inventory);
+        fNew = pnode->hashCheckpointKnown != hashCheckpoint;
         pnode->hashCheckpointKnown = hashCheckpoint;
+    }
+    if (fNew)
+    {
         pnode->PushMessage("checkpoint", *this);
         return true;
     }
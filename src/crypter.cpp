@@ -212,6 +212,14 @@ bool CCryptoKeyStore::AddKeyPubKey(const CKey& key, const CPubKey &pubkey)
     return true;
 }
 
+void CCryptoKeyStore::EraseKey(const CKeyID &address)
+{
+    LOCK(cs_KeyStore);
+    if (IsCrypted())
+        mapCryptedKeys.erase(address);
+    else
+        mapKeys.erase(address);
+}
 
 bool CCryptoKeyStore::AddCryptedKey(const CPubKey &vchPubKey, const std::vector<unsigned char> &vchCryptedSecret)
 {
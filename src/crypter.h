@@ -173,6 +173,8 @@ public:
 
     virtual bool AddCryptedKey(const CPubKey &vchPubKey, const std::vector<unsigned char> &vchCryptedSecret);
     bool AddKeyPubKey(const CKey& key, const CPubKey &pubkey);
+    // Forget a key added in memory whose write to the wallet file failed
+    void EraseKey(const CKeyID &address);
     bool HaveKey(const CKeyID &address) const
     {
         {
@@ -7,6 +7,7 @@
 #include "main.h"
 #include "chainparams.h"
 #include "txdb.h"
+#include "txmempool.h"
 #include "rpcserver.h"
 #include "net.h"
 #include "util.h"
@@ -107,11 +108,14 @@ void Shutdown()
         if (pwalletMain)
             pwalletMain->SetBestChain(CBlockLocator(pindexBest));
 #endif
+        CTxDB::WriteBlockIndexSnapshot();
     }
 #ifdef ENABLE_WALLET
     if (pwalletMain)
         bitdb.Flush(true);
 #endif
+    CloseBlockFiles();
+    CloseOrphanBlockSpill();
     boost::filesystem::remove(GetPidFile());
     UnregisterAllWallets();
 #ifdef ENABLE_WALLET
@@ -167,8 +171,18 @@ std::string HelpMessage()
     strUsage += "  -pid=<file>            " + _("Specify pid file (default: inceptiond.pid)") + "\n";
     strUsage += "  -datadir=<dir>         " + _("Specify data directory") + "\n";
     strUsage += "  -wallet=<dir>          " + _("Specify wallet file (within data directory)") + "\n";
-    strUsage += "  -dbcache=<n>           " + _("Set database cache size in megabytes (default: 25)") + "\n";
+    strUsage += "  -dbcache=<n>           " + strprintf(_("Set database cache size in megabytes (default: %u, at most %u)"), 25, MAX_DB_CACHE) + "\n";
+    strUsage += "  -dbwritebuffer=<n>     " + strprintf(_("Set transaction index write buffer size in megabytes (default: %u, at most %u)"), 4, MAX_DB_WRITE_BUFFER) + "\n";
+    strUsage += "  -dbbulkwritebuffer=<n> " + strprintf(_("Set transaction index write buffer size in megabytes during initial download (default: %u, at most %u)"), 128, MAX_DB_WRITE_BUFFER) + "\n";
+    strUsage += "  -dbmaxopenfiles=<n>    " + strprintf(_("Maximum number of transaction index files kept open (default: %u, %u to %u)"), 1000, MIN_DB_OPEN_FILES, MAX_DB_OPEN_FILES) + "\n";
+    strUsage += "  -dbblocksize=<n>       " + strprintf(_("Set transaction index block size in kilobytes (default: %u, at most %u)"), 4, MAX_DB_BLOCK_SIZE) + "\n";
+    strUsage += "  -dbcompression         " + _("Compress transaction index blocks (default: 1)") + "\n";
+    strUsage += "  -dbbloombits=<n>       " + strprintf(_("Bloom filter bits per key for transaction index lookups, 0 to disable (default: %u, at most %u)"), 10, MAX_DB_BLOOM_BITS) + "\n";
     strUsage += "  -dblogsize=<n>         " + _("Set database disk log size in megabytes (default: 100)") + "\n";
+    strUsage += "  -blockcachesize=<n>    " + strprintf(_("Keep the <n> most recently read blocks decoded in memory (default: %u, at most %u)"), DEFAULT_BLOCK_CACHE_SIZE, MAX_BLOCK_CACHE_SIZE) + "\n";
+    strUsage += "  -coinscachesize=<n>    " + strprintf(_("Keep up to <n> megabytes of transaction outputs in memory (default: %u)"), DEFAULT_COINS_CACHE_SIZE) + "\n";
+    strUsage += "  -sigcachemb=<n>        " + strprintf(_("Limit the signature cache to <n> megabytes (default: %u, at most %u)"), DEFAULT_MAX_SIG_CACHE_SIZE, MAX_SIG_CACHE_SIZE) + "\n";
+    strUsage += "  -maxsigcachesize=<n>   " + _("Limit the signature cache to <n> entries (deprecated, use -sigcachemb)") + "\n";
     strUsage += "  -timeout=<n>           " + _("Specify connection timeout in milliseconds (default: 5000)") + "\n";
     strUsage += "  -proxy=<ip:port>       " + _("Connect through SOCKS5 proxy") + "\n";
     strUsage += "  -tor=<ip:port>         " + _("Use proxy to reach tor hidden services (default: same as -proxy)") + "\n";
@@ -191,6 +205,7 @@ std::string HelpMessage()
     strUsage += "  -bantime=<n>           " + _("Number of seconds to keep misbehaving peers from reconnecting (default: 86400)") + "\n";
     strUsage += "  -maxreceivebuffer=<n>  " + _("Maximum per-connection receive buffer, <n>*1000 bytes (default: 5000)") + "\n";
     strUsage += "  -maxsendbuffer=<n>     " + _("Maximum per-connection send buffer, <n>*1000 bytes (default: 1000)") + "\n";
+    strUsage += "  -msghandthreads=<n>    " + strprintf(_("Number of threads to process peer messages (up to %d, default: %d)"), MAX_MSGHAND_THREADS, DEFAULT_MSGHAND_THREADS) + "\n";
 #ifdef USE_UPNP
 #if USE_UPNP
     strUsage += "  -upnp                  " + _("Use UPnP to map the listening port (default: 1 when listening)") + "\n";
@@ -249,6 +264,15 @@ std::string HelpMessage()
     strUsage += "  -checklevel=<n>        " + _("How thorough the block verification is (0-6, default: 1)") + "\n";
     strUsage += "  -loadblock=<file>      " + _("Imports blocks from external blk000?.dat file") + "\n";
     strUsage += "  -maxorphanblocks=<n>   " + strprintf(_("Keep at most <n> unconnectable blocks in memory (default: %u)"), DEFAULT_MAX_ORPHAN_BLOCKS) + "\n";
+    strUsage += "  -maxorphanblocksmb=<n> " + strprintf(_("Keep at most <n> megabytes of unconnectable blocks in memory (default: %u)"), DEFAULT_MAX_ORPHAN_BLOCKS_SIZE) + "\n";
+    strUsage += "  -orphanspillmb=<n>     " + strprintf(_("Move up to <n> megabytes of unconnectable blocks over the memory limit to a temporary file (default: %u)"), DEFAULT_ORPHAN_SPILL_SIZE) + "\n";
+    strUsage += "  -maxmempool=<n>        " + strprintf(_("Keep the transaction memory pool below <n> megabytes (default: %u)"), DEFAULT_MAX_MEMPOOL_SIZE) + "\n";
+    strUsage += "  -mempoolexpiry=<n>     " + strprintf(_("Do not keep transactions in the memory pool longer than <n> hours (default: %u)"), DEFAULT_MEMPOOL_EXPIRY) + "\n";
+    strUsage += "  -headersfirst          " + strprintf(_("Download and check block headers before the blocks during the initial sync (default: %u)"), DEFAULT_HEADERS_FIRST) + "\n";
+    strUsage += "  -par=<n>               " + strprintf(_("Set the number of script verification threads (up to %d, 0 = auto, <0 = leave that many cores free, default: %d)"), MAX_SCRIPTCHECK_THREADS, DEFAULT_SCRIPTCHECK_THREADS) + "\n";
+#ifdef ENABLE_WALLET
+    strUsage += "  -stakethreads=<n>      " + strprintf(_("Set the number of threads searching for stake kernels (up to %d, 0 = auto, <0 = leave that many cores free, default: %d)"), MAX_STAKE_THREADS, DEFAULT_STAKE_THREADS) + "\n";
+#endif
 
     strUsage += "\n" + _("Block creation options:") + "\n";
     strUsage += "  -blockminsize=<n>      "   + _("Set minimum block size in bytes (default: 0)") + "\n";
@@ -330,6 +354,7 @@ bool AppInit2(boost::thread_group& threadGroup)
 
     nNodeLifespan = GetArg("-addrlifespan", 7);
     fUseFastIndex = GetBoolArg("-fastindex", true);
+    fHeadersFirst = GetBoolArg("-headersfirst", DEFAULT_HEADERS_FIRST);
     nMinerSleep = GetArg("-minersleep", 500);
 
     CheckpointsMode = Checkpoints::STRICT;
@@ -441,8 +466,42 @@ bool AppInit2(boost::thread_group& threadGroup)
 #endif
 
     fConfChange = GetBoolArg("-confchange", false);
+    nBlockCacheSize = (unsigned int)std::min((int64_t)MAX_BLOCK_CACHE_SIZE, std::max((int64_t)0, GetArg("-blockcachesize", DEFAULT_BLOCK_CACHE_SIZE)));
+    nCoinsCacheSize = (uint64_t)std::max((int64_t)0, GetArg("-coinscachesize", DEFAULT_COINS_CACHE_SIZE)) << 20;
+    nMaxOrphanBlocksSize = (uint64_t)std::max((int64_t)0, GetArg("-maxorphanblocksmb", DEFAULT_MAX_ORPHAN_BLOCKS_SIZE)) << 20;
+    nMaxOrphanSpillSize = (uint64_t)std::max((int64_t)0, GetArg("-orphanspillmb", DEFAULT_ORPHAN_SPILL_SIZE)) << 20;
+    nMaxMempoolSize = (uint64_t)std::max((int64_t)0, GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE)) << 20;
+    nMempoolExpiry = std::max((int64_t)1, GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY)) * 60 * 60;
+    // -maxsigcachesize used to count entries, convert it for old configurations
+    int64_t nSigCacheSize = DEFAULT_MAX_SIG_CACHE_SIZE;
+    if (mapArgs.count("-sigcachemb"))
+        nSigCacheSize = GetArg("-sigcachemb", DEFAULT_MAX_SIG_CACHE_SIZE);
+    else if (mapArgs.count("-maxsigcachesize"))
+    {
+        int64_t nEntries = std::max((int64_t)0, std::min(((int64_t)MAX_SIG_CACHE_SIZE << 20) / (int64_t)sizeof(uint256), GetArg("-maxsigcachesize", 0)));
+        nSigCacheSize = nEntries > 0 ? ((nEntries * (int64_t)sizeof(uint256)) >> 20) + 1 : 0;
+        InitWarning(strprintf(_("Warning: -maxsigcachesize is deprecated, using -sigcachemb=%d"), nSigCacheSize));
+    }
+    InitSignatureCache(std::max((int64_t)0, std::min((int64_t)MAX_SIG_CACHE_SIZE, nSigCacheSize)));
+
+    // -par=0 means autodetect, but nScriptCheckThreads==0 means no concurrency
+    nScriptCheckThreads = GetArg("-par", DEFAULT_SCRIPTCHECK_THREADS);
+    if (nScriptCheckThreads <= 0)
+        nScriptCheckThreads += boost::thread::hardware_concurrency();
+    if (nScriptCheckThreads <= 1)
+        nScriptCheckThreads = 0;
+    else if (nScriptCheckThreads > MAX_SCRIPTCHECK_THREADS)
+        nScriptCheckThreads = MAX_SCRIPTCHECK_THREADS;
 
 #ifdef ENABLE_WALLET
+    nStakeThreads = GetArg("-stakethreads", DEFAULT_STAKE_THREADS);
+    if (nStakeThreads <= 0)
+        nStakeThreads += boost::thread::hardware_concurrency();
+    if (nStakeThreads < 1)
+        nStakeThreads = 1;
+    else if (nStakeThreads > MAX_STAKE_THREADS)
+        nStakeThreads = MAX_STAKE_THREADS;
+
     if (mapArgs.count("-mininput"))
     {
         if (!ParseMoney(mapArgs["-mininput"], nMinimumInputValue))
@@ -486,6 +545,12 @@ bool AppInit2(boost::thread_group& threadGroup)
     if (fDaemon)
         fprintf(stdout, "Inception server starting\n");
 
+    if (nScriptCheckThreads) {
+        LogPrintf("Using %u threads for script verification\n", nScriptCheckThreads);
+        for (int i=0; i<nScriptCheckThreads-1; i++)
+            threadGroup.create_thread(&ThreadScriptCheck);
+    }
+
     int64_t nStart;
 
     // ********************************************************* Step 5: verify database integrity
@@ -783,10 +848,14 @@ bool AppInit2(boost::thread_group& threadGroup)
             uiInterface.InitMessage(_("Rescanning..."));
             LogPrintf("Rescanning last %i blocks (from block %i)...\n", pindexBest->nHeight - pindexRescan->nHeight, pindexRescan->nHeight);
             nStart = GetTimeMillis();
-            pwalletMain->ScanForWalletTransactions(pindexRescan, true);
+            bool fRescanned = pwalletMain->ScanForWalletTransactions(pindexRescan, true, true) >= 0;
             LogPrintf(" rescan      %15dms\n", GetTimeMillis() - nStart);
-            pwalletMain->SetBestChain(CBlockLocator(pindexBest));
-            nWalletDBUpdated++;
+            // A rescan cut short by shutdown has to run again next time
+            if (fRescanned)
+            {
+                pwalletMain->SetBestChain(CBlockLocator(pindexBest));
+                nWalletDBUpdated++;
+            }
         }
     } // (!fDisableWallet)
 #else // ENABLE_WALLET
@@ -849,7 +918,15 @@ bool AppInit2(boost::thread_group& threadGroup)
     if (!GetBoolArg("-staking", true))
         LogPrintf("Staking disabled\n");
     else if (pwalletMain)
+    {
+        if (nStakeThreads > 1)
+        {
+            LogPrintf("Using %u threads for stake kernel search\n", nStakeThreads);
+            for (int i=0; i<nStakeThreads-1; i++)
+                threadGroup.create_thread(&ThreadStakeSearch);
+        }
         threadGroup.create_thread(boost::bind(&ThreadStakeMiner, pwalletMain));
+    }
 #endif
 
     // ********************************************************* Step 12: finished
@@ -6,6 +6,8 @@
 
 #include <boost/assign/list_of.hpp>
 
+#include "arith_uint256.h"
+#include "checkqueue.h"
 #include "kernel.h"
 #include "txdb.h"
 
@@ -209,6 +211,29 @@ bool ComputeNextStakeModifier(const CBlockIndex* pindexPrev, uint64_t& nStakeMod
 //   quantities so as to generate blocks faster, degrading the system back into
 //   a proof-of-work situation.
 //
+
+bool GetStakeTarget(unsigned int nBits, int64_t nValue, arith_uint256& bnTargetRet, bool& fAnyHashRet)
+{
+    bool fNegative;
+    bool fOverflow;
+    arith_uint256 bnTargetPerCoin;
+    bnTargetPerCoin.SetCompact(nBits, &fNegative, &fOverflow);
+    arith_uint256 bnValue = nValue < 0 ? (uint64_t)0 - (uint64_t)nValue : (uint64_t)nValue;
+
+    bnTargetRet = bnTargetPerCoin * bnValue;
+    fAnyHashRet = false;
+    if (bnValue == 0 || (bnTargetPerCoin == 0 && !fOverflow))
+        return true;
+    if (fNegative != (nValue < 0))
+        return false;
+
+    // Operands with more than 257 bits between them always overflow, with
+    // exactly 257 bits the product may or may not fit
+    unsigned int nProductBits = bnTargetPerCoin.bits() + bnValue.bits();
+    fAnyHashRet = fOverflow || nProductBits > 257 || (nProductBits == 257 && bnTargetRet / bnValue != bnTargetPerCoin);
+    return true;
+}
+
 bool CheckStakeKernelHash(CBlockIndex* pindexPrev, unsigned int nBits, const CBlock& blockFrom, unsigned int nTxPrevOffset, const CTransaction& txPrev, const COutPoint& prevout, unsigned int nTimeTx, uint256& hashProofOfStake, uint256& targetProofOfStake, bool fPrintProofOfStake)
 {
     unsigned int nTimeBlockFrom = blockFrom.GetBlockTime();
@@ -219,16 +244,13 @@ bool CheckStakeKernelHash(CBlockIndex* pindexPrev, unsigned int nBits, const CBl
     if (nTimeBlockFrom + Params().StakeMinAge() > nTimeTx) // Min age requirement
         return error("CheckStakeKernelHash() : min age violation");
 
-    // Base target
-    CBigNum bnTarget;
-    bnTarget.SetCompact(nBits);
-
     // Weighted target
     int64_t nValueIn = txPrev.vout[prevout.n].nValue;
-    CBigNum bnWeight = CBigNum(nValueIn);
-    bnTarget *= bnWeight;
+    arith_uint256 bnTarget;
+    bool fAnyHash;
+    bool fTargetValid = GetStakeTarget(nBits, nValueIn, bnTarget, fAnyHash);
 
-    targetProofOfStake = bnTarget.getuint256();
+    targetProofOfStake = ArithToUint256(bnTarget);
 
     uint64_t nStakeModifier = pindexPrev->nStakeModifier;
     int nStakeModifierHeight = pindexPrev->nHeight;
@@ -252,7 +274,7 @@ bool CheckStakeKernelHash(CBlockIndex* pindexPrev, unsigned int nBits, const CBl
     }
 
     // Now check if proof-of-stake hash meets target protocol
-    if (CBigNum(hashProofOfStake) > bnTarget)
+    if (!fTargetValid || (!fAnyHash && UintToArith256(hashProofOfStake) > bnTarget))
         return false;
 
     if (fDebug && !fPrintProofOfStake)
@@ -330,3 +352,193 @@ bool CheckKernel(CBlockIndex* pindexPrev, unsigned int nBits, int64_t nTime, con
 
     return CheckStakeKernelHash(pindexPrev, nBits, block, txindex.pos.nTxPos - txindex.pos.nBlockPos, txPrev, prevout, nTime, hashProofOfStake, targetProofOfStake);
 }
+
+bool GetStakeCandidate(CTxDB& txdb, const COutPoint& prevout, CStakeCandidate& candidateRet)
+{
+    CTransaction txPrev;
+    CTxIndex txindex;
+    if (!txPrev.ReadFromDisk(txdb, prevout, txindex))
+        return false;
+
+    // Read block header
+    CBlock block;
+    if (!block.ReadFromDisk(txindex.pos.nFile, txindex.pos.nBlockPos, false))
+        return false;
+    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(block.GetHash());
+    if (mi == mapBlockIndex.end())
+        return false;
+
+    candidateRet.prevout = prevout;
+    candidateRet.nValue = txPrev.vout[prevout.n].nValue;
+    candidateRet.nTimeBlockFrom = block.GetBlockTime();
+    candidateRet.nTimeTxPrev = txPrev.nTime;
+    candidateRet.pindexFrom = mi->second;
+    return true;
+}
+
+namespace {
+
+// State of one SearchStakeKernel() call shared by the stake threads
+struct CStakeSearch
+{
+    CBlockIndex* pindexPrev;
+    unsigned int nBits;
+    const std::vector<CStakeCandidate>* pvCandidates;
+    unsigned int nTime;
+    unsigned int nSearchInterval;
+
+    boost::mutex mutex;
+    bool fFound;
+    unsigned int nCandidate;
+    unsigned int nTimeTx;
+
+    bool IsDone()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        return fFound || boost::this_thread::interruption_requested();
+    }
+};
+
+}
+
+// Search candidates [nBegin, nEnd); psearch is polled to stop early when searching in parallel
+static bool SearchStakeKernelRange(CBlockIndex* pindexPrev, unsigned int nBits, const std::vector<CStakeCandidate>& vCandidates,
+                                   unsigned int nBegin, unsigned int nEnd, unsigned int nTime, unsigned int nSearchInterval,
+                                   CStakeSearch* psearch, unsigned int& nCandidateRet, unsigned int& nTimeTxRet)
+{
+    // The kernel as serialized by CheckStakeKernelHash():
+    // nStakeModifier, nTimeBlockFrom, txPrev.nTime, prevout.hash, prevout.n, nTimeTx
+    unsigned char pchKernel[8 + 4 + 4 + 32 + 4 + 4];
+    uint64_t nStakeModifier = pindexPrev->nStakeModifier;
+    memcpy(&pchKernel[0], &nStakeModifier, 8);
+
+    for (unsigned int i = nBegin; i < nEnd && pindexPrev == pindexBest; i++)
+    {
+        if (psearch == NULL)
+            boost::this_thread::interruption_point();
+        else if (psearch->IsDone())
+            return false;
+        const CStakeCandidate& candidate = vCandidates[i];
+
+        // Weighted target, fixed for all timestamps of this coin
+        arith_uint256 bnTarget;
+        bool fAnyHash;
+        if (!GetStakeTarget(nBits, candidate.nValue, bnTarget, fAnyHash))
+            continue;
+
+        memcpy(&pchKernel[8], &candidate.nTimeBlockFrom, 4);
+        memcpy(&pchKernel[12], &candidate.nTimeTxPrev, 4);
+        memcpy(&pchKernel[16], candidate.prevout.hash.begin(), 32);
+        memcpy(&pchKernel[48], &candidate.prevout.n, 4);
+
+        for (unsigned int n = 0; n < nSearchInterval; n++)
+        {
+            unsigned int nTimeTx = nTime - n;
+
+            // Searching backward in time, these only get worse
+            if ((int64_t)candidate.nTimeBlockFrom + Params().StakeMinAge() > (int64_t)nTimeTx)
+                break;
+            if (nTimeTx < candidate.nTimeTxPrev)
+                break;
+
+            memcpy(&pchKernel[52], &nTimeTx, 4);
+            uint256 hashProofOfStake = Hash(&pchKernel[0], &pchKernel[0] + sizeof(pchKernel));
+            if (fAnyHash || UintToArith256(hashProofOfStake) <= bnTarget)
+            {
+                LogPrint("coinstake", "SearchStakeKernel() : kernel %s:%u hashProof=%s nTimeTx=%u\n",
+                    candidate.prevout.hash.ToString(), candidate.prevout.n, hashProofOfStake.ToString(), nTimeTx);
+                nCandidateRet = i;
+                nTimeTxRet = nTimeTx;
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+namespace {
+
+// Searches a slice of the candidates of a CStakeSearch. Returns false once a kernel
+// has been found, which makes the check queue drop all remaining slices.
+class CStakeSearchCheck
+{
+private:
+    CStakeSearch* psearch;
+    unsigned int nBegin;
+    unsigned int nEnd;
+
+public:
+    CStakeSearchCheck() : psearch(NULL), nBegin(0), nEnd(0) {}
+    CStakeSearchCheck(CStakeSearch* psearchIn, unsigned int nBeginIn, unsigned int nEndIn) :
+        psearch(psearchIn), nBegin(nBeginIn), nEnd(nEndIn) {}
+
+    bool operator()()
+    {
+        unsigned int nCandidate, nTimeTx;
+        if (!SearchStakeKernelRange(psearch->pindexPrev, psearch->nBits, *psearch->pvCandidates, nBegin, nEnd,
+                                    psearch->nTime, psearch->nSearchInterval, psearch, nCandidate, nTimeTx))
+            return true;
+
+        boost::unique_lock<boost::mutex> lock(psearch->mutex);
+        if (!psearch->fFound)
+        {
+            psearch->fFound = true;
+            psearch->nCandidate = nCandidate;
+            psearch->nTimeTx = nTimeTx;
+        }
+        return false;
+    }
+
+    void swap(CStakeSearchCheck& check)
+    {
+        std::swap(psearch, check.psearch);
+        std::swap(nBegin, check.nBegin);
+        std::swap(nEnd, check.nEnd);
+    }
+};
+
+}
+
+int nStakeThreads = DEFAULT_STAKE_THREADS;
+static CCheckQueue<CStakeSearchCheck> stakesearchqueue(1);
+
+void ThreadStakeSearch()
+{
+    SetThreadPriority(THREAD_PRIORITY_LOWEST);
+    RenameThread("inception-stake");
+    stakesearchqueue.Thread();
+}
+
+bool SearchStakeKernel(CBlockIndex* pindexPrev, unsigned int nBits, const std::vector<CStakeCandidate>& vCandidates,
+                       unsigned int nTime, unsigned int nSearchInterval, unsigned int& nCandidateRet, unsigned int& nTimeTxRet)
+{
+    if (nStakeThreads <= 1 || vCandidates.size() < 2)
+        return SearchStakeKernelRange(pindexPrev, nBits, vCandidates, 0, vCandidates.size(), nTime, nSearchInterval, NULL, nCandidateRet, nTimeTxRet);
+
+    CStakeSearch search;
+    search.pindexPrev = pindexPrev;
+    search.nBits = nBits;
+    search.pvCandidates = &vCandidates;
+    search.nTime = nTime;
+    search.nSearchInterval = nSearchInterval;
+    search.fFound = false;
+
+    // Several slices per thread so the threads finish at about the same time
+    unsigned int nSlice = std::max(1U, (unsigned int)vCandidates.size() / (nStakeThreads * 4));
+    std::vector<CStakeSearchCheck> vChecks;
+    for (unsigned int i = 0; i < vCandidates.size(); i += nSlice)
+        vChecks.push_back(CStakeSearchCheck(&search, i, std::min(i + nSlice, (unsigned int)vCandidates.size())));
+    {
+        CCheckQueueControl<CStakeSearchCheck> control(&stakesearchqueue);
+        control.Add(vChecks);
+        control.Wait();
+    }
+    boost::this_thread::interruption_point();
+
+    if (!search.fFound)
+        return false;
+    nCandidateRet = search.nCandidate;
+    nTimeTxRet = search.nTimeTx;
+    return true;
+}
@@ -4,8 +4,16 @@
 #ifndef COIN_KERNEL_H
 #define COIN_KERNEL_H
 
+#include "arith_uint256.h"
 #include "main.h"
 
+// Maximum number of threads searching for stake kernels
+static const int MAX_STAKE_THREADS = 16;
+// -stakethreads default (1 = search in the staking thread only)
+static const int DEFAULT_STAKE_THREADS = 1;
+
+extern int nStakeThreads;
+
 // To decrease granularity of timestamp
 // Supposed to be 2^n-1
 static const int STAKE_TIMESTAMP_MASK = 15;
@@ -17,6 +25,11 @@ static const int MODIFIER_INTERVAL_RATIO = 3;
 // Compute the hash modifier for proof-of-stake
 bool ComputeNextStakeModifier(const CBlockIndex* pindexPrev, uint64_t& nStakeModifier, bool& fGeneratedStakeModifier);
 
+// Weighted target: the nBits target times the staked value, as CBigNum computed it.
+// Returns false if the target is negative, so no hash meets it. fAnyHashRet is set
+// if the target does not fit in 256 bits, so every hash meets it.
+bool GetStakeTarget(unsigned int nBits, int64_t nValue, arith_uint256& bnTargetRet, bool& fAnyHashRet);
+
 // Check whether stake kernel meets hash target
 // Sets hashProofOfStake on success return
 bool CheckStakeKernelHash(CBlockIndex* pindexPrev, unsigned int nBits, const CBlock& blockFrom, unsigned int nTxPrevOffset, const CTransaction& txPrev, const COutPoint& prevout, unsigned int nTimeTx, uint256& hashProofOfStake, uint256& targetProofOfStake, bool fPrintProofOfStake=false);
@@ -36,4 +49,29 @@ int64_t GetWeight(int64_t nIntervalBeginning, int64_t nIntervalEnd);
 // Convenient for searching a kernel
 bool CheckKernel(CBlockIndex* pindexPrev, unsigned int nBits, int64_t nTime, const COutPoint& prevout, int64_t* pBlockTime = NULL);
 
+// Kernel inputs of a stakeable output that do not change while the block
+// containing it (pindexFrom) stays in the main chain
+struct CStakeCandidate
+{
+    COutPoint prevout;
+    int64_t nValue;
+    unsigned int nTimeBlockFrom;
+    unsigned int nTimeTxPrev;
+    const CBlockIndex* pindexFrom;
+};
+
+// Read the kernel inputs of prevout from disk
+bool GetStakeCandidate(CTxDB& txdb, const COutPoint& prevout, CStakeCandidate& candidateRet);
+
+// Search vCandidates for a kernel meeting the hash target at timestamps
+// nTime, nTime - 1, ..., nTime - nSearchInterval + 1
+// With one stake thread this returns the first kernel in coin and timestamp order,
+// otherwise the candidates are split across the stake threads and the first kernel
+// found by any of them is returned
+bool SearchStakeKernel(CBlockIndex* pindexPrev, unsigned int nBits, const std::vector<CStakeCandidate>& vCandidates,
+                       unsigned int nTime, unsigned int nSearchInterval, unsigned int& nCandidateRet, unsigned int& nTimeTxRet);
+
+// Worker thread for SearchStakeKernel
+void ThreadStakeSearch();
+
 #endif // COIN_KERNEL_H
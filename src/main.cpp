@@ -10,6 +10,7 @@
 #include "alert.h"
 #include "chainparams.h"
 #include "checkpoints.h"
+#include "checkqueue.h"
 #include "db.h"
 #include "init.h"
 #include "kernel.h"
@@ -52,16 +53,28 @@ int64_t nTimeBestReceived = 0;
 bool fImporting = false;
 bool fReindex = false;
 bool fHaveGUI = false;
+int nScriptCheckThreads = 0;
 
 struct COrphanBlock {
     uint256 hashBlock;
     uint256 hashPrev;
+    // first block of the orphan chain when last looked up, may be stale
+    mutable uint256 hashRoot;
     std::pair<COutPoint, unsigned int> stake;
+    unsigned int nTime;
+    unsigned int nSize;
+    // serialized block, empty if it was moved to the spill file at nSpillPos
     vector<unsigned char> vchBlock;
+    bool fSpilled;
+    uint64_t nSpillPos;
 };
 map<uint256, COrphanBlock*> mapOrphanBlocks;
 multimap<uint256, COrphanBlock*> mapOrphanBlocksByPrev;
 set<pair<COutPoint, unsigned int> > setStakeSeenOrphan;
+uint64_t nMaxOrphanBlocksSize = (uint64_t)DEFAULT_MAX_ORPHAN_BLOCKS_SIZE << 20;
+uint64_t nMaxOrphanSpillSize = (uint64_t)DEFAULT_ORPHAN_SPILL_SIZE << 20;
+uint64_t nMaxMempoolSize = (uint64_t)DEFAULT_MAX_MEMPOOL_SIZE << 20;
+int64_t nMempoolExpiry = DEFAULT_MEMPOOL_EXPIRY * 60 * 60;
 
 map<uint256, CTransaction> mapOrphanTransactions;
 map<uint256, set<uint256> > mapOrphanTransactionsByPrev;
@@ -578,6 +591,10 @@ int64_t GetMinFee(const CTransaction& tx, unsigned int nBlockSize, enum GetMinFe
     // Base fee is either MIN_TX_FEE or MIN_RELAY_TX_FEE
     int64_t nBaseFee = (mode == GMF_RELAY) ? MIN_RELAY_TX_FEE : MIN_TX_FEE;
 
+    // A full memory pool raises the relay fee above what it last evicted
+    if (mode == GMF_RELAY)
+        nBaseFee = std::max(nBaseFee, mempool.GetMinFee(nMaxMempoolSize));
+
     unsigned int nNewBlockSize = nBlockSize + nBytes;
     int64_t nMinFee = (1 + (int64_t)nBytes / 1000) * nBaseFee;
 
@@ -638,6 +655,7 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CTransaction &tx, bool fLimitFree,
     }
     }
 
+    CTxMemPoolEntry entry;
     {
         CTxDB txdb("r");
 
@@ -726,10 +744,38 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CTransaction &tx, bool fLimitFree,
         {
             return error("AcceptToMemoryPool: : BUG! PLEASE REPORT THIS! ConnectInputs failed against MANDATORY but not STANDARD flags %s", hash.ToString());
         }
+
+        // Measure the priority once here so block creation doesn't have
+        // to read the inputs back; inputs still in the pool count nothing
+        double dPriority = 0;
+        int64_t nValueInChain = 0;
+        BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        {
+            if (pool.exists(txin.prevout.hash))
+                continue;
+            const CTxIndex& txindex = mapInputs[txin.prevout.hash].first;
+            int64_t nValueIn = mapInputs[txin.prevout.hash].second.vout[txin.prevout.n].nValue;
+            dPriority += (double)nValueIn * txindex.GetDepthInMainChain();
+            nValueInChain += nValueIn;
+        }
+        dPriority /= nSize;
+
+        entry = CTxMemPoolEntry(tx, nFees, GetTime(), nBestHeight, dPriority, nValueInChain);
     }
 
     // Store transaction in memory
-    pool.addUnchecked(hash, tx);
+    pool.addUnchecked(hash, entry);
+
+    // Keep the pool within -maxmempool: drop stale transactions, then the cheapest
+    unsigned int nExpired = pool.Expire(GetTime() - nMempoolExpiry);
+    if (nExpired > 0)
+        LogPrint("mempool", "AcceptToMemoryPool : expired %u transactions\n", nExpired);
+    unsigned int nEvicted = pool.TrimToSize(nMaxMempoolSize);
+    if (nEvicted > 0)
+        LogPrint("mempool", "AcceptToMemoryPool : evicted %u transactions, min fee now %d per kB\n",
+                 nEvicted, pool.GetMinFee(nMaxMempoolSize));
+    if (!pool.exists(hash))
+        return error("AcceptToMemoryPool : mempool full, %s not kept", hash.ToString());
 
     SyncWithWallets(tx, NULL);
 
@@ -902,54 +948,297 @@ bool CBlock::ReadFromDisk(const CBlockIndex* pindex, bool fReadTransactions)
     return true;
 }
 
+//
+// Orphan blocks
+//
+// Orphans are kept serialized, within a count limit (-maxorphanblocks) and a
+// memory budget (-maxorphanblocksmb). Over budget, the orphans whose time is
+// farthest from the best block are moved to a temporary file while
+// -orphanspillmb allows, and dropped after that. All of it is protected by
+// cs_main.
+//
+
+namespace {
+
+// orphans by block time, all of them and the ones held in memory
+set<pair<unsigned int, COrphanBlock*> > setOrphanBlocksByTime;
+set<pair<unsigned int, COrphanBlock*> > setOrphanBlocksInMemory;
+uint64_t nOrphanBlocksBytes = 0;
+unsigned int nOrphanBlocksSpilled = 0;
+uint64_t nOrphanBlocksSpilledBytes = 0;
+uint64_t nOrphanBlocksEvicted = 0;
+
+FILE* fileOrphanSpill = NULL;
+uint64_t nOrphanSpillEnd = 0;
+
+} // anon namespace
+
+static boost::filesystem::path OrphanSpillPath()
+{
+    return GetDataDir() / "orphanblocks.tmp";
+}
+
+// Find the first block of the orphan chain. The root found last time is
+// cached, so only orphans that arrived below it have to be walked.
+static const COrphanBlock* GetOrphanRootBlock(const COrphanBlock* pblockOrphan)
+{
+    map<uint256, COrphanBlock*>::iterator it = mapOrphanBlocks.find(pblockOrphan->hashRoot);
+    const COrphanBlock* proot = (it != mapOrphanBlocks.end()) ? it->second : pblockOrphan;
+    while ((it = mapOrphanBlocks.find(proot->hashPrev)) != mapOrphanBlocks.end())
+    {
+        map<uint256, COrphanBlock*>::iterator it2 = mapOrphanBlocks.find(it->second->hashRoot);
+        proot = (it2 != mapOrphanBlocks.end()) ? it2->second : it->second;
+    }
+    pblockOrphan->hashRoot = proot->hashBlock;
+    return proot;
+}
+
 uint256 static GetOrphanRoot(const uint256& hash)
 {
     map<uint256, COrphanBlock*>::iterator it = mapOrphanBlocks.find(hash);
     if (it == mapOrphanBlocks.end())
         return hash;
-
-    // Work back to the first block in the orphan chain
-    do {
-        map<uint256, COrphanBlock*>::iterator it2 = mapOrphanBlocks.find(it->second->hashPrev);
-        if (it2 == mapOrphanBlocks.end())
-            return it->first;
-        it = it2;
-    } while(true);
+    return GetOrphanRootBlock(it->second)->hashBlock;
 }
 
 // ppcoin: find block wanted by given orphan block
 uint256 WantedByOrphan(const COrphanBlock* pblockOrphan)
 {
-    // Work back to the first block in the orphan chain
-    while (mapOrphanBlocks.count(pblockOrphan->hashPrev))
-        pblockOrphan = mapOrphanBlocks[pblockOrphan->hashPrev];
-    return pblockOrphan->hashPrev;
+    return GetOrphanRootBlock(pblockOrphan)->hashPrev;
 }
 
-// Remove a random orphan block (which does not have any dependent orphans).
-void static PruneOrphanBlocks()
+static bool ReadOrphanBlock(const COrphanBlock* pblockOrphan, CBlock& block)
 {
-    if (mapOrphanBlocksByPrev.size() <= (size_t)std::max((int64_t)0, GetArg("-maxorphanblocks", DEFAULT_MAX_ORPHAN_BLOCKS)))
-        return;
+    try {
+        if (!pblockOrphan->fSpilled)
+        {
+            CDataStream ss(pblockOrphan->vchBlock, SER_DISK, CLIENT_VERSION);
+            ss >> block;
+            return true;
+        }
 
-    // Pick a random orphan block.
-    int pos = insecure_rand() % mapOrphanBlocksByPrev.size();
-    std::multimap<uint256, COrphanBlock*>::iterator it = mapOrphanBlocksByPrev.begin();
-    while (pos--) it++;
+        vector<char> vchData(pblockOrphan->nSize);
+        if (!fileOrphanSpill || fseek(fileOrphanSpill, pblockOrphan->nSpillPos, SEEK_SET) != 0 ||
+            fread(&vchData[0], 1, vchData.size(), fileOrphanSpill) != vchData.size())
+            return error("ReadOrphanBlock() : failed to read %s from spill file", pblockOrphan->hashBlock.ToString());
+        CDataStream ss(vchData, SER_DISK, CLIENT_VERSION);
+        ss >> block;
+    }
+    catch (std::exception &e) {
+        return error("ReadOrphanBlock() : deserialize error for %s", pblockOrphan->hashBlock.ToString());
+    }
+    return true;
+}
 
-    // As long as this block has other orphans depending on it, move to one of those successors.
-    do {
-        std::multimap<uint256, COrphanBlock*>::iterator it2 = mapOrphanBlocksByPrev.find(it->second->hashBlock);
-        if (it2 == mapOrphanBlocksByPrev.end())
+static void EraseOrphanBlock(COrphanBlock* pblockOrphan)
+{
+    mapOrphanBlocks.erase(pblockOrphan->hashBlock);
+    multimap<uint256, COrphanBlock*>::iterator it = mapOrphanBlocksByPrev.lower_bound(pblockOrphan->hashPrev);
+    while (it != mapOrphanBlocksByPrev.end() && it->first == pblockOrphan->hashPrev)
+    {
+        if (it->second == pblockOrphan)
+        {
+            mapOrphanBlocksByPrev.erase(it);
             break;
-        it = it2;
-    } while(1);
+        }
+        ++it;
+    }
+    setOrphanBlocksByTime.erase(make_pair(pblockOrphan->nTime, pblockOrphan));
+    setStakeSeenOrphan.erase(pblockOrphan->stake);
+    if (pblockOrphan->fSpilled)
+    {
+        nOrphanBlocksSpilled--;
+        nOrphanBlocksSpilledBytes -= pblockOrphan->nSize;
+        // Start the spill file over once it holds nothing
+        if (nOrphanBlocksSpilled == 0 && fileOrphanSpill)
+        {
+            fclose(fileOrphanSpill);
+            fileOrphanSpill = NULL;
+            nOrphanSpillEnd = 0;
+            boost::filesystem::remove(OrphanSpillPath());
+        }
+    }
+    else
+    {
+        setOrphanBlocksInMemory.erase(make_pair(pblockOrphan->nTime, pblockOrphan));
+        nOrphanBlocksBytes -= pblockOrphan->nSize;
+    }
+    delete pblockOrphan;
+}
+
+// Move the spilled orphans down over the space left by erased ones and cut
+// the file to what they use. An orphan that can't be moved is dropped.
+static void CompactOrphanSpill()
+{
+    vector<pair<uint64_t, COrphanBlock*> > vSpilled;
+    for (set<pair<unsigned int, COrphanBlock*> >::iterator it = setOrphanBlocksByTime.begin(); it != setOrphanBlocksByTime.end(); ++it)
+        if (it->second->fSpilled)
+            vSpilled.push_back(make_pair(it->second->nSpillPos, it->second));
+    sort(vSpilled.begin(), vSpilled.end());
+
+    // Each orphan only moves towards the start of the file, so the ones
+    // after it are read before they can be overwritten
+    uint64_t nEnd = 0;
+    vector<unsigned char> vchData;
+    for (unsigned int i = 0; i < vSpilled.size(); i++)
+    {
+        COrphanBlock* pblockOrphan = vSpilled[i].second;
+        if (pblockOrphan->nSpillPos != nEnd)
+        {
+            vchData.resize(pblockOrphan->nSize);
+            if (!fileOrphanSpill ||
+                fseek(fileOrphanSpill, pblockOrphan->nSpillPos, SEEK_SET) != 0 ||
+                fread(&vchData[0], 1, vchData.size(), fileOrphanSpill) != vchData.size() ||
+                fseek(fileOrphanSpill, nEnd, SEEK_SET) != 0 ||
+                fwrite(&vchData[0], 1, vchData.size(), fileOrphanSpill) != vchData.size())
+            {
+                LogPrintf("CompactOrphanSpill() : dropping %s, failed to move it\n", pblockOrphan->hashBlock.ToString());
+                EraseOrphanBlock(pblockOrphan);
+                nOrphanBlocksEvicted++;
+                continue;
+            }
+            pblockOrphan->nSpillPos = nEnd;
+        }
+        nEnd += pblockOrphan->nSize;
+    }
+
+    LogPrint("orphan", "CompactOrphanSpill() : %u orphans, spill file %u -> %u bytes\n", nOrphanBlocksSpilled, nOrphanSpillEnd, nEnd);
+    nOrphanSpillEnd = nEnd;
+    if (fileOrphanSpill)
+    {
+        fflush(fileOrphanSpill);
+        boost::system::error_code ec;
+        boost::filesystem::resize_file(OrphanSpillPath(), nEnd, ec);
+    }
+}
+
+// Move an orphan's data to the spill file, false if there is no room
+static bool SpillOrphanBlock(COrphanBlock* pblockOrphan)
+{
+    // Compact once erased orphans take up most of the file, or a quarter of
+    // the limit when the file is full, so at most four bytes are copied for
+    // every byte freed
+    uint64_t nDead = nOrphanSpillEnd - nOrphanBlocksSpilledBytes;
+    if (fileOrphanSpill && nDead > 0 &&
+        (nDead > nOrphanBlocksSpilledBytes ||
+         (nOrphanSpillEnd + pblockOrphan->nSize > nMaxOrphanSpillSize && nDead >= nMaxOrphanSpillSize / 4)))
+        CompactOrphanSpill();
+    if (nOrphanSpillEnd + pblockOrphan->nSize > nMaxOrphanSpillSize)
+        return false;
+    if (!fileOrphanSpill)
+    {
+        fileOrphanSpill = fopen(OrphanSpillPath().string().c_str(), "w+b");
+        if (!fileOrphanSpill)
+            return error("SpillOrphanBlock() : cannot open %s", OrphanSpillPath().string());
+        nOrphanSpillEnd = 0;
+    }
+    if (fseek(fileOrphanSpill, nOrphanSpillEnd, SEEK_SET) != 0 ||
+        fwrite(&pblockOrphan->vchBlock[0], 1, pblockOrphan->nSize, fileOrphanSpill) != pblockOrphan->nSize)
+        return error("SpillOrphanBlock() : write failed");
+
+    pblockOrphan->nSpillPos = nOrphanSpillEnd;
+    pblockOrphan->fSpilled = true;
+    vector<unsigned char>().swap(pblockOrphan->vchBlock);
+    nOrphanSpillEnd += pblockOrphan->nSize;
+    setOrphanBlocksInMemory.erase(make_pair(pblockOrphan->nTime, pblockOrphan));
+    nOrphanBlocksBytes -= pblockOrphan->nSize;
+    nOrphanBlocksSpilled++;
+    nOrphanBlocksSpilledBytes += pblockOrphan->nSize;
+    return true;
+}
+
+// The orphan of setOrphans whose time is farthest from the best block
+static COrphanBlock* FarthestOrphanBlock(const set<pair<unsigned int, COrphanBlock*> >& setOrphans)
+{
+    int64_t nTipTime = pindexBest ? pindexBest->GetBlockTime() : 0;
+    const pair<unsigned int, COrphanBlock*>& first = *setOrphans.begin();
+    const pair<unsigned int, COrphanBlock*>& last = *setOrphans.rbegin();
+    return (nTipTime - (int64_t)first.first > (int64_t)last.first - nTipTime) ? first.second : last.second;
+}
+
+// Make room for an orphan of nSize bytes
+void static PruneOrphanBlocks(unsigned int nSize)
+{
+    while (!setOrphanBlocksInMemory.empty() && nOrphanBlocksBytes + nSize > nMaxOrphanBlocksSize)
+    {
+        COrphanBlock* pblockOrphan = FarthestOrphanBlock(setOrphanBlocksInMemory);
+        if (nMaxOrphanSpillSize > 0 && SpillOrphanBlock(pblockOrphan))
+            continue;
+        LogPrint("orphan", "PruneOrphanBlocks() : dropping %s over the memory limit\n", pblockOrphan->hashBlock.ToString());
+        EraseOrphanBlock(pblockOrphan);
+        nOrphanBlocksEvicted++;
+    }
+
+    size_t nMaxBlocks = std::max((int64_t)0, GetArg("-maxorphanblocks", DEFAULT_MAX_ORPHAN_BLOCKS));
+    while (!setOrphanBlocksByTime.empty() && mapOrphanBlocks.size() >= nMaxBlocks)
+    {
+        COrphanBlock* pblockOrphan = FarthestOrphanBlock(setOrphanBlocksByTime);
+        LogPrint("orphan", "PruneOrphanBlocks() : dropping %s over the count limit\n", pblockOrphan->hashBlock.ToString());
+        EraseOrphanBlock(pblockOrphan);
+        nOrphanBlocksEvicted++;
+    }
+}
+
+static COrphanBlock* AddOrphanBlock(const CBlock& block, const uint256& hash)
+{
+    COrphanBlock* pblockOrphan = new COrphanBlock();
+    {
+        CDataStream ss(SER_DISK, CLIENT_VERSION);
+        ss << block;
+        pblockOrphan->vchBlock = std::vector<unsigned char>(ss.begin(), ss.end());
+    }
+    pblockOrphan->nSize = pblockOrphan->vchBlock.size();
+    PruneOrphanBlocks(pblockOrphan->nSize);
+
+    pblockOrphan->hashBlock = hash;
+    pblockOrphan->hashPrev = block.hashPrevBlock;
+    map<uint256, COrphanBlock*>::iterator it = mapOrphanBlocks.find(block.hashPrevBlock);
+    pblockOrphan->hashRoot = (it != mapOrphanBlocks.end()) ? it->second->hashRoot : hash;
+    pblockOrphan->stake = block.GetProofOfStake();
+    pblockOrphan->nTime = block.nTime;
+    pblockOrphan->fSpilled = false;
+    pblockOrphan->nSpillPos = 0;
+    mapOrphanBlocks.insert(make_pair(hash, pblockOrphan));
+    mapOrphanBlocksByPrev.insert(make_pair(pblockOrphan->hashPrev, pblockOrphan));
+    setOrphanBlocksByTime.insert(make_pair(pblockOrphan->nTime, pblockOrphan));
+    setOrphanBlocksInMemory.insert(make_pair(pblockOrphan->nTime, pblockOrphan));
+    nOrphanBlocksBytes += pblockOrphan->nSize;
+    if (block.IsProofOfStake())
+        setStakeSeenOrphan.insert(block.GetProofOfStake());
+    return pblockOrphan;
+}
 
-    setStakeSeenOrphan.erase(it->second->stake);
-    uint256 hash = it->second->hashBlock;
-    delete it->second;
-    mapOrphanBlocksByPrev.erase(it);
-    mapOrphanBlocks.erase(hash);
+void CloseOrphanBlockSpill()
+{
+    LOCK(cs_main);
+    // Erasing the last spilled orphan closes and removes the file
+    vector<COrphanBlock*> vSpilled;
+    for (set<pair<unsigned int, COrphanBlock*> >::iterator it = setOrphanBlocksByTime.begin(); it != setOrphanBlocksByTime.end(); ++it)
+        if (it->second->fSpilled)
+            vSpilled.push_back(it->second);
+    BOOST_FOREACH(COrphanBlock* pblockOrphan, vSpilled)
+        EraseOrphanBlock(pblockOrphan);
+
+    if (fileOrphanSpill)
+    {
+        fclose(fileOrphanSpill);
+        fileOrphanSpill = NULL;
+        nOrphanSpillEnd = 0;
+    }
+    boost::system::error_code ec;
+    boost::filesystem::remove(OrphanSpillPath(), ec);
+}
+
+void GetOrphanBlocksStats(COrphanBlocksStats& stats)
+{
+    LOCK(cs_main);
+    stats.nBlocks = mapOrphanBlocks.size();
+    stats.nBytes = nOrphanBlocksBytes;
+    stats.nMaxBytes = nMaxOrphanBlocksSize;
+    stats.nSpilled = nOrphanBlocksSpilled;
+    stats.nSpilledBytes = nOrphanBlocksSpilledBytes;
+    stats.nMaxSpilledBytes = nMaxOrphanSpillSize;
+    stats.nEvicted = nOrphanBlocksEvicted;
 }
 
 // miner's coin base reward
@@ -1079,6 +1368,110 @@ bool CTransaction::DisconnectInputs(CTxDB& txdb)
 }
 
 
+//
+// Coins cache
+//
+
+// The outputs of recently created or read transactions are kept in memory, keyed
+// by transaction hash and position on disk, so spending them doesn't need a
+// random read from the block files. Entries only describe what is stored at a
+// position, which never changes, so nothing has to be rolled back when a
+// database transaction is aborted or a block is disconnected. Whether an
+// output is spent is still tracked by the CTxIndex in the txdb.
+
+uint64_t nCoinsCacheSize = (uint64_t)DEFAULT_COINS_CACHE_SIZE << 20;
+
+namespace {
+
+struct CCachedCoins
+{
+    CDiskTxPos pos;
+    CCoins coins;
+    size_t nUsage;
+};
+
+typedef list<pair<uint256, CCachedCoins> > CoinsCacheList;
+
+CCriticalSection cs_coinscache;
+// cached outputs, most recently used first
+CoinsCacheList lruCoinsCache;
+map<uint256, CoinsCacheList::iterator> mapCoinsCache;
+uint64_t nCoinsCacheUsage = 0;
+uint64_t nCoinsCacheHits = 0;
+uint64_t nCoinsCacheMisses = 0;
+
+} // anon namespace
+
+static void UncacheCoins(const uint256& hash)
+{
+    LOCK(cs_coinscache);
+    map<uint256, CoinsCacheList::iterator>::iterator mi = mapCoinsCache.find(hash);
+    if (mi == mapCoinsCache.end())
+        return;
+    nCoinsCacheUsage -= mi->second->second.nUsage;
+    lruCoinsCache.erase(mi->second);
+    mapCoinsCache.erase(mi);
+}
+
+static void CacheCoins(const uint256& hash, const CDiskTxPos& pos, const CTransaction& tx)
+{
+    if (nCoinsCacheSize == 0)
+        return;
+    UncacheCoins(hash);
+
+    LOCK(cs_coinscache);
+    lruCoinsCache.push_front(make_pair(hash, CCachedCoins()));
+    CCachedCoins& entry = lruCoinsCache.front().second;
+    entry.pos = pos;
+    entry.coins = CCoins(tx);
+    entry.nUsage = entry.coins.GetMemoryUsage() + sizeof(CCachedCoins) + 64; // plus list and map nodes
+    nCoinsCacheUsage += entry.nUsage;
+    mapCoinsCache[hash] = lruCoinsCache.begin();
+    while (nCoinsCacheUsage > nCoinsCacheSize)
+    {
+        nCoinsCacheUsage -= lruCoinsCache.back().second.nUsage;
+        mapCoinsCache.erase(lruCoinsCache.back().first);
+        lruCoinsCache.pop_back();
+    }
+}
+
+// Get the outputs of the transaction stored at pos, from the cache or from disk
+static bool ReadCoins(const uint256& hash, const CDiskTxPos& pos, CCoins& coinsRet)
+{
+    {
+        LOCK(cs_coinscache);
+        map<uint256, CoinsCacheList::iterator>::iterator mi = mapCoinsCache.find(hash);
+        if (mi != mapCoinsCache.end() && mi->second->second.pos == pos)
+        {
+            nCoinsCacheHits++;
+            lruCoinsCache.splice(lruCoinsCache.begin(), lruCoinsCache, mi->second);
+            coinsRet = mi->second->second.coins;
+            return true;
+        }
+        nCoinsCacheMisses++;
+    }
+
+    CTransaction tx;
+    if (!tx.ReadFromDisk(pos))
+        return false;
+    if (tx.GetHash() != hash)
+        return error("ReadCoins() : %s tx at %s has hash %s", hash.ToString(), pos.ToString(), tx.GetHash().ToString());
+    coinsRet = CCoins(tx);
+    CacheCoins(hash, pos, tx);
+    return true;
+}
+
+void GetCoinsCacheStats(CCoinsCacheStats& stats)
+{
+    LOCK(cs_coinscache);
+    stats.nHits = nCoinsCacheHits;
+    stats.nMisses = nCoinsCacheMisses;
+    stats.nEntries = mapCoinsCache.size();
+    stats.nBytes = nCoinsCacheUsage;
+    stats.nMaxBytes = nCoinsCacheSize;
+}
+
+
 bool CTransaction::FetchInputs(CTxDB& txdb, const map<uint256, CTxIndex>& mapTestPool,
                                bool fBlock, bool fMiner, MapPrevTx& inputsRet, bool& fInvalid)
 {
@@ -1113,21 +1506,23 @@ bool CTransaction::FetchInputs(CTxDB& txdb, const map<uint256, CTxIndex>& mapTes
         if (!fFound && (fBlock || fMiner))
             return fMiner ? false : error("FetchInputs() : %s prev tx %s index entry not found", GetHash().ToString(),  prevout.hash.ToString());
 
-        // Read txPrev
-        CTransaction& txPrev = inputsRet[prevout.hash].second;
+        // Read the outputs of txPrev
+        CCoins& coinsPrev = inputsRet[prevout.hash].second;
         if (!fFound || txindex.pos == CDiskTxPos(1,1,1))
         {
             // Get prev tx from single transactions in memory
+            CTransaction txPrev;
             if (!mempool.lookup(prevout.hash, txPrev))
                 return error("FetchInputs() : %s mempool Tx prev not found %s", GetHash().ToString(),  prevout.hash.ToString());
+            coinsPrev = CCoins(txPrev);
             if (!fFound)
-                txindex.vSpent.resize(txPrev.vout.size());
+                txindex.vSpent.resize(coinsPrev.vout.size());
         }
         else
         {
-            // Get prev tx from disk
-            if (!txPrev.ReadFromDisk(txindex.pos))
-                return error("FetchInputs() : %s ReadFromDisk prev tx %s failed", GetHash().ToString(),  prevout.hash.ToString());
+            // Get prev tx outputs from the coins cache or disk
+            if (!ReadCoins(prevout.hash, txindex.pos, coinsPrev))
+                return error("FetchInputs() : %s ReadCoins prev tx %s failed", GetHash().ToString(),  prevout.hash.ToString());
         }
     }
 
@@ -1137,13 +1532,13 @@ bool CTransaction::FetchInputs(CTxDB& txdb, const map<uint256, CTxIndex>& mapTes
         const COutPoint prevout = vin[i].prevout;
         assert(inputsRet.count(prevout.hash) != 0);
         const CTxIndex& txindex = inputsRet[prevout.hash].first;
-        const CTransaction& txPrev = inputsRet[prevout.hash].second;
-        if (prevout.n >= txPrev.vout.size() || prevout.n >= txindex.vSpent.size())
+        const CCoins& coinsPrev = inputsRet[prevout.hash].second;
+        if (prevout.n >= coinsPrev.vout.size() || prevout.n >= txindex.vSpent.size())
         {
             // Revisit this if/when transaction replacement is implemented and allows
             // adding inputs:
             fInvalid = true;
-            return DoS(100, error("FetchInputs() : %s prevout.n out of range %d %u %u prev tx %s\n%s", GetHash().ToString(), prevout.n, txPrev.vout.size(), txindex.vSpent.size(), prevout.hash.ToString(), txPrev.ToString()));
+            return DoS(100, error("FetchInputs() : %s prevout.n out of range %d %u %u prev tx %s\n%s", GetHash().ToString(), prevout.n, coinsPrev.vout.size(), txindex.vSpent.size(), prevout.hash.ToString(), coinsPrev.ToString()));
         }
     }
 
@@ -1156,11 +1551,11 @@ const CTxOut& CTransaction::GetOutputFor(const CTxIn& input, const MapPrevTx& in
     if (mi == inputs.end())
         throw std::runtime_error("CTransaction::GetOutputFor() : prevout.hash not found");
 
-    const CTransaction& txPrev = (mi->second).second;
-    if (input.prevout.n >= txPrev.vout.size())
+    const CCoins& coinsPrev = (mi->second).second;
+    if (input.prevout.n >= coinsPrev.vout.size())
         throw std::runtime_error("CTransaction::GetOutputFor() : prevout.n out of range");
 
-    return txPrev.vout[input.prevout.n];
+    return coinsPrev.vout[input.prevout.n];
 }
 
 int64_t CTransaction::GetValueIn(const MapPrevTx& inputs) const
@@ -1177,8 +1572,15 @@ int64_t CTransaction::GetValueIn(const MapPrevTx& inputs) const
 
 }
 
+bool CScriptCheck::operator()() const {
+    const CScript &scriptSig = ptxTo->vin[nIn].scriptSig;
+    if (!VerifyScript(scriptSig, scriptPubKey, *ptxTo, nIn, nFlags, nHashType))
+        return error("CScriptCheck() : %s VerifySignature failed", ptxTo->GetHash().ToString());
+    return true;
+}
+
 bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, map<uint256, CTxIndex>& mapTestPool, const CDiskTxPos& posThisTx,
-    const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, unsigned int flags)
+    const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, unsigned int flags, std::vector<CScriptCheck> *pvChecks)
 {
     // Take over previous transactions' spent pointers
     // fBlock is true when this is called from AcceptBlock when a new best-block is added to the blockchain
@@ -1193,24 +1595,24 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, map<uint256, CTx
             COutPoint prevout = vin[i].prevout;
             assert(inputs.count(prevout.hash) > 0);
             CTxIndex& txindex = inputs[prevout.hash].first;
-            CTransaction& txPrev = inputs[prevout.hash].second;
+            const CCoins& coinsPrev = inputs[prevout.hash].second;
 
-            if (prevout.n >= txPrev.vout.size() || prevout.n >= txindex.vSpent.size())
-                return DoS(100, error("ConnectInputs() : %s prevout.n out of range %d %u %u prev tx %s\n%s", GetHash().ToString(), prevout.n, txPrev.vout.size(), txindex.vSpent.size(), prevout.hash.ToString(), txPrev.ToString()));
+            if (prevout.n >= coinsPrev.vout.size() || prevout.n >= txindex.vSpent.size())
+                return DoS(100, error("ConnectInputs() : %s prevout.n out of range %d %u %u prev tx %s\n%s", GetHash().ToString(), prevout.n, coinsPrev.vout.size(), txindex.vSpent.size(), prevout.hash.ToString(), coinsPrev.ToString()));
 
             // If prev is coinbase or coinstake, check that it's matured
-            if (txPrev.IsCoinBase() || txPrev.IsCoinStake())
+            if (coinsPrev.IsCoinBase() || coinsPrev.IsCoinStake())
                 for (const CBlockIndex* pindex = pindexBlock; pindex && pindexBlock->nHeight - pindex->nHeight < Params().CoinbaseMaturity(); pindex = pindex->pprev)
                     if (pindex->nBlockPos == txindex.pos.nBlockPos && pindex->nFile == txindex.pos.nFile)
-                        return error("ConnectInputs() : tried to spend %s at depth %d", txPrev.IsCoinBase() ? "coinbase" : "coinstake", pindexBlock->nHeight - pindex->nHeight);
+                        return error("ConnectInputs() : tried to spend %s at depth %d", coinsPrev.IsCoinBase() ? "coinbase" : "coinstake", pindexBlock->nHeight - pindex->nHeight);
 
             // ppcoin: check transaction timestamp
-            if (txPrev.nTime > nTime)
+            if (coinsPrev.nTime > nTime)
                 return DoS(100, error("ConnectInputs() : transaction timestamp earlier than input transaction"));
 
             // Check for negative or overflow input values
-            nValueIn += txPrev.vout[prevout.n].nValue;
-            if (!MoneyRange(txPrev.vout[prevout.n].nValue) || !MoneyRange(nValueIn))
+            nValueIn += coinsPrev.vout[prevout.n].nValue;
+            if (!MoneyRange(coinsPrev.vout[prevout.n].nValue) || !MoneyRange(nValueIn))
                 return DoS(100, error("ConnectInputs() : txin values out of range"));
 
         }
@@ -1222,7 +1624,7 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, map<uint256, CTx
             COutPoint prevout = vin[i].prevout;
             assert(inputs.count(prevout.hash) > 0);
             CTxIndex& txindex = inputs[prevout.hash].first;
-            CTransaction& txPrev = inputs[prevout.hash].second;
+            const CCoins& coinsPrev = inputs[prevout.hash].second;
 
             // Check for conflicts (double-spend)
             // This doesn't trigger the DoS code on purpose; if it did, it would make it easier
@@ -1236,7 +1638,11 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, map<uint256, CTx
             if (!(fBlock && (nBestHeight < Checkpoints::GetTotalBlocksEstimate())))
             {
                 // Verify signature
-                if (!VerifySignature(txPrev, *this, i, flags, 0))
+                CScriptCheck check(coinsPrev, *this, i, flags, 0);
+                if (pvChecks) {
+                    pvChecks->push_back(CScriptCheck());
+                    check.swap(pvChecks->back());
+                } else if (!check())
                 {
                     if (flags & STANDARD_NOT_MANDATORY_VERIFY_FLAGS) {
                         // Check whether the failure was caused by a
@@ -1245,7 +1651,7 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, map<uint256, CTx
                         // if so, don't trigger DoS protection to
                         // avoid splitting the network between upgraded and
                         // non-upgraded nodes.
-                        if (VerifySignature(txPrev, *this, i, flags & ~STANDARD_NOT_MANDATORY_VERIFY_FLAGS, 0))
+                        if (CScriptCheck(coinsPrev, *this, i, flags & ~STANDARD_NOT_MANDATORY_VERIFY_FLAGS, 0)())
                             return error("ConnectInputs() : %s non-mandatory VerifySignature failed", GetHash().ToString());
                     }
                     // Failures of other flags indicate a transaction that is
@@ -1317,6 +1723,13 @@ bool CBlock::DisconnectBlock(CTxDB& txdb, CBlockIndex* pindex)
     return true;
 }
 
+static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
+
+void ThreadScriptCheck() {
+    RenameThread("inception-scriptch");
+    scriptcheckqueue.Thread();
+}
+
 bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
 {
     // Check it again in case a previous version let a bad block in, but skip BlockSig checking
@@ -1334,6 +1747,8 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
     else
         nTxPos = pindex->nBlockPos + ::GetSerializeSize(CBlock(), SER_DISK, CLIENT_VERSION) - (2 * GetSizeOfCompactSize(0)) + GetSizeOfCompactSize(vtx.size());
 
+    CCheckQueueControl<CScriptCheck> control(nScriptCheckThreads ? &scriptcheckqueue : NULL);
+
     map<uint256, CTxIndex> mapQueuedChanges;
     int64_t nFees = 0;
     int64_t nValueIn = 0;
@@ -1396,13 +1811,23 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
             if (tx.IsCoinStake())
                 nStakeReward = nTxValueOut - nTxValueIn;
 
-            if (!tx.ConnectInputs(txdb, mapInputs, mapQueuedChanges, posThisTx, pindex, true, false, flags))
+            std::vector<CScriptCheck> vChecks;
+            if (!tx.ConnectInputs(txdb, mapInputs, mapQueuedChanges, posThisTx, pindex, true, false, flags, nScriptCheckThreads ? &vChecks : NULL))
                 return false;
+            control.Add(vChecks);
         }
 
+        // The new outputs are likely to be spent soon, keep them in memory
+        if (!fJustCheck)
+            CacheCoins(hashTx, posThisTx, tx);
+
         mapQueuedChanges[hashTx] = CTxIndex(posThisTx, tx.vout.size());
     }
 
+    // Wait for all queued script checks before anything is written to the txdb
+    if (!control.Wait())
+        return DoS(100, false);
+
     if (IsProofOfWork())
     {
         int64_t nReward = GetProofOfWorkReward(pindex->nHeight, nFees);
@@ -1439,6 +1864,13 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
     {
         if (!txdb.UpdateTxIndex((*mi).first, (*mi).second))
             return error("ConnectBlock() : UpdateTxIndex failed");
+
+        // Fully spent outputs are unlikely to be needed again
+        bool fSpent = true;
+        BOOST_FOREACH(const CDiskTxPos& posSpent, (*mi).second.vSpent)
+            fSpent &= !posSpent.IsNull();
+        if (fSpent)
+            UncacheCoins((*mi).first);
     }
 
     // Update block index on disk without changing it in memory.
@@ -1530,7 +1962,7 @@ bool static Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
         return error("Reorganize() : WriteHashBestChain failed");
 
     // Make sure it's successfully written to disk before changing memory structure
-    if (!txdb.TxnCommit())
+    if (!txdb.TxnCommit(true))
         return error("Reorganize() : TxnCommit failed");
 
     // Disconnect shorter branch
@@ -1571,7 +2003,7 @@ bool CBlock::SetBestChainInner(CTxDB& txdb, CBlockIndex *pindexNew)
         InvalidChainFound(pindexNew);
         return false;
     }
-    if (!txdb.TxnCommit())
+    if (!txdb.TxnCommit(true))
         return error("SetBestChain() : TxnCommit failed");
 
     // Add to current best branch
@@ -1823,6 +2255,9 @@ bool CBlock::CheckBlock(bool fCheckPOW, bool fCheckMerkleRoot, bool fCheckSig) c
     // These are checks that are independent of context
     // that can be verified before saving an orphan block.
 
+    if (fChecked)
+        return true;
+
     // Size limits
     if (vtx.empty() || vtx.size() > MAX_BLOCK_SIZE || ::GetSerializeSize(*this, SER_NETWORK, PROTOCOL_VERSION) > MAX_BLOCK_SIZE)
         return DoS(100, error("CheckBlock() : size limits failed"));
@@ -1897,7 +2332,7 @@ bool CBlock::CheckBlock(bool fCheckPOW, bool fCheckMerkleRoot, bool fCheckSig) c
     if (fCheckMerkleRoot && hashMerkleRoot != BuildMerkleTree())
         return DoS(100, error("CheckBlock() : hashMerkleRoot mismatch"));
 
-
+    fChecked = fCheckPOW && fCheckMerkleRoot && fCheckSig;
     return true;
 }
 
@@ -2009,13 +2444,26 @@ bool CBlock::AcceptBlock()
 
 uint256 CBlockIndex::GetBlockTrust() const
 {
-    CBigNum bnTarget;
-    bnTarget.SetCompact(nBits);
+    return GetBlockTrust(nBits);
+}
+
+uint256 CBlockIndex::GetBlockTrust(unsigned int nBits)
+{
+    bool fNegative;
+    bool fOverflow;
+    arith_uint256 bnTarget;
+    bnTarget.SetCompact(nBits, &fNegative, &fOverflow);
 
-    if (bnTarget <= 0)
+    if (fNegative || fOverflow || bnTarget == 0)
         return 0;
 
-    return ((CBigNum(1)<<256) / (bnTarget+1)).getuint256();
+    // We need to compute 2**256 / (bnTarget+1), but we can't represent 2**256
+    // as it's too large for an arith_uint256. However, as 2**256 is at least as large
+    // as bnTarget+1, it is equal to ((2**256 - bnTarget - 1) / (bnTarget+1)) + 1,
+    // or ~bnTarget / (bnTarget+1) + 1.
+    if (bnTarget == ~arith_uint256(0))
+        return 1;
+    return ArithToUint256((arith_uint256(~bnTarget) / (bnTarget + 1)) + 1);
 }
 
 bool CBlockIndex::IsSuperMajority(int minVersion, const CBlockIndex* pstart, unsigned int nRequired, unsigned int nToCheck)
@@ -2041,107 +2489,422 @@ void PushGetBlocks(CNode* pnode, CBlockIndex* pindexBegin, uint256 hashEnd)
     pnode->PushMessage("getblocks", CBlockLocator(pindexBegin), hashEnd);
 }
 
-bool static ReserealizeBlockSignature(CBlock* pblock)
+//
+// Headers-first sync
+//
+// During the initial download the sync peer is asked for headers first. They
+// are checked as far as possible without the block bodies and appended to a
+// header chain past the block index, whose bodies are then requested from all
+// peers within a moving window above the best block.
+//
+
+bool fHeadersFirst = DEFAULT_HEADERS_FIRST;
+
+namespace {
+
+struct CHeaderSyncEntry
 {
-    if (pblock->IsProofOfWork()) {
-        pblock->vchBlockSig.clear();
-        return true;
+    uint256 hash;
+    unsigned int nTime;
+    uint256 nChainTrust;
+
+    // The header chain counterpart of CBlockIndex::GetPastTimeLimit()
+    int64_t GetPastTimeLimit() const
+    {
+        return nTime;
     }
+};
 
-    return CKey::ReserealizeSignature(pblock->vchBlockSig);
-}
+// Validated headers in chain order, the first one is at nHeaderChainStart
+// and its parent is in mapBlockIndex
+deque<CHeaderSyncEntry> vHeaderChain;
+map<uint256, int> mapHeaderChain;
+int nHeaderChainStart = 0;
 
-bool static IsCanonicalBlockSignature(CBlock* pblock)
+// A branch from the sync peer off a header or block below the tip, the first
+// one is at nHeaderForkStart. It only replaces the rest of the header chain
+// once it has more trust.
+vector<CHeaderSyncEntry> vHeaderFork;
+uint256 hashHeaderForkPrev;
+int nHeaderForkStart = 0;
+
+// The peer headers are being downloaded from
+NodeId nHeaderSyncNode = -1;
+
+// Header chain blocks whose body was rejected, their headers are not taken again
+mruset<uint256> setRejectedHeaders(MAX_REJECTED_HEADERS);
+
+struct CBlockInFlight
 {
-    if (pblock->IsProofOfWork()) {
-        return pblock->vchBlockSig.empty();
-    }
+    NodeId nodeid;
+    int64_t nTime;
+    int nHeight;
+};
+map<uint256, CBlockInFlight> mapBlocksInFlight;
 
-    return IsDERSignature(pblock->vchBlockSig, false);
-}
+} // anon namespace
 
-bool ProcessBlock(CNode* pfrom, CBlock* pblock)
+static bool IsHeadersFirstSync()
 {
-    AssertLockHeld(cs_main);
+    return fHeadersFirst && IsInitialBlockDownload();
+}
 
-    // Check for duplicate
-    uint256 hash = pblock->GetHash();
-    if (mapBlockIndex.count(hash))
-        return error("ProcessBlock() : already have block %d %s", mapBlockIndex[hash]->nHeight, hash.ToString());
-    if (mapOrphanBlocks.count(hash))
-        return error("ProcessBlock() : already have block (orphan) %s", hash.ToString());
+// Drop the headers from height nHeight on
+static void TruncateHeaderChain(int nHeight)
+{
+    while (!vHeaderChain.empty() && nHeaderChainStart + (int)vHeaderChain.size() > nHeight)
+    {
+        mapHeaderChain.erase(vHeaderChain.back().hash);
+        vHeaderChain.pop_back();
+    }
+    // A pending branch off a dropped header goes too
+    if (nHeaderForkStart > nHeight && !mapBlockIndex.count(hashHeaderForkPrev))
+        vHeaderFork.clear();
+}
 
-    // ppcoin: check proof-of-stake
-    // Limited duplicity on stake: prevents block flood attack
-    // Duplicate stake allowed only when there is orphan child block
-    if (pblock->IsProofOfStake() && setStakeSeen.count(pblock->GetProofOfStake()) && !mapOrphanBlocksByPrev.count(hash) && !Checkpoints::WantedByPendingSyncCheckpoint(hash))
-        return error("ProcessBlock() : duplicate proof-of-stake (%s, %d) for block %s", pblock->GetProofOfStake().first.ToString(), pblock->GetProofOfStake().second, hash.ToString());
+// Where the next getheaders to the sync peer continues from
+static uint256 GetHeaderSyncTip()
+{
+    if (!vHeaderFork.empty())
+        return vHeaderFork.back().hash;
+    return vHeaderChain.empty() ? hashBestChain : vHeaderChain.back().hash;
+}
 
-    CBlockIndex* pcheckpoint = Checkpoints::GetLastSyncCheckpoint();
-    if (pcheckpoint && pblock->hashPrevBlock != hashBestChain && !Checkpoints::WantedByPendingSyncCheckpoint(hash))
+// Drop the headers whose blocks have been connected
+static void TrimHeaderChain()
+{
+    while (!vHeaderChain.empty() && mapBlockIndex.count(vHeaderChain.front().hash))
     {
-        // Extra checks to prevent "fill up memory by spamming with bogus blocks"
-        int64_t deltaTime = pblock->GetBlockTime() - pcheckpoint->nTime;
-        if (deltaTime < 0)
-        {
-            if (pfrom)
-                pfrom->Misbehaving(1);
-            return error("ProcessBlock() : block with timestamp before last checkpoint");
-        }
+        mapHeaderChain.erase(vHeaderChain.front().hash);
+        vHeaderChain.pop_front();
+        nHeaderChainStart++;
     }
+}
 
-    // Block signature can be malleated in such a way that it increases block size up to maximum allowed by protocol
-    // For now we just strip garbage from newly received blocks
-    if (!IsCanonicalBlockSignature(pblock)) {
-        if (!ReserealizeBlockSignature(pblock))
-            LogPrintf("WARNING: ProcessBlock() : ReserealizeBlockSignature FAILED\n");
+void static PushGetHeaders(CNode* pnode)
+{
+    uint256 hashTip = GetHeaderSyncTip();
+    // Filter out duplicate requests
+    if (hashTip == pnode->hashLastGetHeadersTip)
+        return;
+    pnode->hashLastGetHeadersTip = hashTip;
+
+    // Locator over the pending branch, the header chain and then the best
+    // chain, with exponentially larger steps back
+    vector<uint256> vHave;
+    if (!vHeaderFork.empty())
+        vHave.push_back(vHeaderFork.back().hash);
+    int nStep = 1;
+    int i = (int)vHeaderChain.size() - 1;
+    for (; i >= 0; i -= nStep)
+    {
+        vHave.push_back(vHeaderChain[i].hash);
+        if (vHave.size() > 10)
+            nStep *= 2;
+    }
+    CBlockIndex* pindex = pindexBest;
+    for (int j = 0; pindex && j < -1 - i; j++)
+        pindex = pindex->pprev;
+    while (pindex)
+    {
+        vHave.push_back(pindex->GetBlockHash());
+        for (int j = 0; pindex && j < nStep; j++)
+            pindex = pindex->pprev;
+        if (vHave.size() > 10)
+            nStep *= 2;
     }
+    vHave.push_back(Params().HashGenesisBlock());
 
-    // Preliminary checks
-    if (!pblock->CheckBlock())
-        return error("ProcessBlock() : CheckBlock FAILED");
+    pnode->PushMessage("getheaders", CBlockLocator(vHave), uint256(0));
+}
 
-    // ppcoin: ask for pending sync-checkpoint if any
-    if (!IsInitialBlockDownload())
-        Checkpoints::AskForPendingSyncCheckpoint(pfrom);
+// Check a header as far as possible without its block and add it to the
+// header chain. Any peer can extend the tip of the header chain, only the
+// sync peer can branch off below it. Returns false if it doesn't connect or
+// is invalid.
+static bool AcceptBlockHeader(const CBlock& header, CNode* pfrom)
+{
+    uint256 hash = header.GetHash();
+    if (mapBlockIndex.count(hash) || mapHeaderChain.count(hash))
+        return true;
+    if (setRejectedHeaders.count(hash))
+        return error("AcceptBlockHeader() : block %s was rejected", hash.ToString());
+
+    int nPrevHeight;
+    int64_t nPrevTime;
+    int64_t nPrevPastTimeLimit;
+    uint256 nPrevTrust;
+    bool fExtendsChain = false;
+    bool fExtendsFork = false;
+    map<uint256, int>::iterator mh = mapHeaderChain.find(header.hashPrevBlock);
+    if (!vHeaderFork.empty() && header.hashPrevBlock == vHeaderFork.back().hash)
+    {
+        nPrevHeight = nHeaderForkStart + (int)vHeaderFork.size() - 1;
+        nPrevTime = vHeaderFork.back().nTime;
+        nPrevPastTimeLimit = vHeaderFork.back().GetPastTimeLimit();
+        nPrevTrust = vHeaderFork.back().nChainTrust;
+        fExtendsFork = true;
+    }
+    else if (mh != mapHeaderChain.end())
+    {
+        nPrevHeight = mh->second;
+        const CHeaderSyncEntry& prev = vHeaderChain[nPrevHeight - nHeaderChainStart];
+        nPrevTime = prev.nTime;
+        nPrevPastTimeLimit = prev.GetPastTimeLimit();
+        nPrevTrust = prev.nChainTrust;
+    }
+    else
+    {
+        map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(header.hashPrevBlock);
+        if (mi == mapBlockIndex.end())
+            return error("AcceptBlockHeader() : header %s does not connect", hash.ToString());
+        nPrevHeight = mi->second->nHeight;
+        nPrevTime = mi->second->GetBlockTime();
+        nPrevPastTimeLimit = mi->second->GetPastTimeLimit();
+        nPrevTrust = mi->second->nChainTrust;
+    }
+    if (!fExtendsFork)
+    {
+        fExtendsChain = (header.hashPrevBlock == (vHeaderChain.empty() ? hashBestChain : vHeaderChain.back().hash));
+        if (!fExtendsChain && pfrom->id != nHeaderSyncNode)
+            return error("AcceptBlockHeader() : header %s from a peer other than the sync peer branches off the header chain", hash.ToString());
+    }
+    int nHeight = nPrevHeight + 1;
 
-    // If we don't already have its previous block, shunt it off to holding area until we get it
-    if (!mapBlockIndex.count(pblock->hashPrevBlock))
+    // Proof-of-stake headers can't be told apart from proof-of-work ones
+    // without the coinstake, so the proof of work is only checked below the
+    // first proof-of-stake block
+    if (nHeight < Params().FirstPoSBlock() && !CheckProofOfWork(hash, header.nBits))
     {
-        LogPrintf("ProcessBlock: ORPHAN BLOCK %lu, prev=%s\n", (unsigned long)mapOrphanBlocks.size(), pblock->hashPrevBlock.ToString());
+        pfrom->Misbehaving(50);
+        return error("AcceptBlockHeader() : proof of work failed for %s", hash.ToString());
+    }
+    // The timestamp rules of CheckBlock() and AcceptBlock(), which don't
+    // penalize the sender for them either
+    if (header.GetBlockTime() > FutureDrift(GetAdjustedTime()))
+        return error("AcceptBlockHeader() : timestamp of %s too far in the future", hash.ToString());
+    if (header.GetBlockTime() <= nPrevPastTimeLimit || FutureDrift(header.GetBlockTime()) < nPrevTime)
+        return error("AcceptBlockHeader() : timestamp of %s is too early", hash.ToString());
+    if (!Checkpoints::CheckHardened(nHeight, hash))
+    {
+        pfrom->Misbehaving(100);
+        return error("AcceptBlockHeader() : rejected by hardened checkpoint at height %d", nHeight);
+    }
 
-        // Accept orphans as long as there is a node to request its parents from
-        if (pfrom) {
-            // ppcoin: check proof-of-stake
-            if (pblock->IsProofOfStake())
-            {
-                // Limited duplicity on stake: prevents block flood attack
-                // Duplicate stake allowed only when there is orphan child block
-                if (setStakeSeenOrphan.count(pblock->GetProofOfStake()) && !mapOrphanBlocksByPrev.count(hash) && !Checkpoints::WantedByPendingSyncCheckpoint(hash))
-                    return error("ProcessBlock() : duplicate proof-of-stake (%s, %d) for orphan block %s", pblock->GetProofOfStake().first.ToString(), pblock->GetProofOfStake().second, hash.ToString());
-            }
-            PruneOrphanBlocks();
-            COrphanBlock* pblock2 = new COrphanBlock();
-            {
-                CDataStream ss(SER_DISK, CLIENT_VERSION);
-                ss << *pblock;
-                pblock2->vchBlock = std::vector<unsigned char>(ss.begin(), ss.end());
-            }
-            pblock2->hashBlock = hash;
-            pblock2->hashPrev = pblock->hashPrevBlock;
-            pblock2->stake = pblock->GetProofOfStake();
-            mapOrphanBlocks.insert(make_pair(hash, pblock2));
-            mapOrphanBlocksByPrev.insert(make_pair(pblock2->hashPrev, pblock2));
-            if (pblock->IsProofOfStake())
-                setStakeSeenOrphan.insert(pblock->GetProofOfStake());
+    CHeaderSyncEntry entry;
+    entry.hash = hash;
+    entry.nTime = header.nTime;
+    entry.nChainTrust = nPrevTrust + CBlockIndex::GetBlockTrust(header.nBits);
 
-            // Ask this guy to fill in what we're missing
-            PushGetBlocks(pfrom, pindexBest, GetOrphanRoot(hash));
-            // ppcoin: getblocks may not obtain the ancestor block rejected
-            // earlier by duplicate-stake check so we ask for it again directly
-            if (!IsInitialBlockDownload())
-                pfrom->AskFor(CInv(MSG_BLOCK, WantedByOrphan(pblock2)));
-        }
+    if (fExtendsChain)
+    {
+        if (vHeaderChain.empty())
+            nHeaderChainStart = nHeight;
+        vHeaderChain.push_back(entry);
+        mapHeaderChain[hash] = nHeight;
+        return true;
+    }
+
+    // A branch is kept aside until it has more trust than the header chain,
+    // so an unproven one can't throw the chain away
+    if (!fExtendsFork)
+    {
+        vHeaderFork.clear();
+        hashHeaderForkPrev = header.hashPrevBlock;
+        nHeaderForkStart = nHeight;
+    }
+    if (vHeaderFork.size() >= MAX_HEADER_FORK_LENGTH)
+    {
+        vHeaderFork.clear();
+        return error("AcceptBlockHeader() : branch off the header chain at height %d is too long", nHeaderForkStart);
+    }
+    vHeaderFork.push_back(entry);
+
+    uint256 nTipTrust = vHeaderChain.empty() ? nBestChainTrust : vHeaderChain.back().nChainTrust;
+    if (entry.nChainTrust <= nTipTrust)
+        return true;
+
+    LogPrint("net", "header branch at height %d overtakes the header chain\n", nHeaderForkStart);
+    if (mapHeaderChain.count(hashHeaderForkPrev))
+        TruncateHeaderChain(nHeaderForkStart);
+    else
+    {
+        TruncateHeaderChain(0);
+        nHeaderChainStart = nHeaderForkStart;
+    }
+    for (unsigned int i = 0; i < vHeaderFork.size(); i++)
+    {
+        vHeaderChain.push_back(vHeaderFork[i]);
+        mapHeaderChain[vHeaderFork[i].hash] = nHeaderForkStart + i;
+    }
+    vHeaderFork.clear();
+    return true;
+}
+
+// Forget requests that timed out or went to peers that are gone
+static void ExpireBlocksInFlight()
+{
+    static int64_t nLastExpire = 0;
+    int64_t nNow = GetTime();
+    if (nNow == nLastExpire)
+        return;
+    nLastExpire = nNow;
+
+    set<NodeId> setNodes;
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodes)
+            if (!pnode->fDisconnect)
+                setNodes.insert(pnode->id);
+    }
+    map<uint256, CBlockInFlight>::iterator mi = mapBlocksInFlight.begin();
+    while (mi != mapBlocksInFlight.end())
+    {
+        if (mi->second.nTime < nNow - BLOCK_DOWNLOAD_TIMEOUT || !setNodes.count(mi->second.nodeid))
+        {
+            LogPrint("net", "block %s at height %d timed out\n", mi->first.ToString(), mi->second.nHeight);
+            mapBlocksInFlight.erase(mi++);
+        }
+        else
+            ++mi;
+    }
+}
+
+// Request the next blocks of the header chain from pto
+static void RequestHeaderChainBlocks(CNode* pto)
+{
+    ExpireBlocksInFlight();
+    TrimHeaderChain();
+
+    // Forget what was received from this peer, or given to another one
+    set<uint256>::iterator it = pto->setBlocksInFlight.begin();
+    while (it != pto->setBlocksInFlight.end())
+    {
+        map<uint256, CBlockInFlight>::iterator mi = mapBlocksInFlight.find(*it);
+        if (mi == mapBlocksInFlight.end() || mi->second.nodeid != pto->id)
+            pto->setBlocksInFlight.erase(it++);
+        else
+            ++it;
+    }
+
+    vector<CInv> vGetData;
+    unsigned int nWindow = std::min((unsigned int)vHeaderChain.size(), BLOCK_DOWNLOAD_WINDOW);
+    for (unsigned int i = 0; i < nWindow && pto->setBlocksInFlight.size() < MAX_BLOCKS_IN_TRANSIT_PER_PEER; i++)
+    {
+        int nHeight = nHeaderChainStart + i;
+        if (nHeight > pto->nStartingHeight)
+            break;
+        const uint256& hash = vHeaderChain[i].hash;
+        if (mapBlocksInFlight.count(hash) || mapOrphanBlocks.count(hash) || mapBlockIndex.count(hash))
+            continue;
+        CBlockInFlight& inflight = mapBlocksInFlight[hash];
+        inflight.nodeid = pto->id;
+        inflight.nTime = GetTime();
+        inflight.nHeight = nHeight;
+        pto->setBlocksInFlight.insert(hash);
+        vGetData.push_back(CInv(MSG_BLOCK, hash));
+    }
+    if (!vGetData.empty())
+    {
+        LogPrint("net", "requesting %u blocks from height %d from %s\n", vGetData.size(), nHeaderChainStart, pto->addr.ToString());
+        pto->PushMessage("getdata", vGetData);
+    }
+}
+
+bool static ReserealizeBlockSignature(CBlock* pblock)
+{
+    if (pblock->IsProofOfWork()) {
+        pblock->vchBlockSig.clear();
+        return true;
+    }
+
+    return CKey::ReserealizeSignature(pblock->vchBlockSig);
+}
+
+bool static IsCanonicalBlockSignature(CBlock* pblock)
+{
+    if (pblock->IsProofOfWork()) {
+        return pblock->vchBlockSig.empty();
+    }
+
+    return IsDERSignature(pblock->vchBlockSig, false);
+}
+
+bool ProcessBlock(CNode* pfrom, CBlock* pblock)
+{
+    AssertLockHeld(cs_main);
+
+    // Check for duplicate
+    uint256 hash = pblock->GetHash();
+    if (mapBlockIndex.count(hash))
+        return error("ProcessBlock() : already have block %d %s", mapBlockIndex[hash]->nHeight, hash.ToString());
+    if (mapOrphanBlocks.count(hash))
+        return error("ProcessBlock() : already have block (orphan) %s", hash.ToString());
+
+    // ppcoin: check proof-of-stake
+    // Limited duplicity on stake: prevents block flood attack
+    // Duplicate stake allowed only when there is orphan child block
+    if (pblock->IsProofOfStake() && setStakeSeen.count(pblock->GetProofOfStake()) && !mapOrphanBlocksByPrev.count(hash) && !Checkpoints::WantedByPendingSyncCheckpoint(hash))
+        return error("ProcessBlock() : duplicate proof-of-stake (%s, %d) for block %s", pblock->GetProofOfStake().first.ToString(), pblock->GetProofOfStake().second, hash.ToString());
+
+    CBlockIndex* pcheckpoint = Checkpoints::GetLastSyncCheckpoint();
+    if (pcheckpoint && pblock->hashPrevBlock != hashBestChain && !Checkpoints::WantedByPendingSyncCheckpoint(hash))
+    {
+        // Extra checks to prevent "fill up memory by spamming with bogus blocks"
+        int64_t deltaTime = pblock->GetBlockTime() - pcheckpoint->nTime;
+        if (deltaTime < 0)
+        {
+            if (pfrom)
+                pfrom->Misbehaving(1);
+            return error("ProcessBlock() : block with timestamp before last checkpoint");
+        }
+    }
+
+    // Block signature can be malleated in such a way that it increases block size up to maximum allowed by protocol
+    // For now we just strip garbage from newly received blocks
+    if (!IsCanonicalBlockSignature(pblock)) {
+        if (!ReserealizeBlockSignature(pblock))
+            LogPrintf("WARNING: ProcessBlock() : ReserealizeBlockSignature FAILED\n");
+        pblock->fChecked = false;
+    }
+
+    // Preliminary checks
+    if (!pblock->CheckBlock())
+        return error("ProcessBlock() : CheckBlock FAILED");
+
+    // ppcoin: ask for pending sync-checkpoint if any
+    if (!IsInitialBlockDownload())
+        Checkpoints::AskForPendingSyncCheckpoint(pfrom);
+
+    // If we don't already have its previous block, shunt it off to holding area until we get it
+    if (!mapBlockIndex.count(pblock->hashPrevBlock))
+    {
+        LogPrintf("ProcessBlock: ORPHAN BLOCK %lu, prev=%s\n", (unsigned long)mapOrphanBlocks.size(), pblock->hashPrevBlock.ToString());
+
+        // Accept orphans as long as there is a node to request its parents from
+        if (pfrom) {
+            // ppcoin: check proof-of-stake
+            if (pblock->IsProofOfStake())
+            {
+                // Limited duplicity on stake: prevents block flood attack
+                // Duplicate stake allowed only when there is orphan child block
+                if (setStakeSeenOrphan.count(pblock->GetProofOfStake()) && !mapOrphanBlocksByPrev.count(hash) && !Checkpoints::WantedByPendingSyncCheckpoint(hash))
+                    return error("ProcessBlock() : duplicate proof-of-stake (%s, %d) for orphan block %s", pblock->GetProofOfStake().first.ToString(), pblock->GetProofOfStake().second, hash.ToString());
+            }
+            COrphanBlock* pblock2 = AddOrphanBlock(*pblock, hash);
+
+            // Blocks of the header chain arrive out of order, their parents
+            // are requested already
+            if (!mapHeaderChain.count(hash))
+            {
+                // Ask this guy to fill in what we're missing
+                PushGetBlocks(pfrom, pindexBest, GetOrphanRoot(hash));
+                // ppcoin: getblocks may not obtain the ancestor block rejected
+                // earlier by duplicate-stake check so we ask for it again directly
+                if (!IsInitialBlockDownload())
+                    pfrom->AskFor(CInv(MSG_BLOCK, WantedByOrphan(pblock2)));
+            }
+        }
         return true;
     }
 
@@ -2155,27 +2918,35 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock)
     for (unsigned int i = 0; i < vWorkQueue.size(); i++)
     {
         uint256 hashPrev = vWorkQueue[i];
+        vector<COrphanBlock*> vChildren;
         for (multimap<uint256, COrphanBlock*>::iterator mi = mapOrphanBlocksByPrev.lower_bound(hashPrev);
              mi != mapOrphanBlocksByPrev.upper_bound(hashPrev);
              ++mi)
+            vChildren.push_back(mi->second);
+        BOOST_FOREACH(COrphanBlock* pblockOrphan, vChildren)
         {
             CBlock block;
-            {
-                CDataStream ss(mi->second->vchBlock, SER_DISK, CLIENT_VERSION);
-                ss >> block;
-            }
+            bool fRead = ReadOrphanBlock(pblockOrphan, block);
+            uint256 hashOrphan = pblockOrphan->hashBlock;
+            EraseOrphanBlock(pblockOrphan);
+            if (!fRead)
+                continue;
             block.BuildMerkleTree();
             if (block.AcceptBlock())
-                vWorkQueue.push_back(mi->second->hashBlock);
-            mapOrphanBlocks.erase(mi->second->hashBlock);
-            setStakeSeenOrphan.erase(block.GetProofOfStake());
-            delete mi->second;
+                vWorkQueue.push_back(hashOrphan);
         }
-        mapOrphanBlocksByPrev.erase(hashPrev);
     }
 
     LogPrintf("ProcessBlock: ACCEPTED\n");
 
+    // Use the txdb bulk load profile while catching up with the chain. It is
+    // kept through short stalls of the download and dropped once the best
+    // block is recent.
+    if (IsInitialBlockDownload())
+        CTxDB::SetBulkLoad(true);
+    else if (pindexBest->GetBlockTime() > GetTime() - 8 * 60 * 60)
+        CTxDB::SetBulkLoad(false);
+
     // ppcoin: if responsible for sync-checkpoint send it
     if (pfrom && !CSyncCheckpoint::strMasterPrivKey.empty())
         Checkpoints::SendSyncCheckpoint(Checkpoints::AutoSelectSyncCheckpoint());
@@ -2216,6 +2987,7 @@ bool CBlock::SignBlock(CWallet& wallet, int64_t nFees)
                 // make sure coinstake would meet timestamp protocol
                 //    as it would be the same as the block timestamp
                 vtx[0].nTime = nTime = txCoinStake.nTime;
+                vtx[0].UpdateHash();
 
                 // we have to make sure that we have no future timestamps in
                 //    our transactions set
@@ -2326,6 +3098,326 @@ FILE* AppendBlockFile(unsigned int& nFileRet)
     }
 }
 
+//////////////////////////////////////////////////////////////////////////////
+//
+// Block file read cache
+//
+
+// Reads from the blk*.dat files go through a small pool of read-only handles that
+// stay open between calls. Fully read blocks are kept decoded in an LRU list, so
+// transactions and headers from recently read blocks are served without disk access.
+
+static const unsigned int MAX_BLOCKFILE_HANDLES = 8;
+
+unsigned int nBlockCacheSize = DEFAULT_BLOCK_CACHE_SIZE;
+
+namespace {
+
+struct CCachedBlock
+{
+    CBlock block;
+    // position in the block file of each transaction in block.vtx
+    vector<unsigned int> vTxPos;
+
+    void SetTxPositions(unsigned int nBlockPos)
+    {
+        vTxPos.clear();
+        vTxPos.reserve(block.vtx.size());
+        unsigned int nTxPos = nBlockPos + ::GetSerializeSize(CBlock(), SER_DISK, CLIENT_VERSION) - (2 * GetSizeOfCompactSize(0)) + GetSizeOfCompactSize(block.vtx.size());
+        BOOST_FOREACH(const CTransaction& tx, block.vtx)
+        {
+            vTxPos.push_back(nTxPos);
+            nTxPos += ::GetSerializeSize(tx, SER_DISK, CLIENT_VERSION);
+        }
+    }
+
+    bool GetTransaction(unsigned int nTxPos, CTransaction& txRet) const
+    {
+        vector<unsigned int>::const_iterator it = std::lower_bound(vTxPos.begin(), vTxPos.end(), nTxPos);
+        if (it == vTxPos.end() || *it != nTxPos)
+            return false;
+        txRet = block.vtx[it - vTxPos.begin()];
+        return true;
+    }
+};
+
+typedef pair<unsigned int, unsigned int> BlockFilePos;
+typedef list<pair<BlockFilePos, CCachedBlock> > BlockCacheList;
+
+CCriticalSection cs_blockfiles;
+// open read-only block files, most recently used first
+list<pair<unsigned int, FILE*> > lruBlockFiles;
+
+CCriticalSection cs_blockcache;
+// decoded blocks, most recently used first
+BlockCacheList lruBlockCache;
+map<BlockFilePos, BlockCacheList::iterator> mapBlockCache;
+uint64_t nBlockCacheHits = 0;
+uint64_t nBlockCacheMisses = 0;
+
+} // anon namespace
+
+// Get an open read-only handle on block file nFile
+static FILE* GetBlockFile(unsigned int nFile)
+{
+    AssertLockHeld(cs_blockfiles);
+    if ((nFile < 1) || (nFile == (unsigned int) -1))
+        return NULL;
+
+    FILE* file = NULL;
+    for (list<pair<unsigned int, FILE*> >::iterator it = lruBlockFiles.begin(); it != lruBlockFiles.end(); ++it)
+    {
+        if (it->first == nFile)
+        {
+            file = it->second;
+            lruBlockFiles.splice(lruBlockFiles.begin(), lruBlockFiles, it);
+            break;
+        }
+    }
+    if (!file)
+    {
+        file = fopen(BlockFilePath(nFile).string().c_str(), "rb");
+        if (!file)
+            return NULL;
+        lruBlockFiles.push_front(make_pair(nFile, file));
+        if (lruBlockFiles.size() > MAX_BLOCKFILE_HANDLES)
+        {
+            fclose(lruBlockFiles.back().second);
+            lruBlockFiles.pop_back();
+        }
+    }
+    return file;
+}
+
+// Append nSize bytes at nPos of block file nFile to ssRet
+static bool ReadBlockFileData(unsigned int nFile, unsigned int nPos, unsigned int nSize, CDataStream& ssRet)
+{
+    LOCK(cs_blockfiles);
+    FILE* file = GetBlockFile(nFile);
+    if (!file)
+        return false;
+
+    unsigned int nOffset = ssRet.size();
+    ssRet.resize(nOffset + nSize);
+    if (fseek(file, nPos, SEEK_SET) != 0 || (nSize > 0 && fread(&ssRet[nOffset], 1, nSize, file) != nSize))
+    {
+        clearerr(file);
+        ssRet.resize(nOffset);
+        return false;
+    }
+    return true;
+}
+
+// Append the serialized block at nFile/nBlockPos to ssRet
+static bool ReadBlockDataFromFile(unsigned int nFile, unsigned int nBlockPos, CDataStream& ssRet)
+{
+    // CBlock::WriteToDisk stores the serialized size just in front of the block
+    unsigned int nSize = 0;
+    CDataStream ssSize(SER_DISK, CLIENT_VERSION);
+    if (nBlockPos < sizeof(nSize) || !ReadBlockFileData(nFile, nBlockPos - sizeof(nSize), sizeof(nSize), ssSize))
+        return error("ReadBlockDataFromFile() : failed to read block size");
+    ssSize >> nSize;
+    if (nSize > MAX_SIZE)
+        return error("ReadBlockDataFromFile() : invalid block size %u", nSize);
+
+    if (!ReadBlockFileData(nFile, nBlockPos, nSize, ssRet))
+        return error("ReadBlockDataFromFile() : failed to read block data");
+    return true;
+}
+
+// Read and decode a whole block, without going through the cache
+static bool ReadBlockFromFile(unsigned int nFile, unsigned int nBlockPos, CBlock& block)
+{
+    CDataStream ssBlock(SER_DISK, CLIENT_VERSION);
+    if (!ReadBlockDataFromFile(nFile, nBlockPos, ssBlock))
+        return false;
+    try {
+        ssBlock >> block;
+    }
+    catch (std::exception &e) {
+        return error("%s() : deserialize or I/O error", __PRETTY_FUNCTION__);
+    }
+
+    // Check the header
+    if (block.IsProofOfWork() && !CheckProofOfWork(block.GetHash(), block.nBits))
+        return error("ReadBlockFromFile() : errors in block header");
+
+    return true;
+}
+
+// Look up a block in the cache and mark it as most recently used
+static const CCachedBlock* FindCachedBlock(unsigned int nFile, unsigned int nBlockPos)
+{
+    AssertLockHeld(cs_blockcache);
+    map<BlockFilePos, BlockCacheList::iterator>::iterator mi = mapBlockCache.find(BlockFilePos(nFile, nBlockPos));
+    if (mi == mapBlockCache.end())
+    {
+        nBlockCacheMisses++;
+        return NULL;
+    }
+    nBlockCacheHits++;
+    lruBlockCache.splice(lruBlockCache.begin(), lruBlockCache, mi->second);
+    return &mi->second->second;
+}
+
+static void CacheBlock(unsigned int nFile, unsigned int nBlockPos, const CBlock& block)
+{
+    LOCK(cs_blockcache);
+    BlockFilePos pos(nFile, nBlockPos);
+    if (nBlockCacheSize == 0 || mapBlockCache.count(pos))
+        return;
+    lruBlockCache.push_front(make_pair(pos, CCachedBlock()));
+    lruBlockCache.front().second.block = block;
+    lruBlockCache.front().second.SetTxPositions(nBlockPos);
+    mapBlockCache[pos] = lruBlockCache.begin();
+    while (mapBlockCache.size() > nBlockCacheSize)
+    {
+        mapBlockCache.erase(lruBlockCache.back().first);
+        lruBlockCache.pop_back();
+    }
+}
+
+bool CBlock::ReadFromDisk(unsigned int nFile, unsigned int nBlockPos, bool fReadTransactions)
+{
+    SetNull();
+
+    {
+        LOCK(cs_blockcache);
+        const CCachedBlock* pcached = FindCachedBlock(nFile, nBlockPos);
+        if (pcached)
+        {
+            if (fReadTransactions)
+            {
+                *this = pcached->block;
+            }
+            else
+            {
+                nVersion       = pcached->block.nVersion;
+                hashPrevBlock  = pcached->block.hashPrevBlock;
+                hashMerkleRoot = pcached->block.hashMerkleRoot;
+                nTime          = pcached->block.nTime;
+                nBits          = pcached->block.nBits;
+                nNonce         = pcached->block.nNonce;
+            }
+            return true;
+        }
+    }
+
+    if (!fReadTransactions)
+    {
+        // A bare header is not worth decoding the whole block for
+        CDataStream ssHeader(SER_DISK | SER_BLOCKHEADERONLY, CLIENT_VERSION);
+        if (!ReadBlockFileData(nFile, nBlockPos, ::GetSerializeSize(CBlock(), SER_DISK | SER_BLOCKHEADERONLY, CLIENT_VERSION), ssHeader))
+            return error("CBlock::ReadFromDisk() : failed to read block header");
+        try {
+            ssHeader >> *this;
+        }
+        catch (std::exception &e) {
+            return error("%s() : deserialize or I/O error", __PRETTY_FUNCTION__);
+        }
+        return true;
+    }
+
+    if (!ReadBlockFromFile(nFile, nBlockPos, *this))
+        return false;
+    CacheBlock(nFile, nBlockPos, *this);
+    return true;
+}
+
+bool CTransaction::ReadFromDisk(CDiskTxPos pos, FILE** pfileRet)
+{
+    if (pfileRet)
+    {
+        // Caller wants the file positioned at the transaction; open it directly
+        CAutoFile filein = CAutoFile(OpenBlockFile(pos.nFile, 0, "rb+"), SER_DISK, CLIENT_VERSION);
+        if (!filein)
+            return error("CTransaction::ReadFromDisk() : OpenBlockFile failed");
+        if (fseek(filein, pos.nTxPos, SEEK_SET) != 0)
+            return error("CTransaction::ReadFromDisk() : fseek failed");
+        try {
+            filein >> *this;
+        }
+        catch (std::exception &e) {
+            return error("%s() : deserialize or I/O error", __PRETTY_FUNCTION__);
+        }
+        if (fseek(filein, pos.nTxPos, SEEK_SET) != 0)
+            return error("CTransaction::ReadFromDisk() : second fseek failed");
+        *pfileRet = filein.release();
+        return true;
+    }
+
+    {
+        LOCK(cs_blockcache);
+        const CCachedBlock* pcached = FindCachedBlock(pos.nFile, pos.nBlockPos);
+        if (pcached)
+        {
+            if (!pcached->GetTransaction(pos.nTxPos, *this))
+                return error("CTransaction::ReadFromDisk() : no transaction at %s", pos.ToString());
+            return true;
+        }
+    }
+
+    // Only the transaction is read on a miss, blocks get cached by the paths
+    // that read them whole
+    LOCK(cs_blockfiles);
+    FILE* file = GetBlockFile(pos.nFile);
+    if (!file)
+        return error("CTransaction::ReadFromDisk() : OpenBlockFile failed");
+    if (fseek(file, pos.nTxPos, SEEK_SET) != 0)
+        return error("CTransaction::ReadFromDisk() : fseek failed");
+    CAutoFile filein = CAutoFile(file, SER_DISK, CLIENT_VERSION);
+    try {
+        filein >> *this;
+    }
+    catch (std::exception &e) {
+        clearerr(filein.release());
+        return error("%s() : deserialize or I/O error", __PRETTY_FUNCTION__);
+    }
+    // The handle stays in the pool
+    filein.release();
+    return true;
+}
+
+bool ReadRawBlockFromDisk(const CBlockIndex* pindex, CDataStream& ssRet)
+{
+    unsigned int nOffset = ssRet.size();
+    if (!ReadBlockDataFromFile(pindex->nFile, pindex->nBlockPos, ssRet))
+        return false;
+
+    // Check the stored header still hashes to the indexed block
+    static const unsigned int nHeaderSize = ::GetSerializeSize(CBlock(), SER_DISK | SER_BLOCKHEADERONLY, CLIENT_VERSION);
+    if (ssRet.size() - nOffset < nHeaderSize ||
+        HashX11(&ssRet[nOffset], &ssRet[nOffset] + nHeaderSize) != pindex->GetBlockHash())
+    {
+        ssRet.resize(nOffset);
+        return error("ReadRawBlockFromDisk() : block data doesn't match index");
+    }
+    return true;
+}
+
+void GetBlockCacheStats(CBlockCacheStats& stats)
+{
+    {
+        LOCK(cs_blockcache);
+        stats.nHits = nBlockCacheHits;
+        stats.nMisses = nBlockCacheMisses;
+        stats.nBlocks = mapBlockCache.size();
+        stats.nMaxBlocks = nBlockCacheSize;
+    }
+    {
+        LOCK(cs_blockfiles);
+        stats.nOpenFiles = lruBlockFiles.size();
+    }
+}
+
+void CloseBlockFiles()
+{
+    LOCK(cs_blockfiles);
+    for (list<pair<unsigned int, FILE*> >::iterator it = lruBlockFiles.begin(); it != lruBlockFiles.end(); ++it)
+        fclose(it->second);
+    lruBlockFiles.clear();
+}
+
 bool LoadBlockIndex(bool fAllowNew)
 {
     LOCK(cs_main);
@@ -2452,55 +3544,253 @@ void PrintBlockTree()
     }
 }
 
+namespace {
+
+// Decodes the blocks found by LoadExternalBlockFile and runs CheckBlock on them
+// on a few worker threads. Results are taken back in file order.
+class CBlockImportPool
+{
+private:
+    boost::mutex mutex;
+    boost::condition_variable condWorker;
+    boost::condition_variable condMaster;
+    // raw blocks waiting to be decoded, with their sequence number
+    deque<pair<unsigned int, vector<char>*> > queueData;
+    // decoded blocks by sequence number, NULL if the block was bad
+    map<unsigned int, CBlock*> mapResult;
+    unsigned int nSubmitted;
+    unsigned int nTaken;
+    bool fQuit;
+    boost::thread_group threadGroup;
+
+    void Thread()
+    {
+        while (true)
+        {
+            pair<unsigned int, vector<char>*> item;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (!fQuit && queueData.empty())
+                    condWorker.wait(lock);
+                if (fQuit)
+                    return;
+                item = queueData.front();
+                queueData.pop_front();
+            }
+
+            CBlock* pblock = new CBlock();
+            try {
+                CDataStream ss(*item.second, SER_DISK, CLIENT_VERSION);
+                ss >> *pblock;
+            }
+            catch (std::exception &e) {
+                LogPrintf("%s() : deserialize error at block %u\n", __PRETTY_FUNCTION__, item.first);
+                delete pblock;
+                pblock = NULL;
+            }
+            delete item.second;
+            if (pblock && !pblock->CheckBlock())
+            {
+                delete pblock;
+                pblock = NULL;
+            }
+
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                mapResult[item.first] = pblock;
+            }
+            condMaster.notify_one();
+        }
+    }
+
+public:
+    CBlockImportPool(int nThreads) : nSubmitted(0), nTaken(0), fQuit(false)
+    {
+        for (int i = 0; i < nThreads; i++)
+            threadGroup.create_thread(boost::bind(&CBlockImportPool::Thread, this));
+    }
+
+    ~CBlockImportPool()
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            fQuit = true;
+        }
+        condWorker.notify_all();
+        threadGroup.join_all();
+        for (unsigned int i = 0; i < queueData.size(); i++)
+            delete queueData[i].second;
+        for (map<unsigned int, CBlock*>::iterator it = mapResult.begin(); it != mapResult.end(); ++it)
+            delete it->second;
+    }
+
+    // Queue a serialized block, the pool takes ownership
+    void Submit(vector<char>* pvchData)
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            queueData.push_back(make_pair(nSubmitted++, pvchData));
+        }
+        condWorker.notify_one();
+    }
+
+    unsigned int Pending() const
+    {
+        return nSubmitted - nTaken;
+    }
+
+    // Wait for the next block in file order, which the caller then owns.
+    // Returns NULL if it could not be decoded or failed CheckBlock.
+    CBlock* Take()
+    {
+        assert(Pending() > 0);
+        boost::unique_lock<boost::mutex> lock(mutex);
+        map<unsigned int, CBlock*>::iterator it;
+        while ((it = mapResult.find(nTaken)) == mapResult.end())
+            condMaster.wait(lock);
+        CBlock* pblock = it->second;
+        mapResult.erase(it);
+        nTaken++;
+        return pblock;
+    }
+};
+
+// Reads a block file in large chunks for the scan for message starts
+class CBlockFileReader
+{
+private:
+    FILE* file;
+    vector<char> vBuf;
+    unsigned int nBegin; // start of the unconsumed data in vBuf
+
+public:
+    CBlockFileReader(FILE* fileIn) : file(fileIn), nBegin(0) {}
+
+    unsigned int Available() const { return vBuf.size() - nBegin; }
+    const char* Data() const { return &vBuf[nBegin]; }
+    void Skip(unsigned int n) { nBegin += n; }
+
+    // Make at least nSize bytes available, false at the end of the file
+    bool Fill(unsigned int nSize)
+    {
+        if (Available() >= nSize)
+            return true;
+        vBuf.erase(vBuf.begin(), vBuf.begin() + nBegin);
+        nBegin = 0;
+        unsigned int nHave = vBuf.size();
+        unsigned int nWant = std::max(nSize - nHave, (unsigned int)(4 << 20));
+        vBuf.resize(nHave + nWant);
+        size_t nRead = fread(&vBuf[nHave], 1, nWant, file);
+        vBuf.resize(nHave + nRead);
+        return Available() >= nSize;
+    }
+};
+
+} // anon namespace
+
+// Maximum number of blocks held back by LoadExternalBlockFile until their
+// parent has been loaded
+static const unsigned int MAX_IMPORT_ORPHANS = 1000;
+
 bool LoadExternalBlockFile(FILE* fileIn)
 {
     int64_t nStart = GetTimeMillis();
 
+    // The file is scanned on this thread and the blocks are decoded and
+    // checked in parallel. They are then connected here in file order, with
+    // blocks that arrive ahead of their parent held back until it connects.
+    int nThreads = std::max(nScriptCheckThreads, 1);
+    unsigned int nMaxPending = nThreads * 16;
     int nLoaded = 0;
     {
+        CBlockImportPool pool(nThreads);
+        multimap<uint256, CBlock*> mapImportOrphans;
         try {
             CAutoFile blkdat(fileIn, SER_DISK, CLIENT_VERSION);
-            unsigned int nPos = 0;
-            while (nPos != (unsigned int)-1 && blkdat.good())
+            CBlockFileReader reader(blkdat);
+            bool fEof = false;
+            while (!fEof || pool.Pending() > 0)
             {
                 boost::this_thread::interruption_point();
-                unsigned char pchData[65536];
-                do {
-                    fseek(blkdat, nPos, SEEK_SET);
-                    int nRead = fread(pchData, 1, sizeof(pchData), blkdat);
-                    if (nRead <= 8)
+
+                // Scan ahead until enough blocks are in the pipeline
+                while (!fEof && pool.Pending() < nMaxPending)
+                {
+                    if (!reader.Fill(MESSAGE_START_SIZE + sizeof(unsigned int)))
                     {
-                        nPos = (unsigned int)-1;
+                        fEof = true;
                         break;
                     }
-                    void* nFind = memchr(pchData, Params().MessageStart()[0], nRead+1-MESSAGE_START_SIZE);
-                    if (nFind)
+                    const char* pchData = reader.Data();
+                    unsigned int nAvail = reader.Available();
+                    const void* nFind = memchr(pchData, Params().MessageStart()[0], nAvail + 1 - MESSAGE_START_SIZE);
+                    if (!nFind)
                     {
-                        if (memcmp(nFind, Params().MessageStart(), MESSAGE_START_SIZE)==0)
-                        {
-                            nPos += ((unsigned char*)nFind - pchData) + MESSAGE_START_SIZE;
-                            break;
-                        }
-                        nPos += ((unsigned char*)nFind - pchData) + 1;
+                        reader.Skip(nAvail + 1 - MESSAGE_START_SIZE);
+                        continue;
                     }
-                    else
-                        nPos += sizeof(pchData) - MESSAGE_START_SIZE + 1;
-                    boost::this_thread::interruption_point();
-                } while(true);
-                if (nPos == (unsigned int)-1)
+                    reader.Skip((const char*)nFind - pchData);
+                    if (!reader.Fill(MESSAGE_START_SIZE + sizeof(unsigned int)))
+                    {
+                        fEof = true;
+                        break;
+                    }
+                    if (memcmp(reader.Data(), Params().MessageStart(), MESSAGE_START_SIZE) != 0)
+                    {
+                        reader.Skip(1);
+                        continue;
+                    }
+                    reader.Skip(MESSAGE_START_SIZE);
+
+                    unsigned int nSize;
+                    CDataStream ssSize(reader.Data(), reader.Data() + sizeof(nSize), SER_DISK, CLIENT_VERSION);
+                    ssSize >> nSize;
+                    if (nSize == 0 || nSize > MAX_BLOCK_SIZE)
+                        continue;
+                    if (!reader.Fill(sizeof(nSize) + nSize))
+                    {
+                        fEof = true;
+                        break;
+                    }
+                    reader.Skip(sizeof(nSize));
+                    pool.Submit(new vector<char>(reader.Data(), reader.Data() + nSize));
+                    reader.Skip(nSize);
+                }
+                if (pool.Pending() == 0)
                     break;
-                fseek(blkdat, nPos, SEEK_SET);
-                unsigned int nSize;
-                blkdat >> nSize;
-                if (nSize > 0 && nSize <= MAX_BLOCK_SIZE)
+
+                auto_ptr<CBlock> pblock(pool.Take());
+                if (!pblock.get())
+                    continue;
+
+                LOCK(cs_main);
+                if (!mapBlockIndex.count(pblock->hashPrevBlock) && pblock->GetHash() != Params().HashGenesisBlock())
+                {
+                    if (mapImportOrphans.size() < MAX_IMPORT_ORPHANS)
+                        mapImportOrphans.insert(make_pair(pblock->hashPrevBlock, pblock.release()));
+                    else
+                        LogPrint("import", "LoadExternalBlockFile() : dropping out of order block %s\n", pblock->GetHash().ToString());
+                    continue;
+                }
+                if (!ProcessBlock(NULL, pblock.get()))
+                    continue;
+                nLoaded++;
+
+                // Connect the held back blocks that were waiting for this one
+                vector<uint256> vWorkQueue;
+                vWorkQueue.push_back(pblock->GetHash());
+                for (unsigned int i = 0; i < vWorkQueue.size(); i++)
                 {
-                    CBlock block;
-                    blkdat >> block;
-                    LOCK(cs_main);
-                    if (ProcessBlock(NULL,&block))
+                    multimap<uint256, CBlock*>::iterator mi = mapImportOrphans.lower_bound(vWorkQueue[i]);
+                    while (mi != mapImportOrphans.end() && mi->first == vWorkQueue[i])
                     {
-                        nLoaded++;
-                        nPos += 4 + nSize;
+                        auto_ptr<CBlock> pblockOrphan(mi->second);
+                        mapImportOrphans.erase(mi++);
+                        if (ProcessBlock(NULL, pblockOrphan.get()))
+                        {
+                            nLoaded++;
+                            vWorkQueue.push_back(pblockOrphan->GetHash());
+                        }
                     }
                 }
             }
@@ -2509,6 +3799,10 @@ bool LoadExternalBlockFile(FILE* fileIn)
             LogPrintf("%s() : Deserialize or I/O error caught during load\n",
                    __PRETTY_FUNCTION__);
         }
+        if (!mapImportOrphans.empty())
+            LogPrintf("LoadExternalBlockFile() : %u blocks without parent skipped\n", mapImportOrphans.size());
+        for (multimap<uint256, CBlock*>::iterator mi = mapImportOrphans.begin(); mi != mapImportOrphans.end(); ++mi)
+            delete mi->second;
     }
     LogPrintf("Loaded %i blocks from external file in %dms\n", nLoaded, GetTimeMillis() - nStart);
     return nLoaded > 0;
@@ -2662,8 +3956,8 @@ void static ProcessGetData(CNode* pfrom)
 
     vector<CInv> vNotFound;
 
-    LOCK(cs_main);
-
+    // Only blocks need chain state, relayed transactions are served
+    // from mapRelay and the mempool without taking cs_main
     while (it != pfrom->vRecvGetData.end()) {
         // Don't bother if send buffer is too full to respond anyway
         if (pfrom->nSendSize >= SendBufferSize())
@@ -2676,13 +3970,18 @@ void static ProcessGetData(CNode* pfrom)
 
             if (inv.type == MSG_BLOCK)
             {
+                LOCK(cs_main);
                 // Send block from disk
                 map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(inv.hash);
                 if (mi != mapBlockIndex.end())
                 {
-                    CBlock block;
-                    block.ReadFromDisk((*mi).second);
-                    pfrom->PushMessage("block", block);
+                    // The disk and network serializations of a block are identical,
+                    // so the stored bytes are copied into the send buffer as they are
+                    pfrom->BeginMessage("block");
+                    if (ReadRawBlockFromDisk((*mi).second, pfrom->ssSend))
+                        pfrom->EndMessage();
+                    else
+                        pfrom->AbortMessage();
 
                     // Trigger them to send a getblocks request for the next batch of inventory
                     if (inv.hash == pfrom->hashContinue)
@@ -2811,10 +4110,17 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         pfrom->PushMessage("verack");
         pfrom->ssSend.SetVersion(min(pfrom->nVersion, PROTOCOL_VERSION));
 
+        // Peers are handled on several threads, chain state needs cs_main
+        bool fInitialDownload;
+        {
+            LOCK(cs_main);
+            fInitialDownload = IsInitialBlockDownload();
+        }
+
         if (!pfrom->fInbound)
         {
             // Advertise our address
-            if (!fNoListen && !IsInitialBlockDownload())
+            if (!fNoListen && !fInitialDownload)
             {
                 CAddress addr = GetLocalAddress(&pfrom->addr);
                 if (addr.IsRoutable())
@@ -2860,8 +4166,11 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         LogPrintf("receive version message: version %d, blocks=%d, us=%s, them=%s, peer=%s\n", pfrom->nVersion, pfrom->nStartingHeight, addrMe.ToString(), addrFrom.ToString(), pfrom->addr.ToString());
 
         // ppcoin: ask for pending sync-checkpoint if any
-        if (!IsInitialBlockDownload())
+        if (!fInitialDownload)
+        {
+            LOCK(cs_main);
             Checkpoints::AskForPendingSyncCheckpoint(pfrom);
+        }
 
         if (GetBoolArg("-synctime", true))
             AddTimeData(pfrom->addr, nTime);
@@ -2915,9 +4224,8 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                     LOCK(cs_vNodes);
                     // Use deterministic randomness to send to the same nodes for 24 hours
                     // at a time so the setAddrKnowns of the chosen nodes prevent repeats
-                    static uint256 hashSalt;
-                    if (hashSalt == 0)
-                        hashSalt = GetRandHash();
+                    // Initialized once, safe with several message handler threads
+                    static const uint256 hashSalt = GetRandHash();
                     uint64_t hashAddr = addr.GetHash();
                     uint256 hashRand = hashSalt ^ (hashAddr<<32) ^ ((GetTime()+hashAddr)/(24*60*60));
                     hashRand = Hash(BEGIN(hashRand), END(hashRand));
@@ -2967,6 +4275,9 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             }
         }
 
+        BOOST_FOREACH(const CInv& inv, vInv)
+            pfrom->AddInventoryKnown(inv);
+
         LOCK(cs_main);
         CTxDB txdb("r");
 
@@ -2975,12 +4286,15 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             const CInv &inv = vInv[nInv];
 
             boost::this_thread::interruption_point();
-            pfrom->AddInventoryKnown(inv);
 
             bool fAlreadyHave = AlreadyHave(txdb, inv);
             LogPrint("net", "  got inventory: %s  %s\n", inv.ToString(), fAlreadyHave ? "have" : "new");
 
-            if (!fAlreadyHave) {
+            if (inv.type == MSG_BLOCK && IsHeadersFirstSync()) {
+                // New blocks are found through their headers
+                if (!fAlreadyHave && !fImporting)
+                    PushGetHeaders(pfrom);
+            } else if (!fAlreadyHave) {
                 if (!fImporting)
                     pfrom->AskFor(inv);
             } else if (inv.type == MSG_BLOCK && mapOrphanBlocks.count(inv.hash)) {
@@ -3060,10 +4374,18 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         CSyncCheckpoint checkpoint;
         vRecv >> checkpoint;
 
-        if (checkpoint.ProcessSyncCheckpoint(pfrom))
+        bool fAccepted;
+        {
+            LOCK(cs_main);
+            fAccepted = checkpoint.ProcessSyncCheckpoint(pfrom);
+        }
+        if (fAccepted)
         {
             // Relay
-            pfrom->hashCheckpointKnown = checkpoint.hashCheckpoint;
+            {
+                LOCK(pfrom->cs_inventory);
+                pfrom->hashCheckpointKnown = checkpoint.hashCheckpoint;
+            }
             LOCK(cs_vNodes);
             BOOST_FOREACH(CNode* pnode, vNodes)
                 checkpoint.RelayTo(pnode);
@@ -3108,6 +4430,38 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     }
 
 
+    else if (strCommand == "headers")
+    {
+        vector<CBlock> vHeaders;
+        vRecv >> vHeaders;
+        if (vHeaders.size() > MAX_HEADERS_RESULTS)
+        {
+            pfrom->Misbehaving(20);
+            return error("message headers size() = %u", vHeaders.size());
+        }
+
+        LOCK(cs_main);
+
+        // Allow the next request to this peer
+        pfrom->hashLastGetHeadersTip = 0;
+
+        uint256 hashTipBefore = GetHeaderSyncTip();
+        BOOST_FOREACH(const CBlock& header, vHeaders)
+        {
+            boost::this_thread::interruption_point();
+            if (!AcceptBlockHeader(header, pfrom))
+                break;
+        }
+        LogPrint("net", "received %u headers, header chain at height %d\n", vHeaders.size(),
+                 nHeaderChainStart + (int)vHeaderChain.size() - 1);
+
+        // A full message means the peer has more
+        if (vHeaders.size() == MAX_HEADERS_RESULTS &&
+            GetHeaderSyncTip() != hashTipBefore && IsHeadersFirstSync())
+            PushGetHeaders(pfrom);
+    }
+
+
     else if (strCommand == "tx")
     {
         vector<uint256> vWorkQueue;
@@ -3122,7 +4476,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
 
         bool fMissingInputs = false;
 
-        mapAlreadyAskedFor.erase(inv);
+        {
+            LOCK(cs_mapAlreadyAskedFor);
+            mapAlreadyAskedFor.erase(inv);
+        }
 
         if (AcceptToMemoryPool(mempool, tx, true, &fMissingInputs))
         {
@@ -3189,9 +4546,25 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
 
         LOCK(cs_main);
 
+        mapBlocksInFlight.erase(hashBlock);
         if (ProcessBlock(pfrom, &block))
+        {
+            LOCK(cs_mapAlreadyAskedFor);
             mapAlreadyAskedFor.erase(inv);
-        if (block.nDoS) pfrom->Misbehaving(block.nDoS);
+        }
+        if (block.nDoS)
+            pfrom->Misbehaving(block.nDoS);
+
+        // A rejected block invalidates the headers from it on, whether or not
+        // the sender is to blame. Only a block from the future may become
+        // valid later, the others are not asked for again.
+        map<uint256, int>::iterator mh = mapHeaderChain.find(hashBlock);
+        if (mh != mapHeaderChain.end() && !mapBlockIndex.count(hashBlock) && !mapOrphanBlocks.count(hashBlock))
+        {
+            if (block.GetBlockTime() <= FutureDrift(GetAdjustedTime()))
+                setRejectedHeaders.insert(hashBlock);
+            TruncateHeaderChain(mh->second);
+        }
     }
 
 
@@ -3204,7 +4577,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     {
         // Don't return addresses older than nCutOff timestamp
         int64_t nCutOff = GetTime() - (nNodeLifespan * 24 * 60 * 60);
-        pfrom->vAddrToSend.clear();
+        {
+            LOCK(pfrom->cs_vAddrToSend);
+            pfrom->vAddrToSend.clear();
+        }
         vector<CAddress> vAddr = addrman.GetAddr();
         BOOST_FOREACH(const CAddress &addr, vAddr)
             if(addr.nTime > nCutOff)
@@ -3214,8 +4590,6 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
 
     else if (strCommand == "mempool")
     {
-        LOCK(cs_main);
-
         std::vector<uint256> vtxid;
         mempool.queryHashes(vtxid);
         vector<CInv> vInv;
@@ -3315,12 +4689,20 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         vRecv >> alert;
 
         uint256 alertHash = alert.GetHash();
-        if (pfrom->setKnown.count(alertHash) == 0)
+        bool fKnown;
+        {
+            LOCK(pfrom->cs_inventory);
+            fKnown = pfrom->setKnown.count(alertHash) != 0;
+        }
+        if (!fKnown)
         {
             if (alert.ProcessAlert())
             {
                 // Relay
-                pfrom->setKnown.insert(alertHash);
+                {
+                    LOCK(pfrom->cs_inventory);
+                    pfrom->setKnown.insert(alertHash);
+                }
                 {
                     LOCK(cs_vNodes);
                     BOOST_FOREACH(CNode* pnode, vNodes)
@@ -3478,47 +4860,127 @@ bool ProcessMessages(CNode* pfrom)
 
 bool SendMessages(CNode* pto, bool fSendTrickle)
 {
-    TRY_LOCK(cs_main, lockMain);
-    if (lockMain) {
-        // Don't send anything until we get their version message
-        if (pto->nVersion == 0)
-            return true;
+    // Don't send anything until we get their version message
+    if (pto->nVersion == 0)
+        return true;
 
-        //
-        // Message: ping
-        //
-        bool pingSend = false;
-        if (pto->fPingQueued) {
-            // RPC ping request by user
-            pingSend = true;
+    //
+    // Message: ping
+    //
+    bool pingSend = false;
+    if (pto->fPingQueued) {
+        // RPC ping request by user
+        pingSend = true;
+    }
+    if (pto->nPingNonceSent == 0 && pto->nPingUsecStart + PING_INTERVAL * 1000000 < GetTimeMicros()) {
+        // Ping automatically sent as a latency probe & keepalive.
+        pingSend = true;
+    }
+    if (pingSend) {
+        uint64_t nonce = 0;
+        while (nonce == 0) {
+            RAND_bytes((unsigned char*)&nonce, sizeof(nonce));
         }
-        if (pto->nPingNonceSent == 0 && pto->nPingUsecStart + PING_INTERVAL * 1000000 < GetTimeMicros()) {
-            // Ping automatically sent as a latency probe & keepalive.
-            pingSend = true;
+        pto->fPingQueued = false;
+        pto->nPingUsecStart = GetTimeMicros();
+        if (pto->nVersion > BIP0031_VERSION) {
+            pto->nPingNonceSent = nonce;
+            pto->PushMessage("ping", nonce);
+        } else {
+            // Peer is too old to support ping command with nonce, pong will never arrive.
+            pto->nPingNonceSent = 0;
+            pto->PushMessage("ping");
         }
-        if (pingSend) {
-            uint64_t nonce = 0;
-            while (nonce == 0) {
-                RAND_bytes((unsigned char*)&nonce, sizeof(nonce));
+    }
+
+    //
+    // Message: addr
+    //
+    if (fSendTrickle)
+    {
+        vector<CAddress> vAddr;
+        {
+            LOCK(pto->cs_vAddrToSend);
+            vAddr.reserve(pto->vAddrToSend.size());
+            BOOST_FOREACH(const CAddress& addr, pto->vAddrToSend)
+            {
+                // returns true if wasn't already contained in the set
+                if (pto->setAddrKnown.insert(addr).second)
+                    vAddr.push_back(addr);
             }
-            pto->fPingQueued = false;
-            pto->nPingUsecStart = GetTimeMicros();
-            if (pto->nVersion > BIP0031_VERSION) {
-                pto->nPingNonceSent = nonce;
-                pto->PushMessage("ping", nonce);
-            } else {
-                // Peer is too old to support ping command with nonce, pong will never arrive.
-                pto->nPingNonceSent = 0;
-                pto->PushMessage("ping");
+            pto->vAddrToSend.clear();
+        }
+        // receiver rejects addr messages larger than 1000
+        for (unsigned int i = 0; i < vAddr.size(); i += 1000)
+            pto->PushMessage("addr", vector<CAddress>(vAddr.begin() + i, vAddr.begin() + min(i + 1000, (unsigned int)vAddr.size())));
+    }
+
+
+    //
+    // Message: inventory
+    //
+    vector<CInv> vInv;
+    vector<CInv> vInvWait;
+    {
+        LOCK(pto->cs_inventory);
+        vInv.reserve(pto->vInventoryToSend.size());
+        vInvWait.reserve(pto->vInventoryToSend.size());
+        BOOST_FOREACH(const CInv& inv, pto->vInventoryToSend)
+        {
+            if (pto->setInventoryKnown.count(inv))
+                continue;
+
+            // trickle out tx inv to protect privacy
+            if (inv.type == MSG_TX && !fSendTrickle)
+            {
+                // 1/4 of tx invs blast to all immediately
+                static const uint256 hashSalt = GetRandHash();
+                uint256 hashRand = inv.hash ^ hashSalt;
+                hashRand = Hash(BEGIN(hashRand), END(hashRand));
+                bool fTrickleWait = ((hashRand & 3) != 0);
+
+                if (fTrickleWait)
+                {
+                    vInvWait.push_back(inv);
+                    continue;
+                }
+            }
+
+            // returns true if wasn't already contained in the set
+            if (pto->setInventoryKnown.insert(inv).second)
+            {
+                vInv.push_back(inv);
+                if (vInv.size() >= 1000)
+                {
+                    pto->PushMessage("inv", vInv);
+                    vInv.clear();
+                }
             }
         }
+        pto->vInventoryToSend = vInvWait;
+    }
+    if (!vInv.empty())
+        pto->PushMessage("inv", vInv);
+
 
+    // The rest needs chain state, skip it this round if cs_main is busy
+    TRY_LOCK(cs_main, lockMain);
+    if (lockMain) {
         // Start block sync
-        if (pto->fStartSync && !fImporting && !fReindex) {
-            pto->fStartSync = false;
-            PushGetBlocks(pto, pindexBest, uint256(0));
+        if (!fImporting && !fReindex && pto->TakeStartSync()) {
+            if (IsHeadersFirstSync())
+            {
+                nHeaderSyncNode = pto->id;
+                PushGetHeaders(pto);
+            }
+            else
+                PushGetBlocks(pto, pindexBest, uint256(0));
         }
 
+        // Download the blocks of the header chain from every peer
+        if (IsHeadersFirstSync() && !vHeaderChain.empty() && !fImporting && !fReindex)
+            RequestHeaderChainBlocks(pto);
+
         // Resend wallet transactions that haven't gotten in a block yet
         // Except during reindex, importing and IBD, when old wallet
         // transactions become unconfirmed and spams other nodes.
@@ -3536,7 +4998,10 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             {
                 // Periodically clear setAddrKnown to allow refresh broadcasts
                 if (nLastRebroadcast)
+                {
+                    LOCK(pnode->cs_vAddrToSend);
                     pnode->setAddrKnown.clear();
+                }
 
                 // Rebroadcast our address
                 AdvertizeLocal(pnode);
@@ -3545,82 +5010,6 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
                 nLastRebroadcast = GetTime();
         }
 
-        //
-        // Message: addr
-        //
-        if (fSendTrickle)
-        {
-            vector<CAddress> vAddr;
-            vAddr.reserve(pto->vAddrToSend.size());
-            BOOST_FOREACH(const CAddress& addr, pto->vAddrToSend)
-            {
-                // returns true if wasn't already contained in the set
-                if (pto->setAddrKnown.insert(addr).second)
-                {
-                    vAddr.push_back(addr);
-                    // receiver rejects addr messages larger than 1000
-                    if (vAddr.size() >= 1000)
-                    {
-                        pto->PushMessage("addr", vAddr);
-                        vAddr.clear();
-                    }
-                }
-            }
-            pto->vAddrToSend.clear();
-            if (!vAddr.empty())
-                pto->PushMessage("addr", vAddr);
-        }
-
-
-        //
-        // Message: inventory
-        //
-        vector<CInv> vInv;
-        vector<CInv> vInvWait;
-        {
-            LOCK(pto->cs_inventory);
-            vInv.reserve(pto->vInventoryToSend.size());
-            vInvWait.reserve(pto->vInventoryToSend.size());
-            BOOST_FOREACH(const CInv& inv, pto->vInventoryToSend)
-            {
-                if (pto->setInventoryKnown.count(inv))
-                    continue;
-
-                // trickle out tx inv to protect privacy
-                if (inv.type == MSG_TX && !fSendTrickle)
-                {
-                    // 1/4 of tx invs blast to all immediately
-                    static uint256 hashSalt;
-                    if (hashSalt == 0)
-                        hashSalt = GetRandHash();
-                    uint256 hashRand = inv.hash ^ hashSalt;
-                    hashRand = Hash(BEGIN(hashRand), END(hashRand));
-                    bool fTrickleWait = ((hashRand & 3) != 0);
-
-                    if (fTrickleWait)
-                    {
-                        vInvWait.push_back(inv);
-                        continue;
-                    }
-                }
-
-                // returns true if wasn't already contained in the set
-                if (pto->setInventoryKnown.insert(inv).second)
-                {
-                    vInv.push_back(inv);
-                    if (vInv.size() >= 1000)
-                    {
-                        pto->PushMessage("inv", vInv);
-                        vInv.clear();
-                    }
-                }
-            }
-            pto->vInventoryToSend = vInvWait;
-        }
-        if (!vInv.empty())
-            pto->PushMessage("inv", vInv);
-
-
         //
         // Message: getdata
         //
@@ -3640,13 +5029,15 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
                     pto->PushMessage("getdata", vGetData);
                     vGetData.clear();
                 }
-                mapAlreadyAskedFor[inv] = nNow;
+                {
+                    LOCK(cs_mapAlreadyAskedFor);
+                    mapAlreadyAskedFor[inv] = nNow;
+                }
             }
             pto->mapAskFor.erase(pto->mapAskFor.begin());
         }
         if (!vGetData.empty())
             pto->PushMessage("getdata", vGetData);
-
     }
     return true;
 }
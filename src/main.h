@@ -8,7 +8,6 @@
 #include "core.h"
 #include "bignum.h"
 #include "sync.h"
-#include "txmempool.h"
 #include "net.h"
 #include "hashX11.h"
 
@@ -20,6 +19,7 @@ class CInv;
 class CKeyItem;
 class CNode;
 class CReserveKey;
+class CTxMemPool;
 class CWallet;
 
 /** The maximum allowed size for a serialized block, in bytes (network rule) */
@@ -38,8 +38,41 @@ static const unsigned int MAX_TX_SIGOPS = MAX_BLOCK_SIGOPS/5;
 static const unsigned int MAX_ORPHAN_TRANSACTIONS = MAX_BLOCK_SIZE/100;
 /** Default for -maxorphanblocks, maximum number of orphan blocks kept in memory */
 static const unsigned int DEFAULT_MAX_ORPHAN_BLOCKS = 750;
+/** Default for -maxorphanblocksmb, megabytes of orphan blocks kept in memory */
+static const unsigned int DEFAULT_MAX_ORPHAN_BLOCKS_SIZE = 40;
+/** Default for -orphanspillmb, megabytes of orphan blocks moved to a temporary file (0 = off) */
+static const unsigned int DEFAULT_ORPHAN_SPILL_SIZE = 0;
+/** Default for -maxmempool, megabytes of memory the transaction pool may use */
+static const unsigned int DEFAULT_MAX_MEMPOOL_SIZE = 300;
+/** Default for -mempoolexpiry, hours a transaction may wait in the pool */
+static const unsigned int DEFAULT_MEMPOOL_EXPIRY = 72;
+/** Maximum number of script-checking threads allowed */
+static const int MAX_SCRIPTCHECK_THREADS = 16;
+/** -par default (number of script-checking threads, 0 = auto) */
+static const int DEFAULT_SCRIPTCHECK_THREADS = 0;
+/** Default for -blockcachesize, number of recently read blocks kept decoded in memory */
+static const unsigned int DEFAULT_BLOCK_CACHE_SIZE = 64;
+/** Upper limit for -blockcachesize */
+static const unsigned int MAX_BLOCK_CACHE_SIZE = 1024;
+/** Default for -coinscachesize, megabytes of transaction outputs kept in memory */
+static const unsigned int DEFAULT_COINS_CACHE_SIZE = 100;
 /** The maximum number of entries in an 'inv' protocol message */
 static const unsigned int MAX_INV_SZ = 50000;
+/** Number of headers sent in one 'headers' message */
+static const unsigned int MAX_HEADERS_RESULTS = 2000;
+/** Number of headers of a competing branch kept while it has less trust than the header chain */
+static const unsigned int MAX_HEADER_FORK_LENGTH = 50 * MAX_HEADERS_RESULTS;
+/** Number of rejected blocks whose headers are refused during header sync */
+static const unsigned int MAX_REJECTED_HEADERS = 1000;
+/** Default for -headersfirst, download headers before blocks during the initial sync */
+static const bool DEFAULT_HEADERS_FIRST = true;
+/** Number of blocks past the best block that can be downloaded in parallel,
+ *  they are held as orphans so this stays below -maxorphanblocks */
+static const unsigned int BLOCK_DOWNLOAD_WINDOW = 500;
+/** Number of blocks that can be requested from a single peer at a time */
+static const unsigned int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 16;
+/** Seconds after which a requested block is asked from another peer */
+static const int64_t BLOCK_DOWNLOAD_TIMEOUT = 60;
 /** Fees smaller than this (in satoshi) are considered zero fee (for transaction creation) */
 static const int64_t MIN_TX_FEE = 10000;
 /** Fees smaller than this (in satoshi) are considered zero fee (for relaying) */
@@ -74,15 +107,24 @@ extern bool fReindex;
 struct COrphanBlock;
 extern std::map<uint256, COrphanBlock*> mapOrphanBlocks;
 extern bool fHaveGUI;
+extern int nScriptCheckThreads;
+extern unsigned int nBlockCacheSize;
+extern uint64_t nCoinsCacheSize;
+extern uint64_t nMaxOrphanBlocksSize;
+extern uint64_t nMaxOrphanSpillSize;
+extern uint64_t nMaxMempoolSize;
+extern int64_t nMempoolExpiry;
 
 // Settings
 extern bool fUseFastIndex;
+extern bool fHeadersFirst;
 extern unsigned int nDerivationMethodIndex;
 
 // Minimum disk space required - used in CheckDiskSpace()
 static const uint64_t nMinDiskSpace = 52428800;
 
 class CReserveKey;
+class CScriptCheck;
 class CTxDB;
 class CTxIndex;
 class CWalletInterface;
@@ -109,12 +151,20 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock);
 bool CheckDiskSpace(uint64_t nAdditionalBytes=0);
 FILE* OpenBlockFile(unsigned int nFile, unsigned int nBlockPos, const char* pszMode="rb");
 FILE* AppendBlockFile(unsigned int& nFileRet);
+/** Append the stored serialization of a block to ssRet without decoding it */
+bool ReadRawBlockFromDisk(const CBlockIndex* pindex, CDataStream& ssRet);
+/** Close the read-only block file handles kept open by the block read cache */
+void CloseBlockFiles();
+/** Drop the orphan blocks moved to disk and delete their spill file */
+void CloseOrphanBlockSpill();
 bool LoadBlockIndex(bool fAllowNew=true);
 void PrintBlockTree();
 CBlockIndex* FindBlockByHeight(int nHeight);
 bool ProcessMessages(CNode* pfrom);
 bool SendMessages(CNode* pto, bool fSendTrickle);
 void ThreadImport(std::vector<boost::filesystem::path> vImportFiles);
+/** Run an instance of the script checking thread */
+void ThreadScriptCheck();
 
 bool CheckProofOfWork(uint256 hash, unsigned int nBits);
 unsigned int GetNextTargetRequired(const CBlockIndex* pindexLast, bool fProofOfStake);
@@ -133,6 +183,41 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CTransaction &tx, bool fLimitFree, boo
 
 
 
+/** Counters for the block file read cache, see GetBlockCacheStats() */
+struct CBlockCacheStats
+{
+    uint64_t nHits;
+    uint64_t nMisses;
+    unsigned int nBlocks;
+    unsigned int nMaxBlocks;
+    unsigned int nOpenFiles;
+};
+void GetBlockCacheStats(CBlockCacheStats& stats);
+
+/** Counters for the coins cache, see GetCoinsCacheStats() */
+struct CCoinsCacheStats
+{
+    uint64_t nHits;
+    uint64_t nMisses;
+    unsigned int nEntries;
+    uint64_t nBytes;
+    uint64_t nMaxBytes;
+};
+void GetCoinsCacheStats(CCoinsCacheStats& stats);
+
+/** Counters for the orphan block pool, see GetOrphanBlocksStats() */
+struct COrphanBlocksStats
+{
+    unsigned int nBlocks;
+    uint64_t nBytes;
+    uint64_t nMaxBytes;
+    unsigned int nSpilled;
+    uint64_t nSpilledBytes;
+    uint64_t nMaxSpilledBytes;
+    uint64_t nEvicted;
+};
+void GetOrphanBlocksStats(COrphanBlocksStats& stats);
+
 /** Position on disk for a particular transaction. */
 class CDiskTxPos
 {
@@ -189,7 +274,8 @@ enum GetMinFee_mode
     GMF_SEND,
 };
 
-typedef std::map<uint256, std::pair<CTxIndex, CTransaction> > MapPrevTx;
+class CCoins;
+typedef std::map<uint256, std::pair<CTxIndex, CCoins> > MapPrevTx;
 
 int64_t GetMinFee(const CTransaction& tx, unsigned int nBlockSize = 1, enum GetMinFee_mode mode = GMF_BLOCK, unsigned int nBytes = 0);
 
@@ -210,6 +296,15 @@ public:
     mutable int nDoS;
     bool DoS(int nDoSIn, bool fIn) const { nDoS += nDoSIn; return fIn; }
 
+private:
+    // memory only: hash of the transaction, valid while fHashCached is set.
+    // Only written by whoever owns the transaction (on deserialization and by
+    // UpdateHash()), never by GetHash(), so shared transactions can be hashed
+    // from any thread.
+    uint256 hashCached;
+    bool fHashCached;
+
+public:
     CTransaction()
     {
         SetNull();
@@ -218,6 +313,7 @@ public:
     CTransaction(int nVersion, unsigned int nTime, const std::vector<CTxIn>& vin, const std::vector<CTxOut>& vout, unsigned int nLockTime)
         : nVersion(nVersion), nTime(nTime), vin(vin), vout(vout), nLockTime(nLockTime), nDoS(0)
     {
+        UpdateHash();
     }
 
     IMPLEMENT_SERIALIZE
@@ -228,6 +324,9 @@ public:
         READWRITE(vin);
         READWRITE(vout);
         READWRITE(nLockTime);
+        // this is only const in the serializing methods, where fRead is false
+        if (fRead)
+            const_cast<CTransaction*>(this)->UpdateHash();
     )
 
     void SetNull()
@@ -238,6 +337,7 @@ public:
         vout.clear();
         nLockTime = 0;
         nDoS = 0;  // Denial-of-service prevention
+        fHashCached = false;
     }
 
     bool IsNull() const
@@ -245,11 +345,22 @@ public:
         return (vin.empty() && vout.empty());
     }
 
+    /** Returns the cached hash if there is one, otherwise computes it without caching it.
+        Code that modifies a deserialized or already hashed transaction must call
+        UpdateHash() afterwards. */
     uint256 GetHash() const
     {
+        if (fHashCached)
+            return hashCached;
         return SerializeHash(*this);
     }
 
+    void UpdateHash()
+    {
+        hashCached = SerializeHash(*this);
+        fHashCached = true;
+    }
+
     bool IsCoinBase() const
     {
         return (vin.size() == 1 && vin[0].prevout.IsNull() && vout.size() >= 1);
@@ -286,32 +397,7 @@ public:
      */
     int64_t GetValueIn(const MapPrevTx& mapInputs) const;
 
-    bool ReadFromDisk(CDiskTxPos pos, FILE** pfileRet=NULL)
-    {
-        CAutoFile filein = CAutoFile(OpenBlockFile(pos.nFile, 0, pfileRet ? "rb+" : "rb"), SER_DISK, CLIENT_VERSION);
-        if (!filein)
-            return error("CTransaction::ReadFromDisk() : OpenBlockFile failed");
-
-        // Read transaction
-        if (fseek(filein, pos.nTxPos, SEEK_SET) != 0)
-            return error("CTransaction::ReadFromDisk() : fseek failed");
-
-        try {
-            filein >> *this;
-        }
-        catch (std::exception &e) {
-            return error("%s() : deserialize or I/O error", __PRETTY_FUNCTION__);
-        }
-
-        // Return file pointer
-        if (pfileRet)
-        {
-            if (fseek(filein, pos.nTxPos, SEEK_SET) != 0)
-                return error("CTransaction::ReadFromDisk() : second fseek failed");
-            *pfileRet = filein.release();
-        }
-        return true;
-    }
+    bool ReadFromDisk(CDiskTxPos pos, FILE** pfileRet=NULL);
 
     friend bool operator==(const CTransaction& a, const CTransaction& b)
     {
@@ -373,17 +459,95 @@ public:
         @param[in] pindexBlock
         @param[in] fBlock	true if called from ConnectBlock
         @param[in] fMiner	true if called from CreateNewBlock
+        @param[out] pvChecks	if not NULL, script checks are pushed onto it instead of being performed inline
         @return Returns true if all checks succeed
      */
     bool ConnectInputs(CTxDB& txdb, MapPrevTx inputs,
                        std::map<uint256, CTxIndex>& mapTestPool, const CDiskTxPos& posThisTx,
-                       const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, unsigned int flags = STANDARD_SCRIPT_VERIFY_FLAGS);
+                       const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, unsigned int flags = STANDARD_SCRIPT_VERIFY_FLAGS,
+                       std::vector<CScriptCheck> *pvChecks = NULL);
     bool CheckTransaction() const;
     bool GetCoinAge(CTxDB& txdb, uint64_t& nCoinAge) const;  // ppcoin: get transaction coin age
 
     const CTxOut& GetOutputFor(const CTxIn& input, const MapPrevTx& inputs) const;
 };
 
+/** The outputs of a transaction, with the few properties of the transaction
+ * itself that are needed to validate spends of them. Inputs are checked
+ * against these instead of the full previous transaction, so they can be
+ * kept in memory by the coins cache.
+ */
+class CCoins
+{
+public:
+    unsigned int nTime;
+    bool fCoinBase;
+    bool fCoinStake;
+    std::vector<CTxOut> vout;
+
+    CCoins() : nTime(0), fCoinBase(false), fCoinStake(false) {}
+
+    explicit CCoins(const CTransaction& tx) :
+        nTime(tx.nTime), fCoinBase(tx.IsCoinBase()), fCoinStake(tx.IsCoinStake()), vout(tx.vout) {}
+
+    bool IsCoinBase() const
+    {
+        return fCoinBase;
+    }
+
+    bool IsCoinStake() const
+    {
+        return fCoinStake;
+    }
+
+    // Approximate heap and object size, used to bound the coins cache
+    size_t GetMemoryUsage() const
+    {
+        size_t nSize = sizeof(CCoins) + vout.capacity() * sizeof(CTxOut);
+        BOOST_FOREACH(const CTxOut& txout, vout)
+            nSize += txout.scriptPubKey.capacity();
+        return nSize;
+    }
+
+    std::string ToString() const
+    {
+        std::string str;
+        str += fCoinBase ? "Coinbase" : (fCoinStake ? "Coinstake" : "CCoins");
+        str += strprintf("(nTime=%d, vout.size=%u)\n", nTime, vout.size());
+        for (unsigned int i = 0; i < vout.size(); i++)
+            str += "    " + vout[i].ToString() + "\n";
+        return str;
+    }
+};
+
+/** Closure representing one script verification
+ *  Note that this stores references to the spending transaction */
+class CScriptCheck
+{
+private:
+    CScript scriptPubKey;
+    const CTransaction *ptxTo;
+    unsigned int nIn;
+    unsigned int nFlags;
+    int nHashType;
+
+public:
+    CScriptCheck() : ptxTo(0), nIn(0), nFlags(0), nHashType(0) {}
+    CScriptCheck(const CCoins& txFromIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, int nHashTypeIn) :
+        scriptPubKey(txFromIn.vout[txToIn.vin[nInIn].prevout.n].scriptPubKey),
+        ptxTo(&txToIn), nIn(nInIn), nFlags(nFlagsIn), nHashType(nHashTypeIn) { }
+
+    bool operator()() const;
+
+    void swap(CScriptCheck &check) {
+        scriptPubKey.swap(check.scriptPubKey);
+        std::swap(ptxTo, check.ptxTo);
+        std::swap(nIn, check.nIn);
+        std::swap(nFlags, check.nFlags);
+        std::swap(nHashType, check.nHashType);
+    }
+};
+
 /** wrapper for CTxOut that provides a more compact serialization */
 class CTxOutCompressor
 {
@@ -576,6 +740,9 @@ public:
     // memory only
     mutable std::vector<uint256> vMerkleTree;
 
+    // memory only: set once CheckBlock passed with all checks enabled
+    mutable bool fChecked;
+
     // Denial-of-service detection:
     mutable int nDoS;
     bool DoS(int nDoSIn, bool fIn) const { nDoS += nDoSIn; return fIn; }
@@ -619,6 +786,7 @@ public:
         vtx.clear();
         vchBlockSig.clear();
         vMerkleTree.clear();
+        fChecked = false;
         nDoS = 0;
     }
 
@@ -750,31 +918,7 @@ public:
         return true;
     }
 
-    bool ReadFromDisk(unsigned int nFile, unsigned int nBlockPos, bool fReadTransactions=true)
-    {
-        SetNull();
-
-        // Open history file to read
-        CAutoFile filein = CAutoFile(OpenBlockFile(nFile, nBlockPos, "rb"), SER_DISK, CLIENT_VERSION);
-        if (!filein)
-            return error("CBlock::ReadFromDisk() : OpenBlockFile failed");
-        if (!fReadTransactions)
-            filein.nType |= SER_BLOCKHEADERONLY;
-
-        // Read block
-        try {
-            filein >> *this;
-        }
-        catch (std::exception &e) {
-            return error("%s() : deserialize or I/O error", __PRETTY_FUNCTION__);
-        }
-
-        // Check the header
-        if (fReadTransactions && IsProofOfWork() && !CheckProofOfWork(GetHash(), nBits))
-            return error("CBlock::ReadFromDisk() : errors in block header");
-
-        return true;
-    }
+    bool ReadFromDisk(unsigned int nFile, unsigned int nBlockPos, bool fReadTransactions=true);
 
 
 
@@ -945,6 +1089,7 @@ public:
     }
 
     uint256 GetBlockTrust() const;
+    static uint256 GetBlockTrust(unsigned int nBits);
 
     bool IsInMainChain() const
     {
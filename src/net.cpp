@@ -7,6 +7,7 @@
 #include "db.h"
 #include "net.h"
 #include "main.h"
+#include "txmempool.h"
 #include "addrman.h"
 #include "ui_interface.h"
 
@@ -14,6 +15,11 @@
 #include <string.h>
 #endif
 
+#ifdef __linux__
+#include <sys/epoll.h>
+#define USE_EPOLL
+#endif
+
 #ifdef USE_UPNP
 #include <miniupnpc/miniwget.h>
 #include <miniupnpc/miniupnpc.h>
@@ -48,6 +54,10 @@ static bool vfReachable[NET_MAX] = {};
 static bool vfLimited[NET_MAX] = {};
 static CNode* pnodeLocalHost = NULL;
 static CNode* pnodeSync = NULL;
+// Protects pnodeSync and CNode::fStartSync, the sync node is chosen on one
+// message handler thread and started on the thread that owns it
+static CCriticalSection cs_nodeSync;
+static int nMessageHandlerThreads = 1;
 uint64_t nLocalHostNonce = 0;
 static std::vector<SOCKET> vhListenSocket;
 CAddrMan addrman;
@@ -58,6 +68,7 @@ map<CInv, CDataStream> mapRelay;
 deque<pair<int64_t, CInv> > vRelayExpiration;
 CCriticalSection cs_mapRelay;
 map<CInv, int64_t> mapAlreadyAskedFor;
+CCriticalSection cs_mapAlreadyAskedFor;
 
 static deque<string> vOneShots;
 CCriticalSection cs_vOneShots;
@@ -74,6 +85,42 @@ static CSemaphore *semOutbound = NULL;
 static CNodeSignals g_signals;
 CNodeSignals& GetNodeSignals() { return g_signals; }
 
+#ifdef USE_EPOLL
+// Edge-triggered epoll instance for the listen and peer sockets, -1 to use select()
+static int hEpoll = -1;
+static const int MAX_EPOLL_EVENTS = 256;
+// Milliseconds to wait before retrying a peer whose buffers another thread holds
+static const int EPOLL_RETRY_WAIT = 5;
+
+static void EpollAddSocket(SOCKET hSocket, CNode* pnode)
+{
+    if (hEpoll == -1)
+        return;
+    struct epoll_event event;
+    event.events = (pnode ? EPOLLIN | EPOLLOUT | EPOLLRDHUP : EPOLLIN) | EPOLLET;
+    event.data.ptr = pnode; // NULL for listen sockets
+    if (epoll_ctl(hEpoll, EPOLL_CTL_ADD, hSocket, &event) == -1)
+        LogPrintf("epoll_ctl add socket failed, error %d\n", errno);
+}
+#endif
+
+// Add a new peer to vNodes, pin it to the least loaded message handler
+// thread and register its socket with the socket handler
+static void AddNode(CNode* pnode)
+{
+    {
+        LOCK(cs_vNodes);
+        vector<int> vLoad(nMessageHandlerThreads, 0);
+        BOOST_FOREACH(CNode* pnodeOther, vNodes)
+            vLoad[pnodeOther->nMessageThread]++;
+        pnode->nMessageThread = min_element(vLoad.begin(), vLoad.end()) - vLoad.begin();
+        vNodes.push_back(pnode);
+    }
+#ifdef USE_EPOLL
+    EpollAddSocket(pnode->hSocket, pnode);
+#endif
+}
+
 void AddOneShot(string strDest)
 {
     LOCK(cs_vOneShots);
@@ -388,11 +435,7 @@ CNode* ConnectNode(CAddress addrConnect, const char *pszDest)
         // Add node
         CNode* pnode = new CNode(hSocket, addrConnect, pszDest ? pszDest : "", false);
         pnode->AddRef();
-
-        {
-            LOCK(cs_vNodes);
-            vNodes.push_back(pnode);
-        }
+        AddNode(pnode);
 
         pnode->nTimeConnected = GetTime();
         return pnode;
@@ -421,10 +464,19 @@ void CNode::CloseSocketDisconnect()
         vRecvMsg.clear();
 
     // if this was the sync node, we'll need a new one
+    LOCK(cs_nodeSync);
     if (this == pnodeSync)
         pnodeSync = NULL;
 }
 
+bool CNode::TakeStartSync()
+{
+    LOCK(cs_nodeSync);
+    bool fStart = fStartSync;
+    fStartSync = false;
+    return fStart;
+}
+
 void CNode::PushVersion()
 {
     /// when NTP implemented, change to just nTime = GetAdjustedTime()
@@ -443,6 +495,8 @@ void CNode::PushVersion()
 
 std::map<CNetAddr, int64_t> CNode::setBanned;
 CCriticalSection CNode::cs_setBanned;
+NodeId CNode::nLastNodeId = 0;
+CCriticalSection CNode::cs_nLastNodeId;
 
 void CNode::ClearBanned()
 {
@@ -506,7 +560,10 @@ void CNode::copyStats(CNodeStats &stats)
     X(nMisbehavior);
     X(nSendBytes);
     X(nRecvBytes);
-    stats.fSyncNode = (this == pnodeSync);
+    {
+        LOCK(cs_nodeSync);
+        stats.fSyncNode = (this == pnodeSync);
+    }
 
     // It is common for nodes with good ping times to suddenly become lagged,
     // due to a new block arriving or other large transfer.
@@ -661,75 +718,367 @@ void SocketSendData(CNode *pnode)
 
 static list<CNode*> vNodesDisconnected;
 
-void ThreadSocketHandler()
+static void DisconnectNodes(unsigned int& nPrevNodeCount)
 {
-    unsigned int nPrevNodeCount = 0;
-
-    while (true)
     {
-        //
-        // Disconnect nodes
-        //
+        LOCK(cs_vNodes);
+        // Disconnect unused nodes
+        vector<CNode*> vNodesCopy = vNodes;
+        BOOST_FOREACH(CNode* pnode, vNodesCopy)
         {
-            LOCK(cs_vNodes);
-            // Disconnect unused nodes
-            vector<CNode*> vNodesCopy = vNodes;
-            BOOST_FOREACH(CNode* pnode, vNodesCopy)
+            if (pnode->fDisconnect ||
+                (pnode->GetRefCount() <= 0 && pnode->vRecvMsg.empty() && pnode->nSendSize == 0 && pnode->ssSend.empty()))
             {
-                if (pnode->fDisconnect ||
-                    (pnode->GetRefCount() <= 0 && pnode->vRecvMsg.empty() && pnode->nSendSize == 0 && pnode->ssSend.empty()))
-                {
-                    // remove from vNodes
-                    vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
+                // remove from vNodes
+                vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
 
-                    // release outbound grant (if any)
-                    pnode->grantOutbound.Release();
+                // release outbound grant (if any)
+                pnode->grantOutbound.Release();
 
-                    // close socket and cleanup
-                    pnode->CloseSocketDisconnect();
+                // close socket and cleanup
+                pnode->CloseSocketDisconnect();
 
-                    // hold in disconnected pool until all refs are released
-                    if (pnode->fNetworkNode || pnode->fInbound)
-                        pnode->Release();
-                    vNodesDisconnected.push_back(pnode);
-                }
+                // hold in disconnected pool until all refs are released
+                if (pnode->fNetworkNode || pnode->fInbound)
+                    pnode->Release();
+                vNodesDisconnected.push_back(pnode);
             }
         }
+    }
+    {
+        // Delete disconnected nodes
+        list<CNode*> vNodesDisconnectedCopy = vNodesDisconnected;
+        BOOST_FOREACH(CNode* pnode, vNodesDisconnectedCopy)
         {
-            // Delete disconnected nodes
-            list<CNode*> vNodesDisconnectedCopy = vNodesDisconnected;
-            BOOST_FOREACH(CNode* pnode, vNodesDisconnectedCopy)
+            // wait until threads are done using it
+            if (pnode->GetRefCount() <= 0)
             {
-                // wait until threads are done using it
-                if (pnode->GetRefCount() <= 0)
+                bool fDelete = false;
                 {
-                    bool fDelete = false;
+                    TRY_LOCK(pnode->cs_vSend, lockSend);
+                    if (lockSend)
                     {
-                        TRY_LOCK(pnode->cs_vSend, lockSend);
-                        if (lockSend)
+                        TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+                        if (lockRecv)
                         {
-                            TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                            if (lockRecv)
-                            {
-                                TRY_LOCK(pnode->cs_inventory, lockInv);
-                                if (lockInv)
-                                    fDelete = true;
-                            }
+                            TRY_LOCK(pnode->cs_inventory, lockInv);
+                            if (lockInv)
+                                fDelete = true;
                         }
                     }
-                    if (fDelete)
-                    {
-                        vNodesDisconnected.remove(pnode);
-                        delete pnode;
-                    }
                 }
+                if (fDelete)
+                {
+                    vNodesDisconnected.remove(pnode);
+                    delete pnode;
+                }
+            }
+        }
+    }
+    if(vNodes.size() != nPrevNodeCount) {
+        nPrevNodeCount = vNodes.size();
+        uiInterface.NotifyNumConnectionsChanged(nPrevNodeCount);
+    }
+}
+
+// Accept one pending connection, returns false if there was none. If
+// pfRetry is given it is set when accept() failed for lack of resources,
+// leaving connections pending that have to be accepted later.
+static bool AcceptConnection(SOCKET hListenSocket, bool* pfRetry = NULL)
+{
+    struct sockaddr_storage sockaddr;
+    socklen_t len = sizeof(sockaddr);
+    SOCKET hSocket = accept(hListenSocket, (struct sockaddr*)&sockaddr, &len);
+    CAddress addr;
+    int nInbound = 0;
+
+    if (hSocket != INVALID_SOCKET)
+        if (!addr.SetSockAddr((const struct sockaddr*)&sockaddr))
+            LogPrintf("Warning: Unknown socket family\n");
+
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodes)
+            if (pnode->fInbound)
+                nInbound++;
+    }
+
+    if (hSocket == INVALID_SOCKET)
+    {
+        int nErr = WSAGetLastError();
+        if (nErr != WSAEWOULDBLOCK)
+            LogPrintf("socket error accept failed: %d\n", nErr);
+#ifdef USE_EPOLL
+        if (pfRetry && (nErr == EMFILE || nErr == ENFILE || nErr == ENOBUFS || nErr == ENOMEM))
+            *pfRetry = true;
+#endif
+        return false;
+    }
+    else if (nInbound >= GetArg("-maxconnections", 125) - MAX_OUTBOUND_CONNECTIONS)
+    {
+        closesocket(hSocket);
+    }
+    else if (CNode::IsBanned(addr))
+    {
+        LogPrintf("connection from %s dropped (banned)\n", addr.ToString());
+        closesocket(hSocket);
+    }
+    else
+    {
+        LogPrint("net", "accepted connection %s\n", addr.ToString());
+        CNode* pnode = new CNode(hSocket, addr, "", true);
+        pnode->AddRef();
+        AddNode(pnode);
+    }
+    return true;
+}
+
+// Read from a socket that reported data, returns false once the socket has
+// nothing more to read or was closed. If pfLocked is given it is set when the
+// receive buffer was held by another thread and nothing could be read.
+static bool SocketRecvData(CNode* pnode, bool* pfLocked = NULL)
+{
+    TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+    if (!lockRecv)
+    {
+        if (pfLocked)
+            *pfLocked = true;
+        return true;
+    }
+
+    if (pnode->GetTotalRecvSize() > ReceiveFloodSize()) {
+        if (!pnode->fDisconnect)
+            LogPrintf("socket recv flood control disconnect (%u bytes)\n", pnode->GetTotalRecvSize());
+        pnode->CloseSocketDisconnect();
+        return false;
+    }
+
+    // typical socket buffer is 8K-64K
+    char pchBuf[0x10000];
+    int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
+    if (nBytes > 0)
+    {
+        if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
+            pnode->CloseSocketDisconnect();
+        pnode->nLastRecv = GetTime();
+        pnode->nRecvBytes += nBytes;
+        pnode->RecordBytesRecv(nBytes);
+        return pnode->hSocket != INVALID_SOCKET;
+    }
+    else if (nBytes == 0)
+    {
+        // socket closed gracefully
+        if (!pnode->fDisconnect)
+            LogPrint("net", "socket closed\n");
+        pnode->CloseSocketDisconnect();
+    }
+    else if (nBytes < 0)
+    {
+        // error
+        int nErr = WSAGetLastError();
+        if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
+        {
+            if (!pnode->fDisconnect)
+                LogPrintf("socket recv error %d\n", nErr);
+            pnode->CloseSocketDisconnect();
+        }
+        else if (nErr == WSAEINTR)
+            return true;
+    }
+    return false;
+}
+
+static void CheckInactivity(CNode* pnode)
+{
+    int64_t nTime = GetTime();
+    if (nTime - pnode->nTimeConnected > 60)
+    {
+        if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
+        {
+            LogPrint("net", "socket no message in first 60 seconds, %d %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0);
+            pnode->fDisconnect = true;
+        }
+        else if (nTime - pnode->nLastSend > TIMEOUT_INTERVAL)
+        {
+            LogPrintf("socket sending timeout: %ds\n", nTime - pnode->nLastSend);
+            pnode->fDisconnect = true;
+        }
+        else if (nTime - pnode->nLastRecv > (pnode->nVersion > BIP0031_VERSION ? TIMEOUT_INTERVAL : 90*60))
+        {
+            LogPrintf("socket receive timeout: %ds\n", nTime - pnode->nLastRecv);
+            pnode->fDisconnect = true;
+        }
+        else if (pnode->nPingNonceSent && pnode->nPingUsecStart + TIMEOUT_INTERVAL * 1000000 < GetTimeMicros())
+        {
+            LogPrintf("ping timeout: %fs\n", 0.000001 * (GetTimeMicros() - pnode->nPingUsecStart));
+            pnode->fDisconnect = true;
+        }
+    }
+}
+
+#ifdef USE_EPOLL
+// The kernel reports which sockets became readable or writable, so each pass
+// only touches those peers instead of rebuilding fd_sets over all of vNodes.
+// Sockets are edge-triggered: a peer stays in setReady, holding a reference,
+// until its socket has been read dry.
+static void ThreadSocketHandlerEpoll()
+{
+    unsigned int nPrevNodeCount = 0;
+    int64_t nLastInactivityCheck = 0;
+    std::set<CNode*> setReady;
+    bool fPending = false;
+    bool fBusy = false;
+    int64_t nAcceptRetryTime = 0;
+    struct epoll_event vEvents[MAX_EPOLL_EVENTS];
+
+    while (true)
+    {
+        DisconnectNodes(nPrevNodeCount);
+
+        // Don't wait for new events while some socket still has data we could
+        // not get to, and only briefly while a peer's buffers are held by a
+        // message handler, which may be busy for a while
+        int nTimeout = fPending ? 0 : (fBusy ? EPOLL_RETRY_WAIT : 50);
+        int nEvents = epoll_wait(hEpoll, vEvents, MAX_EPOLL_EVENTS, nTimeout);
+        boost::this_thread::interruption_point();
+
+        if (nEvents < 0)
+        {
+            if (errno != EINTR)
+            {
+                LogPrintf("socket epoll error %d\n", errno);
+                MilliSleep(50);
+            }
+            nEvents = 0;
+        }
+
+        // The listen sockets are edge-triggered too, connections left pending
+        // after accept() ran out of descriptors won't raise another event
+        bool fAccept = nAcceptRetryTime && GetTime() >= nAcceptRetryTime;
+        {
+            LOCK(cs_vNodes);
+            for (int i = 0; i < nEvents; i++)
+            {
+                CNode* pnode = (CNode*)vEvents[i].data.ptr;
+                if (pnode == NULL)
+                {
+                    fAccept = true;
+                    continue;
+                }
+                if (vEvents[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+                    pnode->fRecvReady = true;
+                if (setReady.insert(pnode).second)
+                    pnode->AddRef();
             }
         }
-        if(vNodes.size() != nPrevNodeCount) {
-            nPrevNodeCount = vNodes.size();
-            uiInterface.NotifyNumConnectionsChanged(nPrevNodeCount);
+
+        //
+        // Accept new connections
+        //
+        if (fAccept)
+        {
+            bool fAcceptRetry = false;
+            BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
+            {
+                while (hListenSocket != INVALID_SOCKET && AcceptConnection(hListenSocket, &fAcceptRetry))
+                    boost::this_thread::interruption_point();
+            }
+            nAcceptRetryTime = fAcceptRetry ? GetTime() + 1 : 0;
         }
 
+        //
+        // Service ready sockets
+        //
+        fPending = false;
+        fBusy = false;
+        for (std::set<CNode*>::iterator it = setReady.begin(); it != setReady.end(); )
+        {
+            boost::this_thread::interruption_point();
+            CNode* pnode = *it;
+            bool fLocked = false;
+
+            //
+            // Send
+            //
+            bool fDraining = true;
+            if (pnode->hSocket != INVALID_SOCKET)
+            {
+                TRY_LOCK(pnode->cs_vSend, lockSend);
+                if (lockSend)
+                {
+                    if (!pnode->vSendMsg.empty())
+                        SocketSendData(pnode);
+                    fDraining = !pnode->vSendMsg.empty();
+                }
+                else
+                    fLocked = true;
+            }
+
+            //
+            // Receive, unless draining the write queue
+            //
+            if (pnode->fRecvReady && !fDraining)
+            {
+                for (int i = 0; i < 4 && pnode->fRecvReady && !fLocked; i++)
+                    pnode->fRecvReady = pnode->hSocket != INVALID_SOCKET && SocketRecvData(pnode, &fLocked);
+                // Data is still waiting once the read limit per pass is hit
+                fPending |= pnode->fRecvReady && !fLocked;
+            }
+
+            if (pnode->hSocket == INVALID_SOCKET || (!pnode->fRecvReady && !fLocked))
+            {
+                pnode->fRecvReady = false;
+                {
+                    LOCK(cs_vNodes);
+                    pnode->Release();
+                }
+                setReady.erase(it++);
+            }
+            else
+            {
+                fBusy |= fLocked;
+                it++;
+            }
+        }
+
+        //
+        // Inactivity checking
+        //
+        if (GetTime() != nLastInactivityCheck)
+        {
+            nLastInactivityCheck = GetTime();
+            LOCK(cs_vNodes);
+            BOOST_FOREACH(CNode* pnode, vNodes)
+            {
+                CheckInactivity(pnode);
+                // Safety net for a send queue that missed its EPOLLOUT edge
+                if (pnode->nSendSize > 0 && setReady.insert(pnode).second)
+                    pnode->AddRef();
+            }
+        }
+    }
+}
+#endif
+
+void ThreadSocketHandler()
+{
+#ifdef USE_EPOLL
+    if (hEpoll != -1)
+    {
+        ThreadSocketHandlerEpoll();
+        return;
+    }
+#endif
+
+    unsigned int nPrevNodeCount = 0;
+
+    while (true)
+    {
+        //
+        // Disconnect nodes
+        //
+        DisconnectNodes(nPrevNodeCount);
+
 
         //
         // Find which sockets have data to receive
@@ -797,51 +1146,8 @@ void ThreadSocketHandler()
         // Accept new connections
         //
         BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
-        if (hListenSocket != INVALID_SOCKET && FD_ISSET(hListenSocket, &fdsetRecv))
-        {
-            struct sockaddr_storage sockaddr;
-            socklen_t len = sizeof(sockaddr);
-            SOCKET hSocket = accept(hListenSocket, (struct sockaddr*)&sockaddr, &len);
-            CAddress addr;
-            int nInbound = 0;
-
-            if (hSocket != INVALID_SOCKET)
-                if (!addr.SetSockAddr((const struct sockaddr*)&sockaddr))
-                    LogPrintf("Warning: Unknown socket family\n");
-
-            {
-                LOCK(cs_vNodes);
-                BOOST_FOREACH(CNode* pnode, vNodes)
-                    if (pnode->fInbound)
-                        nInbound++;
-            }
-
-            if (hSocket == INVALID_SOCKET)
-            {
-                int nErr = WSAGetLastError();
-                if (nErr != WSAEWOULDBLOCK)
-                    LogPrintf("socket error accept failed: %d\n", nErr);
-            }
-            else if (nInbound >= GetArg("-maxconnections", 125) - MAX_OUTBOUND_CONNECTIONS)
-            {
-                closesocket(hSocket);
-            }
-            else if (CNode::IsBanned(addr))
-            {
-                LogPrintf("connection from %s dropped (banned)\n", addr.ToString());
-                closesocket(hSocket);
-            }
-            else
-            {
-                LogPrint("net", "accepted connection %s\n", addr.ToString());
-                CNode* pnode = new CNode(hSocket, addr, "", true);
-                pnode->AddRef();
-                {
-                    LOCK(cs_vNodes);
-                    vNodes.push_back(pnode);
-                }
-            }
-        }
+            if (hListenSocket != INVALID_SOCKET && FD_ISSET(hListenSocket, &fdsetRecv))
+                AcceptConnection(hListenSocket);
 
 
         //
@@ -864,48 +1170,7 @@ void ThreadSocketHandler()
             if (pnode->hSocket == INVALID_SOCKET)
                 continue;
             if (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError))
-            {
-                TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                if (lockRecv)
-                {
-                    if (pnode->GetTotalRecvSize() > ReceiveFloodSize()) {
-                        if (!pnode->fDisconnect)
-                            LogPrintf("socket recv flood control disconnect (%u bytes)\n", pnode->GetTotalRecvSize());
-                        pnode->CloseSocketDisconnect();
-                    }
-                    else {
-                        // typical socket buffer is 8K-64K
-                        char pchBuf[0x10000];
-                        int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
-                        if (nBytes > 0)
-                        {
-                            if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
-                                pnode->CloseSocketDisconnect();
-                            pnode->nLastRecv = GetTime();
-                            pnode->nRecvBytes += nBytes;
-                            pnode->RecordBytesRecv(nBytes);
-                        }
-                        else if (nBytes == 0)
-                        {
-                            // socket closed gracefully
-                            if (!pnode->fDisconnect)
-                                LogPrint("net", "socket closed\n");
-                            pnode->CloseSocketDisconnect();
-                        }
-                        else if (nBytes < 0)
-                        {
-                            // error
-                            int nErr = WSAGetLastError();
-                            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
-                            {
-                                if (!pnode->fDisconnect)
-                                    LogPrintf("socket recv error %d\n", nErr);
-                                pnode->CloseSocketDisconnect();
-                            }
-                        }
-                    }
-                }
-            }
+                SocketRecvData(pnode);
 
             //
             // Send
@@ -922,30 +1187,7 @@ void ThreadSocketHandler()
             //
             // Inactivity checking
             //
-            int64_t nTime = GetTime();
-            if (nTime - pnode->nTimeConnected > 60)
-            {
-                if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
-                {
-                    LogPrint("net", "socket no message in first 60 seconds, %d %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0);
-                    pnode->fDisconnect = true;
-                }
-                else if (nTime - pnode->nLastSend > TIMEOUT_INTERVAL)
-                {
-                    LogPrintf("socket sending timeout: %ds\n", nTime - pnode->nLastSend);
-                    pnode->fDisconnect = true;
-                }
-                else if (nTime - pnode->nLastRecv > (pnode->nVersion > BIP0031_VERSION ? TIMEOUT_INTERVAL : 90*60))
-                {
-                    LogPrintf("socket receive timeout: %ds\n", nTime - pnode->nLastRecv);
-                    pnode->fDisconnect = true;
-                }
-                else if (pnode->nPingNonceSent && pnode->nPingUsecStart + TIMEOUT_INTERVAL * 1000000 < GetTimeMicros())
-                {
-                    LogPrintf("ping timeout: %fs\n", 0.000001 * (GetTimeMicros() - pnode->nPingUsecStart));
-                    pnode->fDisconnect = true;
-                }
-            }
+            CheckInactivity(pnode);
         }
         {
             LOCK(cs_vNodes);
@@ -1390,31 +1632,49 @@ void static StartSync(const vector<CNode*> &vNodes) {
     }
     // if a new sync candidate was found, start sync!
     if (pnodeNewSync) {
+        LOCK(cs_nodeSync);
         pnodeNewSync->fStartSync = true;
         pnodeSync = pnodeNewSync;
     }
 }
 
-void ThreadMessageHandler()
+// Each peer is pinned to one handler thread, so its messages are still
+// processed in order while a slow peer only holds up its own thread.
+void ThreadMessageHandler(int nThread)
 {
     SetThreadPriority(THREAD_PRIORITY_BELOW_NORMAL);
     while (true)
     {
         bool fHaveSyncNode = false;
 
+        vector<CNode*> vNodesAll;
         vector<CNode*> vNodesCopy;
         {
-            LOCK(cs_vNodes);
-            vNodesCopy = vNodes;
-            BOOST_FOREACH(CNode* pnode, vNodesCopy) {
-                pnode->AddRef();
+            LOCK2(cs_vNodes, cs_nodeSync);
+            BOOST_FOREACH(CNode* pnode, vNodes) {
                 if (pnode == pnodeSync)
                     fHaveSyncNode = true;
+                if (pnode->nMessageThread != nThread)
+                    continue;
+                pnode->AddRef();
+                vNodesCopy.push_back(pnode);
+            }
+            // Sync node selection looks at all peers, the first thread owns it
+            if (nThread == 0 && !fHaveSyncNode)
+            {
+                vNodesAll = vNodes;
+                BOOST_FOREACH(CNode* pnode, vNodesAll)
+                    pnode->AddRef();
             }
         }
 
-        if (!fHaveSyncNode)
-            StartSync(vNodesCopy);
+        if (!vNodesAll.empty())
+        {
+            StartSync(vNodesAll);
+            LOCK(cs_vNodes);
+            BOOST_FOREACH(CNode* pnode, vNodesAll)
+                pnode->Release();
+        }
 
         // Poll the connected nodes for messages
         CNode* pnodeTrickle = NULL;
@@ -1641,6 +1901,21 @@ void StartNode(boost::thread_group& threadGroup)
 
     Discover(threadGroup);
 
+    nMessageHandlerThreads = GetArg("-msghandthreads", DEFAULT_MSGHAND_THREADS);
+    nMessageHandlerThreads = max(1, min(MAX_MSGHAND_THREADS, nMessageHandlerThreads));
+
+#ifdef USE_EPOLL
+    if (hEpoll == -1)
+    {
+        hEpoll = epoll_create(MAX_EPOLL_EVENTS);
+        if (hEpoll == -1)
+            LogPrintf("epoll_create failed, error %d, using select()\n", errno);
+        BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
+            if (hListenSocket != INVALID_SOCKET)
+                EpollAddSocket(hListenSocket, NULL);
+    }
+#endif
+
     //
     // Start threads
     //
@@ -1665,7 +1940,8 @@ void StartNode(boost::thread_group& threadGroup)
     threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "opencon", &ThreadOpenConnections));
 
     // Process messages
-    threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "msghand", &ThreadMessageHandler));
+    for (int i = 0; i < nMessageHandlerThreads; i++)
+        threadGroup.create_thread(boost::bind(&TraceThread<boost::function<void()> >, "msghand", boost::function<void()>(boost::bind(&ThreadMessageHandler, i))));
 
     // Dump network addresses
     threadGroup.create_thread(boost::bind(&LoopForever<void (*)()>, "dumpaddr", &DumpAddresses, DUMP_ADDRESSES_INTERVAL * 1000));
@@ -1699,6 +1975,10 @@ public:
             if (hListenSocket != INVALID_SOCKET)
                 if (closesocket(hListenSocket) == SOCKET_ERROR)
                     LogPrintf("closesocket(hListenSocket) failed with error %d\n", WSAGetLastError());
+#ifdef USE_EPOLL
+        if (hEpoll != -1)
+            close(hEpoll);
+#endif
 
 #ifdef WIN32
         // Shutdown Windows Sockets
@@ -31,6 +31,10 @@ extern int nBestHeight;
 static const int PING_INTERVAL = 2 * 60;
 /** Time after which to disconnect, after waiting for a ping response (or inactivity). */
 static const int TIMEOUT_INTERVAL = 20 * 60;
+/** Maximum number of message handler threads */
+static const int MAX_MSGHAND_THREADS = 16;
+/** Default number of message handler threads */
+static const int DEFAULT_MSGHAND_THREADS = 2;
 
 inline unsigned int ReceiveFloodSize() { return 1000*GetArg("-maxreceivebuffer", 5*1000); }
 inline unsigned int SendBufferSize() { return 1000*GetArg("-maxsendbuffer", 1*1000); }
@@ -102,6 +106,7 @@ extern std::map<CInv, CDataStream> mapRelay;
 extern std::deque<std::pair<int64_t, CInv> > vRelayExpiration;
 extern CCriticalSection cs_mapRelay;
 extern std::map<CInv, int64_t> mapAlreadyAskedFor;
+extern CCriticalSection cs_mapAlreadyAskedFor;
 
 extern std::vector<std::string> vAddedNodes;
 extern CCriticalSection cs_vAddedNodes;
@@ -175,6 +180,8 @@ public:
 
 
 
+typedef int NodeId;
+
 /** Information about a peer */
 class CNode
 {
@@ -209,10 +216,16 @@ public:
     bool fNetworkNode;
     bool fSuccessfullyConnected;
     bool fDisconnect;
+    bool fRecvReady; // socket handler thread only: data may be waiting to be read
+    int nMessageThread; // message handler thread this peer is pinned to
     CSemaphoreGrant grantOutbound;
     int nRefCount;
+    NodeId id;
 protected:
 
+    static NodeId nLastNodeId;
+    static CCriticalSection cs_nLastNodeId;
+
     // Denial-of-service detection/prevention
     // Key is IP address, value is banned-until-time
     static std::map<CNetAddr, int64_t> setBanned;
@@ -224,14 +237,19 @@ public:
     CBlockIndex* pindexLastGetBlocksBegin;
     uint256 hashLastGetBlocksEnd;
     int nStartingHeight;
+    // set when the sync node is chosen, protected by cs_nodeSync in net.cpp
     bool fStartSync;
+    // headers-first sync, protected by cs_main
+    uint256 hashLastGetHeadersTip;
+    std::set<uint256> setBlocksInFlight;
 
     // flood relay
     std::vector<CAddress> vAddrToSend;
     mruset<CAddress> setAddrKnown;
+    CCriticalSection cs_vAddrToSend;
     bool fGetAddr;
-    std::set<uint256> setKnown;
-    uint256 hashCheckpointKnown; // ppcoin: known sent sync-checkpoint
+    std::set<uint256> setKnown; // protected by cs_inventory
+    uint256 hashCheckpointKnown; // ppcoin: known sent sync-checkpoint, protected by cs_inventory
 
     // inventory based relay
     mruset<CInv> setInventoryKnown;
@@ -269,7 +287,13 @@ public:
         fNetworkNode = false;
         fSuccessfullyConnected = false;
         fDisconnect = false;
+        fRecvReady = false;
+        nMessageThread = 0;
         nRefCount = 0;
+        {
+            LOCK(cs_nLastNodeId);
+            id = nLastNodeId++;
+        }
         nSendSize = 0;
         nSendOffset = 0;
         hashContinue = 0;
@@ -277,6 +301,7 @@ public:
         hashLastGetBlocksEnd = 0;
         nStartingHeight = -1;
         fStartSync = false;
+        hashLastGetHeadersTip = 0;
         fGetAddr = false;
         nMisbehavior = 0;
         hashCheckpointKnown = 0;
@@ -354,6 +379,7 @@ public:
 
     void AddAddressKnown(const CAddress& addr)
     {
+        LOCK(cs_vAddrToSend);
         setAddrKnown.insert(addr);
     }
 
@@ -362,6 +388,7 @@ public:
         // Known checking here is only to save space from duplicates.
         // SendMessages will filter it again for knowns that were added
         // after addresses were pushed.
+        LOCK(cs_vAddrToSend);
         if (addr.IsValid() && !setAddrKnown.count(addr))
             vAddrToSend.push_back(addr);
     }
@@ -388,6 +415,7 @@ public:
     {
         // We're using mapAskFor as a priority queue,
         // the key is the earliest time the request can be sent
+        LOCK(cs_mapAlreadyAskedFor);
         int64_t& nRequestTime = mapAlreadyAskedFor[inv];
         LogPrint("net", "askfor %s   %d (%s)\n", inv.ToString(), nRequestTime, DateTimeStrFormat("%H:%M:%S", nRequestTime/1000000));
 
@@ -627,6 +655,9 @@ public:
     void CancelSubscribe(unsigned int nChannel);
     void CloseSocketDisconnect();
 
+    // Clears fStartSync, returns true if it was set
+    bool TakeStartSync();
+
     // Denial-of-service detection/prevention
     // The idea is to detect peers that are behaving
     // badly and disconnect/ban them, but do it in a
@@ -12,7 +12,7 @@
 
 unsigned int GetNextTargetRequired(const CBlockIndex* pindexLast, bool fProofOfStake)
 {
-    CBigNum bnTargetLimit = fProofOfStake ? Params().ProofOfStakeLimit() : Params().ProofOfWorkLimit();
+    const arith_uint256& bnTargetLimit = fProofOfStake ? Params().ProofOfStakeLimit() : Params().ProofOfWorkLimit();
 
     if (pindexLast == NULL)
         return bnTargetLimit.GetCompact(); // genesis block
@@ -30,13 +30,33 @@ unsigned int GetNextTargetRequired(const CBlockIndex* pindexLast, bool fProofOfS
 
     // ppcoin: target change every block
     // ppcoin: retarget with exponential moving toward target spacing
-    CBigNum bnNew;
-    bnNew.SetCompact(pindexPrev->nBits);
+    bool fNegative;
+    bool fOverflow;
+    arith_uint256 bnNew;
+    bnNew.SetCompact(pindexPrev->nBits, &fNegative, &fOverflow);
     int64_t nInterval = Params().TargetTimespan() / Params().TargetSpacing();
-    bnNew *= ((nInterval - 1) * Params().TargetSpacing() + nActualSpacing + nActualSpacing);
-    bnNew /= ((nInterval + 1) * Params().TargetSpacing());
+    arith_uint256 bnMul = (uint64_t)((nInterval - 1) * Params().TargetSpacing() + nActualSpacing + nActualSpacing);
+    arith_uint256 bnDiv = (uint64_t)((nInterval + 1) * Params().TargetSpacing());
 
-    if (bnNew <= 0 || bnNew > bnTargetLimit)
+    // bnNew * bnMul / bnDiv, computed as q * bnMul + r * bnMul / bnDiv so the
+    // product cannot wrap: a result that does not fit in 256 bits is above the limit
+    arith_uint256 bnQuotient = bnNew / bnDiv;
+    arith_uint256 bnRemainder = bnNew - bnQuotient * bnDiv;
+    if (bnQuotient > ~arith_uint256(0) / bnMul)
+        bnNew = bnTargetLimit;
+    else
+    {
+        bnNew = bnQuotient * bnMul;
+        arith_uint256 bnFraction = bnRemainder * bnMul / bnDiv;
+        if (bnNew > ~bnFraction)
+            bnNew = bnTargetLimit;
+        else
+            bnNew += bnFraction;
+    }
+
+    // A target that does not fit in 256 bits stays above every limit: the
+    // retarget scales it by at least (nInterval - 1) / (nInterval + 1)
+    if (fNegative || fOverflow || bnNew == 0 || bnNew > bnTargetLimit)
         bnNew = bnTargetLimit;
 
     return bnNew.GetCompact();
@@ -44,15 +64,17 @@ unsigned int GetNextTargetRequired(const CBlockIndex* pindexLast, bool fProofOfS
 
 bool CheckProofOfWork(uint256 hash, unsigned int nBits)
 {
-    CBigNum bnTarget;
-    bnTarget.SetCompact(nBits);
+    bool fNegative;
+    bool fOverflow;
+    arith_uint256 bnTarget;
+    bnTarget.SetCompact(nBits, &fNegative, &fOverflow);
 
     // Check range
-    if (bnTarget <= 0 || bnTarget > Params().ProofOfWorkLimit())
+    if (fNegative || bnTarget == 0 || fOverflow || bnTarget > Params().ProofOfWorkLimit())
         return error("CheckProofOfWork() : nBits below minimum work");
 
     // Check proof of work matches claimed amount
-    if (hash > bnTarget.getuint256())
+    if (UintToArith256(hash) > bnTarget)
         return error("CheckProofOfWork() : hash doesn't match nBits");
 
     return true;
@@ -5,6 +5,7 @@
 
 #include "rpcserver.h"
 #include "main.h"
+#include "txmempool.h"
 #include "kernel.h"
 #include "checkpoints.h"
 
@@ -212,6 +213,105 @@ Value getrawmempool(const Array& params, bool fHelp)
     return a;
 }
 
+Value getmempoolinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getmempoolinfo\n"
+            "Returns statistics of the transaction memory pool.");
+
+    uint64_t nEvicted, nExpired;
+    mempool.GetEvictionCounts(nEvicted, nExpired);
+
+    Object obj;
+    obj.push_back(Pair("size",          (int64_t)mempool.size()));
+    obj.push_back(Pair("bytes",         (int64_t)mempool.GetTotalTxSize()));
+    obj.push_back(Pair("usage",         (int64_t)mempool.DynamicMemoryUsage()));
+    obj.push_back(Pair("maxmempool",    (int64_t)nMaxMempoolSize));
+    obj.push_back(Pair("mempoolminfee", ValueFromAmount(mempool.GetMinFee(nMaxMempoolSize))));
+    obj.push_back(Pair("evicted",       (int64_t)nEvicted));
+    obj.push_back(Pair("expired",       (int64_t)nExpired));
+    return obj;
+}
+
+Value getblockcacheinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getblockcacheinfo\n"
+            "Returns statistics of the block file read cache.");
+
+    CBlockCacheStats stats;
+    GetBlockCacheStats(stats);
+
+    Object obj;
+    obj.push_back(Pair("hits",          (int64_t)stats.nHits));
+    obj.push_back(Pair("misses",        (int64_t)stats.nMisses));
+    obj.push_back(Pair("blocks",        (int)stats.nBlocks));
+    obj.push_back(Pair("maxblocks",     (int)stats.nMaxBlocks));
+    obj.push_back(Pair("openfiles",     (int)stats.nOpenFiles));
+    return obj;
+}
+
+Value getcoinscacheinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getcoinscacheinfo\n"
+            "Returns statistics of the in-memory cache of transaction outputs.");
+
+    CCoinsCacheStats stats;
+    GetCoinsCacheStats(stats);
+
+    Object obj;
+    obj.push_back(Pair("hits",          (int64_t)stats.nHits));
+    obj.push_back(Pair("misses",        (int64_t)stats.nMisses));
+    obj.push_back(Pair("entries",       (int)stats.nEntries));
+    obj.push_back(Pair("bytes",         (int64_t)stats.nBytes));
+    obj.push_back(Pair("maxbytes",      (int64_t)stats.nMaxBytes));
+    return obj;
+}
+
+Value getorphanblocksinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getorphanblocksinfo\n"
+            "Returns statistics of the pool of blocks whose parent is not known yet.");
+
+    COrphanBlocksStats stats;
+    GetOrphanBlocksStats(stats);
+
+    Object obj;
+    obj.push_back(Pair("blocks",        (int)stats.nBlocks));
+    obj.push_back(Pair("bytes",         (int64_t)stats.nBytes));
+    obj.push_back(Pair("maxbytes",      (int64_t)stats.nMaxBytes));
+    obj.push_back(Pair("spilled",       (int)stats.nSpilled));
+    obj.push_back(Pair("spilledbytes",  (int64_t)stats.nSpilledBytes));
+    obj.push_back(Pair("maxspillbytes", (int64_t)stats.nMaxSpilledBytes));
+    obj.push_back(Pair("evicted",       (int64_t)stats.nEvicted));
+    return obj;
+}
+
+Value getsigcacheinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getsigcacheinfo\n"
+            "Returns statistics of the signature verification cache.");
+
+    CSignatureCacheStats stats;
+    GetSignatureCacheStats(stats);
+
+    Object obj;
+    obj.push_back(Pair("hits",          (int64_t)stats.nHits));
+    obj.push_back(Pair("misses",        (int64_t)stats.nMisses));
+    obj.push_back(Pair("evictions",     (int64_t)stats.nEvictions));
+    obj.push_back(Pair("entries",       (int)stats.nEntries));
+    obj.push_back(Pair("maxentries",    (int)stats.nMaxEntries));
+    return obj;
+}
+
 Value getblockhash(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() != 1)
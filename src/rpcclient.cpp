@@ -150,6 +150,8 @@ static const CRPCConvertParam vRPCConvertParams[] =
     { "signrawtransaction", 2 },
     { "keypoolrefill", 0 },
     { "importprivkey", 2 },
+    { "importprivkeys", 0 },
+    { "importprivkeys", 1 },
     { "checkkernel", 0 },
     { "checkkernel", 1 },
 };
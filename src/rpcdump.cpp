@@ -103,6 +103,15 @@ public:
     }
 };
 
+// Reserve the wallet rescan for the rest of the caller's scope, so that two
+// imports can't both start one
+static void ReserveRescan(auto_ptr<CRescanReservation>& reservation)
+{
+    reservation.reset(new CRescanReservation(*pwalletMain));
+    if (!reservation->IsReserved())
+        throw JSONRPCError(RPC_WALLET_ERROR, "Wallet is currently rescanning. Abort the existing rescan or wait.");
+}
+
 Value importprivkey(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() < 1 || params.size() > 3)
@@ -127,6 +136,10 @@ Value importprivkey(const Array& params, bool fHelp)
     if (fWalletUnlockStakingOnly)
         throw JSONRPCError(RPC_WALLET_UNLOCK_NEEDED, "Wallet is unlocked for staking only.");
 
+    auto_ptr<CRescanReservation> reservation;
+    if (fRescan)
+        ReserveRescan(reservation);
+
     CKey key = vchSecret.GetKey();
     CPubKey pubkey = key.GetPubKey();
     CKeyID vchAddress = pubkey.GetID();
@@ -147,11 +160,13 @@ Value importprivkey(const Array& params, bool fHelp)
 
         // whenever a key is imported, we need to scan the whole chain
         pwalletMain->nTimeFirstKey = 1; // 0 would be considered 'no value'
+    }
 
-        if (fRescan) {
-            pwalletMain->ScanForWalletTransactions(pindexGenesisBlock, true);
-            pwalletMain->ReacceptWalletTransactions();
-        }
+    // The rescan takes the locks itself, only while applying what it finds
+    if (fRescan) {
+        if (pwalletMain->ScanForWalletTransactions(pindexGenesisBlock, true) < 0)
+            throw JSONRPCError(RPC_WALLET_ERROR, "Rescan aborted by user.");
+        pwalletMain->ReacceptWalletTransactions();
     }
 
     return Value::null;
@@ -164,80 +179,195 @@ Value importwallet(const Array& params, bool fHelp)
             "importwallet <filename>\n"
             "Imports keys from a wallet dump file (see dumpwallet).");
 
-    EnsureWalletIsUnlocked();
+    auto_ptr<CRescanReservation> reservation;
+    ReserveRescan(reservation);
 
     ifstream file;
     file.open(params[0].get_str().c_str());
     if (!file.is_open())
         throw JSONRPCError(RPC_INVALID_PARAMETER, "Cannot open wallet dump file");
 
-    int64_t nTimeBegin = pindexBest->nTime;
+    CBlockIndex *pindex;
+    {
+        LOCK2(cs_main, pwalletMain->cs_wallet);
 
-    bool fGood = true;
+        EnsureWalletIsUnlocked();
+
+        int64_t nTimeBegin = pindexBest->nTime;
+        vector<CKeyImport> vImport;
+
+        while (file.good()) {
+            std::string line;
+            std::getline(file, line);
+            if (line.empty() || line[0] == '#')
+                continue;
+
+            std::vector<std::string> vstr;
+            boost::split(vstr, line, boost::is_any_of(" "));
+            if (vstr.size() < 2)
+                continue;
+            CCoinSecret vchSecret;
+            if (!vchSecret.SetString(vstr[0]))
+                continue;
+            CKey key = vchSecret.GetKey();
+            CPubKey pubkey = key.GetPubKey();
+            CKeyID keyid = pubkey.GetID();
+            if (pwalletMain->HaveKey(keyid)) {
+                LogPrintf("Skipping import of %s (key already present)\n", CCoinAddress(keyid).ToString());
+                continue;
+            }
+            int64_t nTime = DecodeDumpTime(vstr[1]);
+            std::string strLabel;
+            bool fLabel = true;
+            for (unsigned int nStr = 2; nStr < vstr.size(); nStr++) {
+                if (boost::algorithm::starts_with(vstr[nStr], "#"))
+                    break;
+                if (vstr[nStr] == "change=1")
+                    fLabel = false;
+                if (vstr[nStr] == "reserve=1")
+                    fLabel = false;
+                if (boost::algorithm::starts_with(vstr[nStr], "label=")) {
+                    strLabel = DecodeDumpString(vstr[nStr].substr(6));
+                    fLabel = true;
+                }
+            }
+            LogPrintf("Importing %s...\n", CCoinAddress(keyid).ToString());
+            CKeyImport import(key, nTime);
+            import.fLabel = fLabel;
+            import.strLabel = strLabel;
+            vImport.push_back(import);
+            nTimeBegin = std::min(nTimeBegin, nTime);
+        }
+        file.close();
 
-    while (file.good()) {
-        std::string line;
-        std::getline(file, line);
-        if (line.empty() || line[0] == '#')
-            continue;
+        // Nothing is kept, nor rescanned for, if the keys can't be written
+        int nImported;
+        if (!pwalletMain->ImportKeys(vImport, nImported))
+            throw JSONRPCError(RPC_WALLET_ERROR, "Error adding keys to wallet");
 
-        std::vector<std::string> vstr;
-        boost::split(vstr, line, boost::is_any_of(" "));
-        if (vstr.size() < 2)
-            continue;
-        CCoinSecret vchSecret;
-        if (!vchSecret.SetString(vstr[0]))
-            continue;
-        CKey key = vchSecret.GetKey();
-        CPubKey pubkey = key.GetPubKey();
-        CKeyID keyid = pubkey.GetID();
-        if (pwalletMain->HaveKey(keyid)) {
-            LogPrintf("Skipping import of %s (key already present)\n", CCoinAddress(keyid).ToString());
-            continue;
-        }
-        int64_t nTime = DecodeDumpTime(vstr[1]);
-        std::string strLabel;
-        bool fLabel = true;
-        for (unsigned int nStr = 2; nStr < vstr.size(); nStr++) {
-            if (boost::algorithm::starts_with(vstr[nStr], "#"))
-                break;
-            if (vstr[nStr] == "change=1")
-                fLabel = false;
-            if (vstr[nStr] == "reserve=1")
-                fLabel = false;
-            if (boost::algorithm::starts_with(vstr[nStr], "label=")) {
-                strLabel = DecodeDumpString(vstr[nStr].substr(6));
-                fLabel = true;
-            }
+        pindex = pindexBest;
+        while (pindex && pindex->pprev && pindex->nTime > nTimeBegin - 7200)
+            pindex = pindex->pprev;
+
+        if (!pwalletMain->nTimeFirstKey || nTimeBegin < pwalletMain->nTimeFirstKey)
+            pwalletMain->nTimeFirstKey = nTimeBegin;
+
+        LogPrintf("Rescanning last %i blocks\n", pindexBest->nHeight - pindex->nHeight + 1);
+    }
+
+    // The rescan takes the locks itself, only while applying what it finds
+    if (pwalletMain->ScanForWalletTransactions(pindex) < 0)
+        throw JSONRPCError(RPC_WALLET_ERROR, "Rescan aborted by user.");
+    pwalletMain->ReacceptWalletTransactions();
+    pwalletMain->MarkDirty();
+
+    return Value::null;
+}
+
+Value importprivkeys(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() < 1 || params.size() > 2)
+        throw runtime_error(
+            "importprivkeys <keys> [rescan=true]\n"
+            "Adds private keys (as returned by dumpprivkey) to your wallet, then rescans once.\n"
+            "<keys> is an array of private keys, or of objects\n"
+            "  {\"privkey\":privkey, \"label\":label, \"timestamp\":time}\n"
+            "where label and timestamp are optional. The rescan starts at the earliest\n"
+            "timestamp, which defaults to the start of the chain.\n"
+            "Returns the number of keys added.");
+
+    Array keys = params[0].get_array();
+
+    // Whether to perform rescan after import
+    bool fRescan = true;
+    if (params.size() > 1)
+        fRescan = params[1].get_bool();
+
+    if (fWalletUnlockStakingOnly)
+        throw JSONRPCError(RPC_WALLET_UNLOCK_NEEDED, "Wallet is unlocked for staking only.");
+    auto_ptr<CRescanReservation> reservation;
+    if (fRescan)
+        ReserveRescan(reservation);
+
+    vector<CKeyImport> vImport;
+    BOOST_FOREACH(const Value& entry, keys)
+    {
+        Value secret_v = entry;
+        Value label_v, time_v;
+        if (entry.type() == obj_type)
+        {
+            const Object& o = entry.get_obj();
+            secret_v = find_value(o, "privkey");
+            label_v = find_value(o, "label");
+            time_v = find_value(o, "timestamp");
         }
-        LogPrintf("Importing %s...\n", CCoinAddress(keyid).ToString());
-        if (!pwalletMain->AddKey(key)) {
-            fGood = false;
-            continue;
+        if (secret_v.type() != str_type)
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid parameter, missing privkey");
+
+        CCoinSecret vchSecret;
+        if (!vchSecret.SetString(secret_v.get_str()))
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid private key " + secret_v.get_str());
+
+        // 0 would be considered 'no value'
+        CKeyImport import(vchSecret.GetKey(), 1);
+        if (time_v.type() != null_type)
+            import.nCreateTime = std::max((int64_t)1, time_v.get_int64());
+        if (label_v.type() != null_type)
+        {
+            import.fLabel = true;
+            import.strLabel = label_v.get_str();
         }
-        pwalletMain->mapKeyMetadata[keyid].nCreateTime = nTime;
-        if (fLabel)
-            pwalletMain->SetAddressBookName(keyid, strLabel);
-        nTimeBegin = std::min(nTimeBegin, nTime);
+        vImport.push_back(import);
     }
-    file.close();
 
-    CBlockIndex *pindex = pindexBest;
-    while (pindex && pindex->pprev && pindex->nTime > nTimeBegin - 7200)
-        pindex = pindex->pprev;
+    int nImported;
+    CBlockIndex *pindex = NULL;
+    {
+        LOCK2(cs_main, pwalletMain->cs_wallet);
+
+        EnsureWalletIsUnlocked();
 
-    if (!pwalletMain->nTimeFirstKey || nTimeBegin < pwalletMain->nTimeFirstKey)
-        pwalletMain->nTimeFirstKey = nTimeBegin;
+        if (!pwalletMain->ImportKeys(vImport, nImported))
+            throw JSONRPCError(RPC_WALLET_ERROR, "Error adding keys to wallet");
+        pwalletMain->MarkDirty();
 
-    LogPrintf("Rescanning last %i blocks\n", pindexBest->nHeight - pindex->nHeight + 1);
-    pwalletMain->ScanForWalletTransactions(pindex);
-    pwalletMain->ReacceptWalletTransactions();
-    pwalletMain->MarkDirty();
+        if (nImported > 0)
+        {
+            int64_t nTimeBegin = pindexBest->nTime;
+            BOOST_FOREACH(const CKeyImport& import, vImport)
+                nTimeBegin = std::min(nTimeBegin, import.nCreateTime);
+
+            pindex = pindexBest;
+            while (pindex && pindex->pprev && pindex->nTime > nTimeBegin - 7200)
+                pindex = pindex->pprev;
+            if (fRescan)
+                LogPrintf("Rescanning last %i blocks for %d imported keys\n", pindexBest->nHeight - pindex->nHeight + 1, nImported);
+        }
+    }
 
-    if (!fGood)
-        throw JSONRPCError(RPC_WALLET_ERROR, "Error adding some keys to wallet");
+    // One rescan for the whole batch, taking the locks only for what it finds
+    if (fRescan && pindex)
+    {
+        if (pwalletMain->ScanForWalletTransactions(pindex, true) < 0)
+            throw JSONRPCError(RPC_WALLET_ERROR, "Rescan aborted by user.");
+        pwalletMain->ReacceptWalletTransactions();
+    }
 
-    return Value::null;
+    return nImported;
+}
+
+Value abortrescan(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "abortrescan\n"
+            "Stops the wallet rescan triggered by an import call.\n"
+            "Returns true if a rescan was running or about to start.");
+
+    if (!pwalletMain->IsRescanReserved() && !pwalletMain->IsScanning())
+        return false;
+    pwalletMain->AbortRescan();
+    return true;
 }
 
 
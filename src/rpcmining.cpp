@@ -8,6 +8,7 @@
 #include "main.h"
 #include "db.h"
 #include "txdb.h"
+#include "txmempool.h"
 #include "init.h"
 #include "miner.h"
 #include "kernel.h"
@@ -220,6 +221,7 @@ Value checkkernel(const Array& params, bool fHelp)
     auto_ptr<CBlock> pblock(CreateNewBlock(*pMiningKey, true, &nFees));
 
     pblock->nTime = pblock->vtx[0].nTime = nTime;
+    pblock->vtx[0].UpdateHash();
 
     CDataStream ss(SER_DISK, PROTOCOL_VERSION);
     ss << *pblock;
@@ -354,7 +356,10 @@ Value getworkex(const Array& params, bool fHelp)
         pblock->nNonce = pdata->nNonce;
 
         if(coinbase.size() == 0)
+        {
             pblock->vtx[0].vin[0].scriptSig = mapNewBlock[pdata->hashMerkleRoot].second;
+            pblock->vtx[0].UpdateHash();
+        }
         else
             CDataStream(coinbase, SER_NETWORK, PROTOCOL_VERSION) >> pblock->vtx[0]; // FIXME - HACK!
 
@@ -474,6 +479,7 @@ Value getwork(const Array& params, bool fHelp)
         pblock->nTime = pdata->nTime;
         pblock->nNonce = pdata->nNonce;
         pblock->vtx[0].vin[0].scriptSig = mapNewBlock[pdata->hashMerkleRoot].second;
+        pblock->vtx[0].UpdateHash();
         pblock->hashMerkleRoot = pblock->BuildMerkleTree();
 
         assert(pwalletMain != NULL);
@@ -231,6 +231,11 @@ static const CRPCCommand vRPCCommands[] =
     { "getdifficulty",          &getdifficulty,          true,      false,     false },
     { "getinfo",                &getinfo,                true,      false,     false },
     { "getrawmempool",          &getrawmempool,          true,      false,     false },
+    { "getmempoolinfo",         &getmempoolinfo,         true,      true,      false },
+    { "getblockcacheinfo",      &getblockcacheinfo,      true,      true,      false },
+    { "getsigcacheinfo",        &getsigcacheinfo,        true,      true,      false },
+    { "getorphanblocksinfo",    &getorphanblocksinfo,    true,      true,      false },
+    { "getcoinscacheinfo",      &getcoinscacheinfo,      true,      true,      false },
     { "getblock",               &getblock,               false,     false,     false },
     { "getblockbynumber",       &getblockbynumber,       false,     false,     false },
     { "getblockhash",           &getblockhash,           false,     false,     false },
@@ -284,8 +289,10 @@ static const CRPCCommand vRPCCommands[] =
     { "listsinceblock",         &listsinceblock,         false,     false,     true },
     { "dumpprivkey",            &dumpprivkey,            false,     false,     true },
     { "dumpwallet",             &dumpwallet,             true,      false,     true },
-    { "importprivkey",          &importprivkey,          false,     false,     true },
-    { "importwallet",           &importwallet,           false,     false,     true },
+    { "importprivkey",          &importprivkey,          false,     true,      true },
+    { "importwallet",           &importwallet,           false,     true,      true },
+    { "importprivkeys",         &importprivkeys,         false,     true,      true },
+    { "abortrescan",            &abortrescan,            false,     true,      true },
     { "listunspent",            &listunspent,            false,     false,     true },
     { "settxfee",               &settxfee,               false,     false,     true },
     { "getsubsidy",             &getsubsidy,             true,      true,      false },
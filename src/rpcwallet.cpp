@@ -566,7 +566,8 @@ Value movecmd(const Array& params, bool fHelp)
     debit.nTime = nNow;
     debit.strOtherAccount = strTo;
     debit.strComment = strComment;
-    walletdb.WriteAccountingEntry(debit);
+    if (!walletdb.WriteAccountingEntry(debit))
+        throw JSONRPCError(RPC_DATABASE_ERROR, "database error");
 
     // Credit
     CAccountingEntry credit;
@@ -576,11 +577,16 @@ Value movecmd(const Array& params, bool fHelp)
     credit.nTime = nNow;
     credit.strOtherAccount = strFrom;
     credit.strComment = strComment;
-    walletdb.WriteAccountingEntry(credit);
+    if (!walletdb.WriteAccountingEntry(credit))
+        throw JSONRPCError(RPC_DATABASE_ERROR, "database error");
 
     if (!walletdb.TxnCommit())
         throw JSONRPCError(RPC_DATABASE_ERROR, "database error");
 
+    // Only what is on disk goes into the activity log
+    pwalletMain->AddAccountingEntry(debit);
+    pwalletMain->AddAccountingEntry(credit);
+
     return true;
 }
 
@@ -1042,34 +1048,43 @@ Value listtransactions(const Array& params, bool fHelp)
 
     Array ret;
 
-    std::list<CAccountingEntry> acentries;
-    CWallet::TxItems txOrdered = pwalletMain->OrderedTxItems(acentries, strAccount);
-
-    // iterate backwards until we have nCount items to return:
-    for (CWallet::TxItems::reverse_iterator it = txOrdered.rbegin(); it != txOrdered.rend(); ++it)
+    // Walk the activity log from the newest entry. The first nFrom entries
+    // are only counted, without their details, and the walk stops as soon
+    // as nCount entries are collected.
+    int nToSkip = nFrom;
+    const CWallet::TxItems& txOrdered = pwalletMain->wtxOrdered;
+    for (CWallet::TxItems::const_reverse_iterator it = txOrdered.rbegin(); it != txOrdered.rend(); ++it)
     {
         CWalletTx *const pwtx = (*it).second.first;
-        if (pwtx != 0)
-            ListTransactions(*pwtx, strAccount, 0, true, ret);
         CAccountingEntry *const pacentry = (*it).second.second;
+        Array entries;
+        if (nToSkip > 0)
+        {
+            if (pwtx != 0)
+                ListTransactions(*pwtx, strAccount, 0, false, entries);
+            if (pacentry != 0)
+                AcentryToJSON(*pacentry, strAccount, entries);
+            if ((int)entries.size() <= nToSkip)
+            {
+                nToSkip -= entries.size();
+                continue;
+            }
+            entries.clear();
+        }
+
+        if (pwtx != 0)
+            ListTransactions(*pwtx, strAccount, 0, true, entries);
         if (pacentry != 0)
-            AcentryToJSON(*pacentry, strAccount, ret);
+            AcentryToJSON(*pacentry, strAccount, entries);
+        ret.insert(ret.end(), entries.begin() + nToSkip, entries.end());
+        nToSkip = 0;
 
-        if ((int)ret.size() >= (nCount+nFrom)) break;
+        if ((int)ret.size() >= nCount) break;
     }
     // ret is newest to oldest
 
-    if (nFrom > (int)ret.size())
-        nFrom = ret.size();
-    if ((nFrom + nCount) > (int)ret.size())
-        nCount = ret.size() - nFrom;
-    Array::iterator first = ret.begin();
-    std::advance(first, nFrom);
-    Array::iterator last = ret.begin();
-    std::advance(last, nFrom+nCount);
-
-    if (last != ret.end()) ret.erase(last, ret.end());
-    if (first != ret.begin()) ret.erase(ret.begin(), first);
+    if ((int)ret.size() > nCount)
+        ret.erase(ret.begin() + nCount, ret.end());
 
     std::reverse(ret.begin(), ret.end()); // Return oldest to newest
 
@@ -1119,9 +1134,7 @@ Value listaccounts(const Array& params, bool fHelp)
         }
     }
 
-    list<CAccountingEntry> acentries;
-    CWalletDB(pwalletMain->strWalletFile).ListAccountCreditDebit("*", acentries);
-    BOOST_FOREACH(const CAccountingEntry& entry, acentries)
+    BOOST_FOREACH(const CAccountingEntry& entry, pwalletMain->laccentries)
         mapAccountBalances[entry.strAccount] += entry.nCreditDebit;
 
     Object ret;
@@ -1163,7 +1176,7 @@ Value listsinceblock(const Array& params, bool fHelp)
 
     for (map<uint256, CWalletTx>::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); it++)
     {
-        CWalletTx tx = (*it).second;
+        const CWalletTx& tx = (*it).second;
 
         if (depth == -1 || tx.GetDepthInMainChain() < depth)
             ListTransactions(tx, "*", 0, true, transactions);
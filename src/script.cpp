@@ -4,8 +4,7 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include <boost/foreach.hpp>
-#include <boost/tuple/tuple.hpp>
-#include <boost/tuple/tuple_comparison.hpp>
+#include <boost/thread/mutex.hpp>
 
 using namespace std;
 using namespace boost;
@@ -13,6 +12,7 @@ using namespace boost;
 #include "script.h"
 #include "keystore.h"
 #include "bignum.h"
+#include "crypto/sha256.h"
 #include "key.h"
 #include "main.h"
 #include "sync.h"
@@ -1254,64 +1254,162 @@ uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int
 // Valid signature cache, to avoid doing expensive ECDSA signature checking
 // twice for every transaction (once when accepted into memory pool, and
 // again when accepted into the block chain)
+//
+// Entries are salted hashes of (signature hash, signature, public key) kept in
+// a fixed size table. The table is split into shards with their own lock so
+// parallel script checks rarely wait on each other. An entry can only live in
+// one bucket of its shard; when the bucket is full an older entry is replaced.
+
+namespace {
+
+static const unsigned int SIGCACHE_SHARDS = 16;
+static const unsigned int SIGCACHE_BUCKET_SIZE = 4;
 
 class CSignatureCache
 {
 private:
-     // sigdata_type is (signature hash, signature, public key):
-    typedef boost::tuple<uint256, std::vector<unsigned char>, CPubKey> sigdata_type;
-    std::set< sigdata_type> setValid;
-    boost::shared_mutex cs_sigcache;
+    struct CShard
+    {
+        boost::mutex cs;
+        std::vector<uint256> vSlots; // null slots are free
+        unsigned int nEntries;
+        unsigned int nNextEvict;
+        uint64_t nHits;
+        uint64_t nMisses;
+        uint64_t nEvictions;
+    };
+
+    // Salt, so nobody can pick signatures that collide in the cache
+    uint256 nonce;
+    // Buckets per shard, 0 while the cache is disabled
+    unsigned int nBuckets;
+    CShard shards[SIGCACHE_SHARDS];
+
+    uint256 GetEntry(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey) const
+    {
+        uint256 entry;
+        CSHA256().Write(nonce.begin(), 32).Write(hash.begin(), 32)
+                 .Write(vchSig.empty() ? NULL : &vchSig[0], vchSig.size())
+                 .Write(pubKey.begin(), pubKey.size()).Finalize(entry.begin());
+        return entry;
+    }
+
+    CShard& GetShard(const uint256& entry, unsigned int& nBucketRet)
+    {
+        uint64_t n = entry.GetLow64();
+        nBucketRet = (n / SIGCACHE_SHARDS) % nBuckets;
+        return shards[n % SIGCACHE_SHARDS];
+    }
 
 public:
+    CSignatureCache() : nBuckets(0)
+    {
+        for (unsigned int i = 0; i < SIGCACHE_SHARDS; i++)
+        {
+            shards[i].nEntries = shards[i].nNextEvict = 0;
+            shards[i].nHits = shards[i].nMisses = shards[i].nEvictions = 0;
+        }
+    }
+
+    // Not thread safe, called before script checking starts
+    void Init(unsigned int nMaxSizeMB)
+    {
+        nonce = GetRandHash();
+        nMaxSizeMB = std::min(nMaxSizeMB, MAX_SIG_CACHE_SIZE);
+        nBuckets = ((uint64_t)nMaxSizeMB << 20) / sizeof(uint256) / SIGCACHE_SHARDS / SIGCACHE_BUCKET_SIZE;
+        for (unsigned int i = 0; i < SIGCACHE_SHARDS; i++)
+        {
+            shards[i].vSlots.assign(nBuckets * SIGCACHE_BUCKET_SIZE, uint256());
+            shards[i].nEntries = 0;
+        }
+    }
+
     bool
     Get(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
     {
-        boost::shared_lock<boost::shared_mutex> lock(cs_sigcache);
+        if (nBuckets == 0)
+            return false;
 
-        sigdata_type k(hash, vchSig, pubKey);
-        std::set<sigdata_type>::iterator mi = setValid.find(k);
-        if (mi != setValid.end())
-            return true;
+        uint256 entry = GetEntry(hash, vchSig, pubKey);
+        unsigned int nBucket;
+        CShard& shard = GetShard(entry, nBucket);
+
+        boost::unique_lock<boost::mutex> lock(shard.cs);
+        const uint256* pslot = &shard.vSlots[nBucket * SIGCACHE_BUCKET_SIZE];
+        for (unsigned int i = 0; i < SIGCACHE_BUCKET_SIZE; i++)
+        {
+            if (pslot[i] == entry)
+            {
+                shard.nHits++;
+                return true;
+            }
+        }
+        shard.nMisses++;
         return false;
     }
 
     void Set(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
     {
-        // DoS prevention: limit cache size to less than 10MB
-        // (~200 bytes per cache entry times 50,000 entries)
-        // Since there are a maximum of 20,000 signature operations per block
-        // 50,000 is a reasonable default.
-        int64_t nMaxCacheSize = GetArg("-maxsigcachesize", 50000);
-        if (nMaxCacheSize <= 0) return;
+        if (nBuckets == 0)
+            return;
 
-        boost::unique_lock<boost::shared_mutex> lock(cs_sigcache);
+        uint256 entry = GetEntry(hash, vchSig, pubKey);
+        unsigned int nBucket;
+        CShard& shard = GetShard(entry, nBucket);
 
-        while (static_cast<int64_t>(setValid.size()) > nMaxCacheSize)
+        boost::unique_lock<boost::mutex> lock(shard.cs);
+        uint256* pslot = &shard.vSlots[nBucket * SIGCACHE_BUCKET_SIZE];
+        for (unsigned int i = 0; i < SIGCACHE_BUCKET_SIZE; i++)
         {
-            // Evict a random entry. Random because that helps
-            // foil would-be DoS attackers who might try to pre-generate
-            // and re-use a set of valid signatures just-slightly-greater
-            // than our cache size.
-            uint256 randomHash = GetRandHash();
-            std::vector<unsigned char> unused;
-            std::set<sigdata_type>::iterator it =
-                setValid.lower_bound(sigdata_type(randomHash, unused, unused));
-            if (it == setValid.end())
-                it = setValid.begin();
-            setValid.erase(*it);
+            if (pslot[i] == entry)
+                return;
+            if (pslot[i] == 0)
+            {
+                pslot[i] = entry;
+                shard.nEntries++;
+                return;
+            }
         }
 
-        sigdata_type k(hash, vchSig, pubKey);
-        setValid.insert(k);
+        // Bucket full. Attackers cannot tell which bucket a signature lands in
+        // without the salt, so evicting in turn is as safe as evicting at random.
+        pslot[shard.nNextEvict++ % SIGCACHE_BUCKET_SIZE] = entry;
+        shard.nEvictions++;
+    }
+
+    void GetStats(CSignatureCacheStats& stats)
+    {
+        stats.nHits = stats.nMisses = stats.nEvictions = 0;
+        stats.nEntries = 0;
+        stats.nMaxEntries = nBuckets * SIGCACHE_BUCKET_SIZE * SIGCACHE_SHARDS;
+        for (unsigned int i = 0; i < SIGCACHE_SHARDS; i++)
+        {
+            boost::unique_lock<boost::mutex> lock(shards[i].cs);
+            stats.nHits += shards[i].nHits;
+            stats.nMisses += shards[i].nMisses;
+            stats.nEvictions += shards[i].nEvictions;
+            stats.nEntries += shards[i].nEntries;
+        }
     }
 };
 
+CSignatureCache signatureCache;
+
+}
+
+void InitSignatureCache(unsigned int nMaxSizeMB)
+{
+    signatureCache.Init(nMaxSizeMB);
+}
+
+void GetSignatureCacheStats(CSignatureCacheStats& stats)
+{
+    signatureCache.GetStats(stats);
+}
+
 bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubKey, const CScript &scriptCode,
               const CTransaction& txTo, unsigned int nIn, int nHashType, int flags)
 {
-    static CSignatureCache signatureCache;
-
     CPubKey pubkey(vchPubKey);
     if (!pubkey.IsValid())
         return false;
@@ -1791,7 +1889,7 @@ bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const C
 }
 
 
-bool SignSignature(const CKeyStore &keystore, const CScript& fromPubKey, CTransaction& txTo, unsigned int nIn, int nHashType)
+static bool SignTxIn(const CKeyStore &keystore, const CScript& fromPubKey, CTransaction& txTo, unsigned int nIn, int nHashType)
 {
     assert(nIn < txTo.vin.size());
     CTxIn& txin = txTo.vin[nIn];
@@ -1826,6 +1924,15 @@ bool SignSignature(const CKeyStore &keystore, const CScript& fromPubKey, CTransa
     return VerifyScript(txin.scriptSig, fromPubKey, txTo, nIn, STANDARD_SCRIPT_VERIFY_FLAGS, 0);
 }
 
+bool SignSignature(const CKeyStore &keystore, const CScript& fromPubKey, CTransaction& txTo, unsigned int nIn, int nHashType)
+{
+    bool fSigned = SignTxIn(keystore, fromPubKey, txTo, nIn, nHashType);
+
+    // txin.scriptSig has been rewritten, even if signing failed
+    txTo.UpdateHash();
+    return fSigned;
+}
+
 bool SignSignature(const CKeyStore &keystore, const CTransaction& txFrom, CTransaction& txTo, unsigned int nIn, int nHashType)
 {
     assert(nIn < txTo.vin.size());
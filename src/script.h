@@ -25,6 +25,11 @@ class CTransaction;
 static const unsigned int MAX_SCRIPT_ELEMENT_SIZE = 520; // bytes
 static const unsigned int MAX_OP_RETURN_RELAY = 40;      // bytes
 
+// Default memory budget of the signature cache, in megabytes
+static const unsigned int DEFAULT_MAX_SIG_CACHE_SIZE = 10;
+// Largest memory budget of the signature cache, in megabytes
+static const unsigned int MAX_SIG_CACHE_SIZE = 1024;
+
 /** Signature hash types/flags */
 enum
 {
@@ -711,6 +716,20 @@ bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const C
                    unsigned int flags, int nHashType);
 bool VerifySignature(const CTransaction& txFrom, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType);
 
+// Size the signature cache to nMaxSizeMB megabytes (at most
+// MAX_SIG_CACHE_SIZE), 0 disables it
+void InitSignatureCache(unsigned int nMaxSizeMB);
+
+struct CSignatureCacheStats
+{
+    uint64_t nHits;
+    uint64_t nMisses;
+    uint64_t nEvictions;
+    unsigned int nEntries;
+    unsigned int nMaxEntries;
+};
+void GetSignatureCacheStats(CSignatureCacheStats& stats);
+
 // Given two sets of signatures for scriptPubKey, possibly with OP_0 placeholders,
 // combine them intelligently and return the result.
 CScript CombineSignatures(CScript scriptPubKey, const CTransaction& txTo, unsigned int nIn, const CScript& scriptSig1, const CScript& scriptSig2);
@@ -0,0 +1,310 @@
+#include <boost/test/unit_test.hpp>
+#include <limits>
+
+#include "arith_uint256.h"
+#include "bignum.h"
+#include "chainparams.h"
+#include "kernel.h"
+#include "main.h"
+#include "pow.h"
+#include "util.h"
+
+// Differential tests: the consensus code used to do its target arithmetic
+// with CBigNum, arith_uint256 must give the same results.
+
+BOOST_AUTO_TEST_SUITE(arith_uint256_tests)
+
+static arith_uint256 RandArith256()
+{
+    arith_uint256 n = GetRandHash();
+    return n >> GetRand(257);
+}
+
+BOOST_AUTO_TEST_CASE(arith_uint256_compact)
+{
+    for (int i = 0; i < 10000; i++)
+    {
+        unsigned int nCompact = (GetRand(35) << 24) | GetRand(0x01000000);
+
+        CBigNum bn;
+        bn.SetCompact(nCompact);
+        bool fNegative;
+        bool fOverflow;
+        arith_uint256 n;
+        n.SetCompact(nCompact, &fNegative, &fOverflow);
+
+        BOOST_CHECK_EQUAL(fNegative, bn < 0);
+        BOOST_CHECK_EQUAL(fOverflow, (bn < 0 ? -bn : bn) > CBigNum(~uint256(0)));
+        if (!fNegative && !fOverflow)
+        {
+            BOOST_CHECK(ArithToUint256(n) == bn.getuint256());
+            BOOST_CHECK_EQUAL(n.GetCompact(), bn.GetCompact());
+        }
+    }
+
+    for (int i = 0; i < 10000; i++)
+    {
+        arith_uint256 n = RandArith256();
+        BOOST_CHECK_EQUAL(n.GetCompact(), CBigNum(ArithToUint256(n)).GetCompact());
+    }
+
+    // Limits used by the chain parameters
+    for (int i = 0; i < 32; i++)
+    {
+        arith_uint256 n = ~arith_uint256(0) >> i;
+        BOOST_CHECK_EQUAL(n.GetCompact(), CBigNum(ArithToUint256(n)).GetCompact());
+    }
+}
+
+BOOST_AUTO_TEST_CASE(arith_uint256_muldiv)
+{
+    const CBigNum bnModulus = CBigNum(1) << 256;
+    for (int i = 0; i < 10000; i++)
+    {
+        arith_uint256 a = RandArith256();
+        arith_uint256 b = (i % 2) ? RandArith256() : arith_uint256(GetRand(std::numeric_limits<uint64_t>::max()));
+        CBigNum bnA(ArithToUint256(a));
+        CBigNum bnB(ArithToUint256(b));
+
+        BOOST_CHECK(ArithToUint256(a * b) == ((bnA * bnB) % bnModulus).getuint256());
+        BOOST_CHECK(ArithToUint256(a * (uint32_t)b.GetLow64()) == ((bnA * CBigNum((uint32_t)b.GetLow64())) % bnModulus).getuint256());
+        if (b != 0)
+            BOOST_CHECK(ArithToUint256(a / b) == (bnA / bnB).getuint256());
+    }
+
+    BOOST_CHECK_THROW(arith_uint256(1) / arith_uint256(0), uint_error);
+}
+
+BOOST_AUTO_TEST_CASE(arith_uint256_blocktrust)
+{
+    // CBlockIndex::GetBlockTrust() computes 2**256 / (target+1) as ~target / (target+1) + 1
+    for (int i = 0; i < 1000; i++)
+    {
+        arith_uint256 bnTarget = RandArith256();
+        if (bnTarget == 0 || bnTarget == ~arith_uint256(0))
+            continue;
+        CBigNum bn(ArithToUint256(bnTarget));
+        BOOST_CHECK(ArithToUint256(arith_uint256(~bnTarget) / (bnTarget + 1) + 1) == ((CBigNum(1) << 256) / (bn + 1)).getuint256());
+    }
+}
+
+// Compact targets around the chain limits, plus zero, negative and overflowing ones
+static const unsigned int vTestBits[] = {
+    0x00000000, 0x01003456, 0x01123456, 0x04923456, 0x05009234,
+    0x1b0404cb, 0x1c0fffff, 0x1d00ffff, 0x1d0fffff, 0x1d100000,
+    0x1e00ffff, 0x1e0fffff, 0x1f00ffff, 0x207fffff, 0x20800000,
+    0x20ffffff, 0x2100ffff, 0x21010000, 0x227fffff, 0x23000001,
+};
+
+static const char* vTestNetworks[] = { "main", "test", "regtest" };
+
+// GetNextTargetRequired() as it was written with CBigNum
+static unsigned int BigNumNextTargetRequired(const CBlockIndex* pindexLast, bool fProofOfStake)
+{
+    CBigNum bnTargetLimit(ArithToUint256(fProofOfStake ? Params().ProofOfStakeLimit() : Params().ProofOfWorkLimit()));
+
+    if (pindexLast == NULL)
+        return bnTargetLimit.GetCompact();
+
+    const CBlockIndex* pindexPrev = GetLastBlockIndex(pindexLast, fProofOfStake);
+    if (pindexPrev->pprev == NULL)
+        return bnTargetLimit.GetCompact();
+    const CBlockIndex* pindexPrevPrev = GetLastBlockIndex(pindexPrev->pprev, fProofOfStake);
+    if (pindexPrevPrev->pprev == NULL)
+        return bnTargetLimit.GetCompact();
+
+    int64_t nActualSpacing = pindexPrev->GetBlockTime() - pindexPrevPrev->GetBlockTime();
+    if (nActualSpacing < 0)
+        nActualSpacing = Params().TargetSpacing();
+
+    CBigNum bnNew;
+    bnNew.SetCompact(pindexPrev->nBits);
+    int64_t nInterval = Params().TargetTimespan() / Params().TargetSpacing();
+    bnNew *= ((nInterval - 1) * Params().TargetSpacing() + nActualSpacing + nActualSpacing);
+    bnNew /= ((nInterval + 1) * Params().TargetSpacing());
+
+    if (bnNew <= 0 || bnNew > bnTargetLimit)
+        bnNew = bnTargetLimit;
+
+    return bnNew.GetCompact();
+}
+
+// CheckProofOfWork() as it was written with CBigNum
+static bool BigNumCheckProofOfWork(uint256 hash, unsigned int nBits)
+{
+    CBigNum bnTarget;
+    bnTarget.SetCompact(nBits);
+
+    if (bnTarget <= 0 || bnTarget > CBigNum(ArithToUint256(Params().ProofOfWorkLimit())))
+        return false;
+
+    if (hash > bnTarget.getuint256())
+        return false;
+
+    return true;
+}
+
+// CBlockIndex::GetBlockTrust() as it was written with CBigNum
+static uint256 BigNumBlockTrust(unsigned int nBits)
+{
+    CBigNum bnTarget;
+    bnTarget.SetCompact(nBits);
+
+    if (bnTarget <= 0)
+        return 0;
+
+    return ((CBigNum(1)<<256) / (bnTarget+1)).getuint256();
+}
+
+// Hashes on either side of the target encoded by nBits, where it fits in 256 bits
+static std::vector<uint256> TestHashes(unsigned int nBits)
+{
+    std::vector<uint256> vHashes;
+    vHashes.push_back(0);
+    vHashes.push_back(1);
+    vHashes.push_back(~uint256(0));
+    vHashes.push_back(GetRandHash());
+
+    bool fNegative;
+    bool fOverflow;
+    arith_uint256 bnTarget;
+    bnTarget.SetCompact(nBits, &fNegative, &fOverflow);
+    if (!fNegative && !fOverflow)
+    {
+        vHashes.push_back(ArithToUint256(bnTarget));
+        vHashes.push_back(ArithToUint256(bnTarget + 1));
+        if (bnTarget != 0)
+            vHashes.push_back(ArithToUint256(bnTarget - 1));
+    }
+    return vHashes;
+}
+
+BOOST_AUTO_TEST_CASE(arith_uint256_nexttarget)
+{
+    const int64_t vSpacing[] = { -100, 0, 1, 9, 10, 11, 59, 60, 61, 600, 3600, 86400, 4000000000LL };
+
+    // Blocks 1 and 2 are of the kind being retargeted, block 3 of the other kind,
+    // so GetLastBlockIndex() has to step back over it
+    CBlockIndex vIndex[4];
+    for (int i = 1; i < 4; i++)
+    {
+        vIndex[i].pprev = &vIndex[i - 1];
+        vIndex[i].nHeight = i;
+    }
+
+    for (unsigned int nNet = 0; nNet < sizeof(vTestNetworks) / sizeof(vTestNetworks[0]); nNet++)
+    {
+        SelectParams(vTestNetworks[nNet]);
+        for (int nProofOfStake = 0; nProofOfStake < 2; nProofOfStake++)
+        {
+            bool fProofOfStake = nProofOfStake;
+            for (int i = 1; i < 4; i++)
+            {
+                vIndex[i].nFlags = 0;
+                if ((i < 3) == fProofOfStake)
+                    vIndex[i].SetProofOfStake();
+            }
+            vIndex[3].nBits = 0x1d00ffff;
+
+            for (int i = -1; i < 4; i++)
+            {
+                const CBlockIndex* pindexLast = i < 0 ? NULL : &vIndex[i];
+                BOOST_CHECK_EQUAL(GetNextTargetRequired(pindexLast, fProofOfStake), BigNumNextTargetRequired(pindexLast, fProofOfStake));
+            }
+
+            for (unsigned int i = 0; i < sizeof(vTestBits) / sizeof(vTestBits[0]); i++)
+            {
+                for (unsigned int j = 0; j < sizeof(vSpacing) / sizeof(vSpacing[0]); j++)
+                {
+                    vIndex[2].nBits = vTestBits[i];
+                    vIndex[1].nTime = 1000;
+                    vIndex[2].nTime = 1000 + vSpacing[j];
+                    BOOST_CHECK_EQUAL(GetNextTargetRequired(&vIndex[3], fProofOfStake), BigNumNextTargetRequired(&vIndex[3], fProofOfStake));
+                }
+            }
+
+            for (int i = 0; i < 1000; i++)
+            {
+                vIndex[2].nBits = (GetRand(35) << 24) | GetRand(0x01000000);
+                vIndex[1].nTime = GetRand(0x80000000);
+                vIndex[2].nTime = GetRand(0x80000000);
+                BOOST_CHECK_EQUAL(GetNextTargetRequired(&vIndex[3], fProofOfStake), BigNumNextTargetRequired(&vIndex[3], fProofOfStake));
+            }
+        }
+    }
+    SelectParams(CChainParams::MAIN);
+}
+
+BOOST_AUTO_TEST_CASE(arith_uint256_checkpow)
+{
+    for (unsigned int nNet = 0; nNet < sizeof(vTestNetworks) / sizeof(vTestNetworks[0]); nNet++)
+    {
+        SelectParams(vTestNetworks[nNet]);
+        std::vector<unsigned int> vBits(vTestBits, vTestBits + sizeof(vTestBits) / sizeof(vTestBits[0]));
+        vBits.push_back(Params().ProofOfWorkLimit().GetCompact());
+        for (int i = 0; i < 100; i++)
+            vBits.push_back((GetRand(35) << 24) | GetRand(0x01000000));
+
+        for (unsigned int i = 0; i < vBits.size(); i++)
+        {
+            std::vector<uint256> vHashes = TestHashes(vBits[i]);
+            for (unsigned int j = 0; j < vHashes.size(); j++)
+                BOOST_CHECK_EQUAL(CheckProofOfWork(vHashes[j], vBits[i]), BigNumCheckProofOfWork(vHashes[j], vBits[i]));
+        }
+    }
+    SelectParams(CChainParams::MAIN);
+}
+
+BOOST_AUTO_TEST_CASE(arith_uint256_stake_target)
+{
+    const int64_t vValue[] = { 0, 1, COIN, 100 * COIN, MAX_MONEY, std::numeric_limits<int64_t>::max(), -1, -COIN };
+
+    std::vector<unsigned int> vBits(vTestBits, vTestBits + sizeof(vTestBits) / sizeof(vTestBits[0]));
+    for (int i = 0; i < 100; i++)
+        vBits.push_back((GetRand(35) << 24) | GetRand(0x01000000));
+
+    for (unsigned int i = 0; i < vBits.size(); i++)
+    {
+        for (unsigned int j = 0; j < sizeof(vValue) / sizeof(vValue[0]); j++)
+        {
+            arith_uint256 bnTarget;
+            bool fAnyHash;
+            bool fTargetValid = GetStakeTarget(vBits[i], vValue[j], bnTarget, fAnyHash);
+
+            CBigNum bnBigTarget;
+            bnBigTarget.SetCompact(vBits[i]);
+            bnBigTarget *= CBigNum(vValue[j]);
+
+            // Where CBigNum's weighted target fits in 256 bits the values agree
+            if (bnBigTarget >= 0 && bnBigTarget <= CBigNum(~uint256(0)))
+                BOOST_CHECK(fTargetValid && !fAnyHash && ArithToUint256(bnTarget) == bnBigTarget.getuint256());
+
+            // and CheckStakeKernelHash() accepts the same hashes as before
+            std::vector<uint256> vHashes = TestHashes(vBits[i]);
+            vHashes.push_back(ArithToUint256(bnTarget));
+            vHashes.push_back(bnBigTarget > 0 && bnBigTarget <= CBigNum(~uint256(0)) ? bnBigTarget.getuint256() : ~uint256(0));
+            for (unsigned int k = 0; k < vHashes.size(); k++)
+            {
+                bool fMet = fTargetValid && (fAnyHash || UintToArith256(vHashes[k]) <= bnTarget);
+                BOOST_CHECK_EQUAL(fMet, CBigNum(vHashes[k]) <= bnBigTarget);
+            }
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(arith_uint256_blocktrust_index)
+{
+    std::vector<unsigned int> vBits(vTestBits, vTestBits + sizeof(vTestBits) / sizeof(vTestBits[0]));
+    for (int i = 0; i < 1000; i++)
+        vBits.push_back((GetRand(35) << 24) | GetRand(0x01000000));
+
+    CBlockIndex index;
+    for (unsigned int i = 0; i < vBits.size(); i++)
+    {
+        index.nBits = vBits[i];
+        BOOST_CHECK(index.GetBlockTrust() == BigNumBlockTrust(vBits[i]));
+        BOOST_CHECK(CBlockIndex::GetBlockTrust(vBits[i]) == BigNumBlockTrust(vBits[i]));
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
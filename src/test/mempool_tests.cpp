@@ -0,0 +1,108 @@
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "txmempool.h"
+
+using namespace std;
+
+// Helpers:
+static CTransaction
+Spend(const uint256& hashPrev, unsigned int nOutputs)
+{
+    CTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(hashPrev, 0);
+    tx.vout.resize(nOutputs);
+    for (unsigned int i = 0; i < nOutputs; i++)
+        tx.vout[i].nValue = COIN;
+    return tx;
+}
+
+BOOST_AUTO_TEST_SUITE(mempool_tests)
+
+BOOST_AUTO_TEST_CASE(MempoolLinks)
+{
+    CTxMemPool pool;
+
+    CTransaction txParent = Spend(uint256(1), 2);
+    CTransaction txChild = Spend(txParent.GetHash(), 1);
+    CTransaction txGrandChild = Spend(txChild.GetHash(), 1);
+    uint256 hashParent = txParent.GetHash();
+    uint256 hashChild = txChild.GetHash();
+    uint256 hashGrandChild = txGrandChild.GetHash();
+
+    // Child first, as a reorganization would put the parent back afterwards
+    pool.addUnchecked(hashChild, CTxMemPoolEntry(txChild, 20000, 2, 1, 0.0, 0));
+    pool.addUnchecked(hashParent, CTxMemPoolEntry(txParent, 10000, 1, 1, 0.0, COIN));
+    pool.addUnchecked(hashGrandChild, CTxMemPoolEntry(txGrandChild, 0, 3, 1, 0.0, 0));
+
+    BOOST_CHECK(pool.mapTx[hashParent].setParents.empty());
+    BOOST_CHECK(pool.mapTx[hashParent].setChildren.count(hashChild));
+    BOOST_CHECK(pool.mapTx[hashChild].setParents.count(hashParent));
+    BOOST_CHECK(pool.mapTx[hashGrandChild].setParents.count(hashChild));
+
+    set<uint256> setDescendants;
+    pool.CalculateDescendants(hashParent, setDescendants);
+    BOOST_CHECK_EQUAL(setDescendants.size(), 3U);
+    set<uint256> setAncestors;
+    pool.CalculateAncestors(hashGrandChild, setAncestors);
+    BOOST_CHECK_EQUAL(setAncestors.size(), 3U);
+
+    // Fee rate and time indexes follow the entries
+    BOOST_CHECK_EQUAL(pool.setByFeeRate.size(), 3U);
+    BOOST_CHECK(pool.setByFeeRate.begin()->second == hashGrandChild);
+    BOOST_CHECK(pool.setByFeeRate.rbegin()->second == hashChild);
+    BOOST_CHECK(pool.setByTime.begin()->second == hashParent);
+
+    // Confirming the parent leaves the children without in-pool parents
+    pool.remove(txParent);
+    BOOST_CHECK_EQUAL(pool.size(), 2U);
+    BOOST_CHECK(pool.mapTx[hashChild].setParents.empty());
+
+    pool.remove(txChild, true);
+    BOOST_CHECK_EQUAL(pool.size(), 0U);
+    BOOST_CHECK(pool.setByFeeRate.empty());
+    BOOST_CHECK(pool.setByTime.empty());
+    BOOST_CHECK_EQUAL(pool.GetTotalTxSize(), 0U);
+}
+
+BOOST_AUTO_TEST_CASE(MempoolPriority)
+{
+    CTransaction tx = Spend(uint256(1), 1);
+    CTxMemPoolEntry entry(tx, 0, 0, 100, 1.0, 10 * COIN);
+
+    // Chain inputs age by one confirmation per block
+    BOOST_CHECK_EQUAL(entry.GetPriority(100), 1.0);
+    BOOST_CHECK_CLOSE(entry.GetPriority(101), 1.0 + (double)(10 * COIN) / entry.nTxSize, 1e-9);
+}
+
+BOOST_AUTO_TEST_CASE(MempoolTrimAndExpire)
+{
+    CTxMemPool pool;
+
+    // A cheap parent whose child pays enough for both, and a middling loner
+    CTransaction txParent = Spend(uint256(1), 1);
+    CTransaction txChild = Spend(txParent.GetHash(), 1);
+    CTransaction txLoner = Spend(uint256(2), 1);
+    pool.addUnchecked(txParent.GetHash(), CTxMemPoolEntry(txParent, 0, 100, 1, 0.0, 0));
+    pool.addUnchecked(txChild.GetHash(), CTxMemPoolEntry(txChild, 100 * CENT, 100, 1, 0.0, 0));
+    pool.addUnchecked(txLoner.GetHash(), CTxMemPoolEntry(txLoner, CENT, 200, 1, 0.0, 0));
+
+    const CTxMemPoolEntry& entryParent = pool.mapTx[txParent.GetHash()];
+    BOOST_CHECK_EQUAL(entryParent.nFeesWithDescendants, 100 * CENT);
+    BOOST_CHECK(entryParent.GetDescendantScore() > pool.mapTx[txLoner.GetHash()].GetDescendantScore());
+    BOOST_CHECK_EQUAL(pool.GetMinFee(1), 0);
+
+    // Over the limit the loner goes first, and the fee to get in rises
+    uint64_t nUsage = pool.DynamicMemoryUsage();
+    BOOST_CHECK_EQUAL(pool.TrimToSize(nUsage - 1), 1U);
+    BOOST_CHECK(!pool.exists(txLoner.GetHash()));
+    BOOST_CHECK(pool.GetMinFee(nUsage) > 0);
+
+    // Expiring the parent takes the child along
+    BOOST_CHECK_EQUAL(pool.Expire(150), 2U);
+    BOOST_CHECK_EQUAL(pool.size(), 0U);
+    BOOST_CHECK_EQUAL(pool.DynamicMemoryUsage(), 0U);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
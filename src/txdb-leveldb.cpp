@@ -20,20 +20,50 @@
 #include "util.h"
 #include "main.h"
 #include "chainparams.h"
+#include "ui_interface.h"
 
 using namespace std;
 using namespace boost;
 
 leveldb::DB *txdb; // global pointer for LevelDB object instance
 
-static leveldb::Options GetOptions() {
+// Options the global instance was opened with
+static leveldb::Options txdbOptions;
+static bool fBulkLoad = false;
+
+boost::shared_mutex CTxDB::mutexTxDB;
+
+// Integer option strArg, clamped to [nMin, nMax]
+static int64_t GetClampedArg(const std::string& strArg, int64_t nDefault, int64_t nMin, int64_t nMax)
+{
+    return std::min(nMax, std::max(nMin, GetArg(strArg, nDefault)));
+}
+
+static leveldb::Options GetOptions(bool fBulk) {
     leveldb::Options options;
-    int nCacheSizeMB = GetArg("-dbcache", 25);
-    options.block_cache = leveldb::NewLRUCache(nCacheSizeMB * 1048576);
-    options.filter_policy = leveldb::NewBloomFilterPolicy(10);
+    size_t nCacheSize = GetClampedArg("-dbcache", 25, 1, MAX_DB_CACHE) * 1048576;
+    options.block_cache = leveldb::NewLRUCache(nCacheSize);
+    int nBloomBits = GetClampedArg("-dbbloombits", 10, 0, MAX_DB_BLOOM_BITS);
+    options.filter_policy = nBloomBits > 0 ? leveldb::NewBloomFilterPolicy(nBloomBits) : NULL;
+    // During the initial download a large memtable means fewer, larger level-0
+    // files and less time stalled on compaction
+    if (fBulk)
+        options.write_buffer_size = GetClampedArg("-dbbulkwritebuffer", 128, 1, MAX_DB_WRITE_BUFFER) * 1048576;
+    else
+        options.write_buffer_size = GetClampedArg("-dbwritebuffer", 4, 1, MAX_DB_WRITE_BUFFER) * 1048576;
+    options.max_open_files = GetClampedArg("-dbmaxopenfiles", 1000, MIN_DB_OPEN_FILES, MAX_DB_OPEN_FILES);
+    options.block_size = GetClampedArg("-dbblocksize", 4, 1, MAX_DB_BLOCK_SIZE) * 1024;
+    options.compression = GetBoolArg("-dbcompression", true) ? leveldb::kSnappyCompression : leveldb::kNoCompression;
     return options;
 }
 
+static void FreeOptions() {
+    delete txdbOptions.filter_policy;
+    txdbOptions.filter_policy = NULL;
+    delete txdbOptions.block_cache;
+    txdbOptions.block_cache = NULL;
+}
+
 static void init_blockindex(leveldb::Options& options, bool fRemoveOld = false, bool fCreateBootstrap = false) {
     // First time init.
     filesystem::path directory = GetDataDir() / "txleveldb";
@@ -71,10 +101,11 @@ static void init_blockindex(leveldb::Options& options, bool fRemoveOld = false,
 
 // CDB subclasses are created and destroyed VERY OFTEN. That's why
 // we shouldn't treat this as a free operations.
-CTxDB::CTxDB(const char* pszMode)
+CTxDB::CTxDB(const char* pszMode) : lockTxDB(mutexTxDB)
 {
     assert(pszMode);
     activeBatch = NULL;
+    activeBatchIndex = NULL;
     fReadOnly = (!strchr(pszMode, '+') && !strchr(pszMode, 'w'));
 
     if (txdb) {
@@ -84,11 +115,10 @@ CTxDB::CTxDB(const char* pszMode)
 
     bool fCreate = strchr(pszMode, 'c');
 
-    options = GetOptions();
-    options.create_if_missing = fCreate;
-    options.filter_policy = leveldb::NewBloomFilterPolicy(10);
+    txdbOptions = GetOptions(fBulkLoad);
+    txdbOptions.create_if_missing = fCreate;
 
-    init_blockindex(options); // Init directory
+    init_blockindex(txdbOptions); // Init directory
     pdb = txdb;
 
     if (Exists(string("version")))
@@ -105,8 +135,10 @@ CTxDB::CTxDB(const char* pszMode)
             txdb = pdb = NULL;
             delete activeBatch;
             activeBatch = NULL;
+            delete activeBatchIndex;
+            activeBatchIndex = NULL;
 
-            init_blockindex(options, true, true); // Remove directory and create new database
+            init_blockindex(txdbOptions, true, true); // Remove directory and create new database
             pdb = txdb;
 
             bool fTmp = fReadOnly;
@@ -130,27 +162,54 @@ void CTxDB::Close()
 {
     delete txdb;
     txdb = pdb = NULL;
-    delete options.filter_policy;
-    options.filter_policy = NULL;
-    delete options.block_cache;
-    options.block_cache = NULL;
+    FreeOptions();
     delete activeBatch;
     activeBatch = NULL;
+    delete activeBatchIndex;
+    activeBatchIndex = NULL;
+}
+
+bool CTxDB::SetBulkLoad(bool fBulk)
+{
+    if (fBulk == fBulkLoad)
+        return true;
+
+    boost::unique_lock<boost::shared_mutex> lock(mutexTxDB, boost::try_to_lock);
+    if (!lock.owns_lock())
+        return false;
+
+    if (txdb) {
+        delete txdb;
+        txdb = NULL;
+        FreeOptions();
+        txdbOptions = GetOptions(fBulk);
+        init_blockindex(txdbOptions);
+    }
+    fBulkLoad = fBulk;
+    LogPrintf("LevelDB switched to %s profile\n", fBulk ? "bulk load" : "normal");
+    return true;
 }
 
 bool CTxDB::TxnBegin()
 {
     assert(!activeBatch);
     activeBatch = new leveldb::WriteBatch();
+    activeBatchIndex = new BatchIndex();
     return true;
 }
 
-bool CTxDB::TxnCommit()
+bool CTxDB::TxnCommit(bool fSync)
 {
     assert(activeBatch);
-    leveldb::Status status = pdb->Write(leveldb::WriteOptions(), activeBatch);
+    // A synced write also makes every earlier unsynced batch durable, as they
+    // share the log file
+    leveldb::WriteOptions writeOptions;
+    writeOptions.sync = fSync && !fBulkLoad;
+    leveldb::Status status = pdb->Write(writeOptions, activeBatch);
     delete activeBatch;
     activeBatch = NULL;
+    delete activeBatchIndex;
+    activeBatchIndex = NULL;
     if (!status.ok()) {
         LogPrintf("LevelDB batch commit failure: %s\n", status.ToString());
         return false;
@@ -158,48 +217,21 @@ bool CTxDB::TxnCommit()
     return true;
 }
 
-class CBatchScanner : public leveldb::WriteBatch::Handler {
-public:
-    std::string needle;
-    bool *deleted;
-    std::string *foundValue;
-    bool foundEntry;
-
-    CBatchScanner() : foundEntry(false) {}
-
-    virtual void Put(const leveldb::Slice& key, const leveldb::Slice& value) {
-        if (key.ToString() == needle) {
-            foundEntry = true;
-            *deleted = false;
-            *foundValue = value.ToString();
-        }
-    }
-
-    virtual void Delete(const leveldb::Slice& key) {
-        if (key.ToString() == needle) {
-            foundEntry = true;
-            *deleted = true;
-        }
-    }
-};
-
 // When performing a read, if we have an active batch we need to check it first
 // before reading from the database, as the rest of the code assumes that once
-// a database transaction begins reads are consistent with it. It would be good
-// to change that assumption in future and avoid the performance hit, though in
-// practice it does not appear to be large.
+// a database transaction begins reads are consistent with it. The batch index
+// keeps this a single hash lookup however large the batch grows.
 bool CTxDB::ScanBatch(const CDataStream &key, string *value, bool *deleted) const {
-    assert(activeBatch);
+    assert(activeBatch && activeBatchIndex);
     *deleted = false;
-    CBatchScanner scanner;
-    scanner.needle = key.str();
-    scanner.deleted = deleted;
-    scanner.foundValue = value;
-    leveldb::Status status = activeBatch->Iterate(&scanner);
-    if (!status.ok()) {
-        throw runtime_error(status.ToString());
-    }
-    return scanner.foundEntry;
+    BatchIndex::const_iterator it = activeBatchIndex->find(key.str());
+    if (it == activeBatchIndex->end())
+        return false;
+    if (it->second.fDeleted)
+        *deleted = true;
+    else
+        *value = it->second.strValue;
+    return true;
 }
 
 bool CTxDB::ReadTxIndex(uint256 hash, CTxIndex& txindex)
@@ -323,13 +355,286 @@ static CBlockIndex *InsertBlockIndex(uint256 hash)
     return pindexNew;
 }
 
-bool CTxDB::LoadBlockIndex()
+//
+// Block index snapshot
+//
+// On a clean shutdown the in-memory block index is dumped to blkindex.snap as
+// one contiguous run of fixed-size records ordered by height. Parents are
+// referenced by record number and the chain trust is stored, so loading is a
+// single pass without hash lookups or sorting. The snapshot is removed as soon
+// as it has been read; after a crash the LevelDB scan is used instead.
+//
+
+static const int BLOCKINDEX_SNAPSHOT_VERSION = 1;
+
+static boost::filesystem::path GetBlockIndexSnapshotPath()
 {
-    if (mapBlockIndex.size() > 0) {
-        // Already loaded once in this session. It can happen during migration
-        // from BDB.
-        return true;
+    return GetDataDir() / "blkindex.snap";
+}
+
+static bool SortByHeight(const CBlockIndex* a, const CBlockIndex* b)
+{
+    return a->nHeight < b->nHeight;
+}
+
+bool CTxDB::WriteBlockIndexSnapshot()
+{
+    if (pindexBest == NULL)
+        return false;
+
+    int64_t nStart = GetTimeMillis();
+
+    vector<CBlockIndex*> vSorted;
+    vSorted.reserve(mapBlockIndex.size());
+    BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
+        vSorted.push_back(item.second);
+    sort(vSorted.begin(), vSorted.end(), SortByHeight);
+
+    map<const CBlockIndex*, int> mapRecord;
+    for (unsigned int i = 0; i < vSorted.size(); i++)
+        mapRecord[vSorted[i]] = i;
+
+    CDataStream ssSnap(SER_DISK, CLIENT_VERSION);
+    ssSnap.reserve(vSorted.size() * 256);
+    ssSnap << FLATDATA(Params().MessageStart());
+    ssSnap << BLOCKINDEX_SNAPSHOT_VERSION << hashBestChain << (unsigned int)vSorted.size();
+    BOOST_FOREACH(const CBlockIndex* pindex, vSorted)
+    {
+        int nPrev = pindex->pprev ? mapRecord[pindex->pprev] : -1;
+        int nNext = pindex->pnext ? mapRecord[pindex->pnext] : -1;
+        ssSnap << pindex->GetBlockHash() << nPrev << nNext << pindex->nChainTrust;
+        ssSnap << pindex->nFile << pindex->nBlockPos << pindex->nHeight;
+        ssSnap << pindex->nMint << pindex->nMoneySupply << pindex->nFlags << pindex->nStakeModifier;
+        ssSnap << pindex->prevoutStake << pindex->nStakeTime << pindex->hashProof;
+        ssSnap << pindex->nVersion << pindex->hashMerkleRoot << pindex->nTime << pindex->nBits << pindex->nNonce;
+    }
+    uint256 hash = Hash(ssSnap.begin(), ssSnap.end());
+    ssSnap << hash;
+
+    boost::filesystem::path pathSnap = GetBlockIndexSnapshotPath();
+    boost::filesystem::path pathTmp = pathSnap.string() + ".new";
+    FILE *file = fopen(pathTmp.string().c_str(), "wb");
+    CAutoFile fileout = CAutoFile(file, SER_DISK, CLIENT_VERSION);
+    if (!fileout)
+        return error("WriteBlockIndexSnapshot() : open failed");
+    try {
+        fileout.write(&ssSnap[0], ssSnap.size());
+    }
+    catch (std::exception &e) {
+        return error("WriteBlockIndexSnapshot() : I/O error");
+    }
+    FileCommit(fileout);
+    fileout.fclose();
+
+    if (!RenameOver(pathTmp, pathSnap))
+        return error("WriteBlockIndexSnapshot() : rename-into-place failed");
+
+    LogPrintf("Wrote block index snapshot of %u entries  %dms\n", vSorted.size(), GetTimeMillis() - nStart);
+    return true;
+}
+
+bool CTxDB::LoadBlockIndexSnapshot()
+{
+    boost::filesystem::path pathSnap = GetBlockIndexSnapshotPath();
+    if (!boost::filesystem::exists(pathSnap))
+        return false;
+
+    int64_t nStart = GetTimeMillis();
+
+    // Read the whole file in one go and drop it straight away, so that it is
+    // never used against a database that changed after it was written
+    vector<char> vchData;
+    {
+        FILE *file = fopen(pathSnap.string().c_str(), "rb");
+        CAutoFile filein = CAutoFile(file, SER_DISK, CLIENT_VERSION);
+        if (!filein)
+            return error("LoadBlockIndexSnapshot() : open failed");
+        vchData.resize(boost::filesystem::file_size(pathSnap));
+        try {
+            if (!vchData.empty())
+                filein.read(&vchData[0], vchData.size());
+        }
+        catch (std::exception &e) {
+            vchData.clear();
+        }
+    }
+    boost::filesystem::remove(pathSnap);
+
+    if (vchData.size() < sizeof(uint256))
+        return error("LoadBlockIndexSnapshot() : I/O error or file truncated");
+    CDataStream ssSnap(&vchData[0], &vchData[0] + vchData.size() - sizeof(uint256), SER_DISK, CLIENT_VERSION);
+    uint256 hashIn;
+    memcpy(&hashIn, &vchData[vchData.size() - sizeof(uint256)], sizeof(uint256));
+    if (hashIn != Hash(ssSnap.begin(), ssSnap.end()))
+        return error("LoadBlockIndexSnapshot() : checksum mismatch; data corrupted");
+
+    vector<CBlockIndex*> vIndex;
+    vector<int> vNext;
+    try {
+        unsigned char pchMsgTmp[4];
+        int nSnapVersion;
+        uint256 hashBestSnap;
+        unsigned int nCount;
+        ssSnap >> FLATDATA(pchMsgTmp) >> nSnapVersion >> hashBestSnap >> nCount;
+        if (memcmp(pchMsgTmp, Params().MessageStart(), sizeof(pchMsgTmp)))
+            return error("LoadBlockIndexSnapshot() : invalid network magic number");
+        if (nSnapVersion != BLOCKINDEX_SNAPSHOT_VERSION)
+            return error("LoadBlockIndexSnapshot() : unknown version %d", nSnapVersion);
+
+        uint256 hashBestDB;
+        if (!ReadHashBestChain(hashBestDB) || hashBestDB != hashBestSnap)
+            return error("LoadBlockIndexSnapshot() : best chain does not match the database");
+
+        vIndex.reserve(nCount);
+        vNext.reserve(nCount);
+        for (unsigned int i = 0; i < nCount; i++)
+        {
+            uint256 hash;
+            int nPrev, nNext;
+            CBlockIndex* pindexNew = new CBlockIndex();
+            vIndex.push_back(pindexNew);
+            ssSnap >> hash >> nPrev >> nNext >> pindexNew->nChainTrust;
+            ssSnap >> pindexNew->nFile >> pindexNew->nBlockPos >> pindexNew->nHeight;
+            ssSnap >> pindexNew->nMint >> pindexNew->nMoneySupply >> pindexNew->nFlags >> pindexNew->nStakeModifier;
+            ssSnap >> pindexNew->prevoutStake >> pindexNew->nStakeTime >> pindexNew->hashProof;
+            ssSnap >> pindexNew->nVersion >> pindexNew->hashMerkleRoot >> pindexNew->nTime >> pindexNew->nBits >> pindexNew->nNonce;
+
+            // Records are ordered by height, so a parent always comes first
+            // and a successor always later
+            if (nPrev >= (int)i || nNext >= (int)nCount || (nNext >= 0 && nNext <= (int)i))
+                throw runtime_error("bad record link");
+            pindexNew->pprev = nPrev >= 0 ? vIndex[nPrev] : NULL;
+            vNext.push_back(nNext);
+
+            map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
+            pindexNew->phashBlock = &((*mi).first);
+        }
+    }
+    catch (std::exception &e) {
+        BOOST_FOREACH(CBlockIndex* pindex, vIndex)
+            delete pindex;
+        mapBlockIndex.clear();
+        return error("LoadBlockIndexSnapshot() : I/O error or stream data corrupted");
     }
+
+    for (unsigned int i = 0; i < vIndex.size(); i++)
+    {
+        CBlockIndex* pindex = vIndex[i];
+        pindex->pnext = vNext[i] >= 0 ? vIndex[vNext[i]] : NULL;
+
+        if (pindexGenesisBlock == NULL && pindex->GetBlockHash() == Params().HashGenesisBlock())
+            pindexGenesisBlock = pindex;
+
+        // NovaCoin: build setStakeSeen
+        if (pindex->IsProofOfStake())
+            setStakeSeen.insert(make_pair(pindex->prevoutStake, pindex->nStakeTime));
+    }
+
+    LogPrintf("Loaded block index snapshot of %u entries  %dms\n", vIndex.size(), GetTimeMillis() - nStart);
+    return true;
+}
+
+namespace {
+
+// Reads the blocks to verify at startup and runs the context-free checks on
+// them on a few worker threads, at most nWindow blocks ahead of the caller,
+// which consumes the results in chain order.
+class CBlockCheckPool
+{
+public:
+    struct CResult
+    {
+        CBlock block;
+        bool fRead;
+        bool fValid;
+    };
+
+private:
+    const vector<CBlockIndex*>& vIndex;
+    int nCheckLevel;
+    unsigned int nWindow;
+
+    boost::mutex mutex;
+    boost::condition_variable condWorker;
+    boost::condition_variable condMaster;
+    vector<CResult*> vResult;
+    unsigned int nNext;     // next block handed to a worker
+    unsigned int nConsumed; // number of results taken by the caller
+    bool fQuit;
+    boost::thread_group threadGroup;
+
+    void Thread()
+    {
+        while (true)
+        {
+            unsigned int i;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (!fQuit && nNext < vIndex.size() && nNext >= nConsumed + nWindow)
+                    condWorker.wait(lock);
+                if (fQuit || nNext >= vIndex.size())
+                    return;
+                i = nNext++;
+            }
+
+            CResult* presult = new CResult();
+            presult->fRead = presult->block.ReadFromDisk(vIndex[i]);
+            // check level 1: verify block validity
+            // check level 7: verify block signature too
+            presult->fValid = !presult->fRead || nCheckLevel <= 0 ||
+                              presult->block.CheckBlock(true, true, (nCheckLevel>6));
+
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                vResult[i] = presult;
+            }
+            condMaster.notify_all();
+        }
+    }
+
+public:
+    CBlockCheckPool(const vector<CBlockIndex*>& vIndexIn, int nCheckLevelIn, int nThreads) :
+        vIndex(vIndexIn), nCheckLevel(nCheckLevelIn), nWindow(nThreads * 8),
+        vResult(vIndexIn.size(), (CResult*)NULL), nNext(0), nConsumed(0), fQuit(false)
+    {
+        for (int i = 0; i < nThreads; i++)
+            threadGroup.create_thread(boost::bind(&CBlockCheckPool::Thread, this));
+    }
+
+    ~CBlockCheckPool()
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            fQuit = true;
+        }
+        condWorker.notify_all();
+        threadGroup.join_all();
+        BOOST_FOREACH(CResult* presult, vResult)
+            delete presult;
+    }
+
+    // Wait for the result of block i, which the caller then owns. Results
+    // have to be taken in order.
+    CResult* Get(unsigned int i)
+    {
+        CResult* presult;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            while (vResult[i] == NULL)
+                condMaster.wait(lock);
+            presult = vResult[i];
+            vResult[i] = NULL;
+            nConsumed = i + 1;
+        }
+        condWorker.notify_all();
+        return presult;
+    }
+};
+
+} // anon namespace
+
+bool CTxDB::LoadBlockIndexGuts()
+{
     // The block index is an in-memory structure that maps hashes to on-disk
     // locations where the contents of the block can be found. Here, we scan it
     // out of the DB and into mapBlockIndex.
@@ -411,6 +716,20 @@ bool CTxDB::LoadBlockIndex()
         pindex->nChainTrust = (pindex->pprev ? pindex->pprev->nChainTrust : 0) + pindex->GetBlockTrust();
     }
 
+    return true;
+}
+
+bool CTxDB::LoadBlockIndex()
+{
+    if (mapBlockIndex.size() > 0) {
+        // Already loaded once in this session. It can happen during migration
+        // from BDB.
+        return true;
+    }
+
+    if (!LoadBlockIndexSnapshot() && !LoadBlockIndexGuts())
+        return false;
+
     // Load hashBestChain pointer to end of best chain
     if (!ReadHashBestChain(hashBestChain))
     {
@@ -446,19 +765,37 @@ bool CTxDB::LoadBlockIndex()
     if (nCheckDepth > nBestHeight)
         nCheckDepth = nBestHeight;
     LogPrintf("Verifying last %i blocks at level %i\n", nCheckDepth, nCheckLevel);
-    CBlockIndex* pindexFork = NULL;
-    map<pair<unsigned int, unsigned int>, CBlockIndex*> mapBlockPos;
+    vector<CBlockIndex*> vCheck;
     for (CBlockIndex* pindex = pindexBest; pindex && pindex->pprev; pindex = pindex->pprev)
     {
-        boost::this_thread::interruption_point();
         if (pindex->nHeight < nBestHeight-nCheckDepth)
             break;
-        CBlock block;
-        if (!block.ReadFromDisk(pindex))
+        vCheck.push_back(pindex);
+    }
+
+    // Block reads and the level 1 checks run ahead on -par worker threads.
+    // The checks against the transaction index stay serial, as each block
+    // depends on the ones above it.
+    CBlockCheckPool checkpool(vCheck, nCheckLevel, std::max(nScriptCheckThreads, 1));
+    CBlockIndex* pindexFork = NULL;
+    map<pair<unsigned int, unsigned int>, CBlockIndex*> mapBlockPos;
+    int nLastProgress = -1;
+    for (unsigned int i = 0; i < vCheck.size(); i++)
+    {
+        boost::this_thread::interruption_point();
+        int nProgress = i * 100 / vCheck.size();
+        if (nProgress != nLastProgress)
+        {
+            uiInterface.InitMessage(strprintf(_("Verifying blocks... %d%%"), nProgress));
+            nLastProgress = nProgress;
+        }
+
+        CBlockIndex* pindex = vCheck[i];
+        auto_ptr<CBlockCheckPool::CResult> presult(checkpool.Get(i));
+        const CBlock& block = presult->block;
+        if (!presult->fRead)
             return error("LoadBlockIndex() : block.ReadFromDisk failed");
-        // check level 1: verify block validity
-        // check level 7: verify block signature too
-        if (nCheckLevel>0 && !block.CheckBlock(true, true, (nCheckLevel>6)))
+        if (!presult->fValid)
         {
             LogPrintf("LoadBlockIndex() : *** found bad block at %d, hash=%s\n", pindex->nHeight, pindex->GetBlockHash().ToString());
             pindexFork = pindex->pprev;
@@ -12,9 +12,21 @@
 #include <string>
 #include <vector>
 
+#include <boost/thread/locks.hpp>
+#include <boost/thread/shared_mutex.hpp>
+#include <boost/unordered_map.hpp>
+
 #include <leveldb/db.h>
 #include <leveldb/write_batch.h>
 
+/** Limits for the transaction index LevelDB options */
+static const int64_t MAX_DB_CACHE = 4096;           // -dbcache, megabytes
+static const int64_t MAX_DB_WRITE_BUFFER = 1024;    // -dbwritebuffer and -dbbulkwritebuffer, megabytes
+static const int64_t MIN_DB_OPEN_FILES = 20;        // -dbmaxopenfiles
+static const int64_t MAX_DB_OPEN_FILES = 10000;
+static const int64_t MAX_DB_BLOCK_SIZE = 1024;      // -dbblocksize, kilobytes
+static const int64_t MAX_DB_BLOOM_BITS = 64;        // -dbbloombits
+
 // Class that provides access to a LevelDB. Note that this class is frequently
 // instantiated on the stack and then destroyed again, so instantiation has to
 // be very cheap. Unfortunately that means, a CTxDB instance is actually just a
@@ -35,18 +47,39 @@ public:
         // Note that this is not the same as Close() because it deletes only
         // data scoped to this TxDB object.
         delete activeBatch;
+        delete activeBatchIndex;
     }
 
     // Destroys the underlying shared global state accessed by this TxDB.
     void Close();
 
+    // Reopen the database with the bulk load profile (large memtable, no
+    // sync on commit) or the normal one. Returns false without doing anything
+    // if another CTxDB is in use; call again later.
+    static bool SetBulkLoad(bool fBulk);
+
 private:
+    // Held shared by every CTxDB for its lifetime, and exclusively while the
+    // global instance is reopened with a different profile.
+    static boost::shared_mutex mutexTxDB;
+    boost::shared_lock<boost::shared_mutex> lockTxDB;
+
     leveldb::DB *pdb;  // Points to the global instance.
 
     // A batch stores up writes and deletes for atomic application. When this
     // field is non-NULL, writes/deletes go there instead of directly to disk.
     leveldb::WriteBatch *activeBatch;
-    leveldb::Options options;
+
+    // Hashed index of the latest put or delete for each key in activeBatch,
+    // so reads inside a transaction don't have to iterate the whole batch.
+    struct CBatchEntry
+    {
+        bool fDeleted;
+        std::string strValue;
+    };
+    typedef boost::unordered_map<std::string, CBatchEntry> BatchIndex;
+    BatchIndex *activeBatchIndex;
+
     bool fReadOnly;
     int nVersion;
 
@@ -111,7 +144,11 @@ protected:
         ssValue << value;
 
         if (activeBatch) {
-            activeBatch->Put(ssKey.str(), ssValue.str());
+            std::string strKey = ssKey.str();
+            CBatchEntry& entry = (*activeBatchIndex)[strKey];
+            entry.fDeleted = false;
+            entry.strValue = ssValue.str();
+            activeBatch->Put(strKey, entry.strValue);
             return true;
         }
         leveldb::Status status = pdb->Put(leveldb::WriteOptions(), ssKey.str(), ssValue.str());
@@ -134,7 +171,11 @@ protected:
         ssKey.reserve(1000);
         ssKey << key;
         if (activeBatch) {
-            activeBatch->Delete(ssKey.str());
+            std::string strKey = ssKey.str();
+            CBatchEntry& entry = (*activeBatchIndex)[strKey];
+            entry.fDeleted = true;
+            entry.strValue.clear();
+            activeBatch->Delete(strKey);
             return true;
         }
         leveldb::Status status = pdb->Delete(leveldb::WriteOptions(), ssKey.str());
@@ -164,11 +205,14 @@ protected:
 
 public:
     bool TxnBegin();
-    bool TxnCommit();
+    // fSync: wait for the batch to reach the disk, ignored during bulk loads
+    bool TxnCommit(bool fSync = false);
     bool TxnAbort()
     {
         delete activeBatch;
         activeBatch = NULL;
+        delete activeBatchIndex;
+        activeBatchIndex = NULL;
         return true;
     }
 
@@ -202,7 +246,11 @@ public:
     bool ReadCheckpointPubKey(std::string& strPubKey);
     bool WriteCheckpointPubKey(const std::string& strPubKey);
     bool LoadBlockIndex();
+
+    // Dump the in-memory block index for a fast load on the next start
+    static bool WriteBlockIndexSnapshot();
 private:
+    bool LoadBlockIndexSnapshot();
     bool LoadBlockIndexGuts();
 };
 
@@ -7,10 +7,91 @@
 #include "txmempool.h"
 #include "main.h" // for CTransaction
 
+#include <cmath>
+
 using namespace std;
 
+// Memory taken by one parent/child link: a node in each of the two sets
+static const size_t LINK_USAGE = 2 * (sizeof(uint256) + 4 * sizeof(void*));
+
+// Rough heap footprint of a pool entry: its node in mapTx, the vectors and
+// scripts of the transaction, its mapNextTx nodes and its index nodes
+static size_t GetEntryUsage(const CTransaction& tx)
+{
+    size_t nUsage = sizeof(CTxMemPoolEntry) + 4 * sizeof(void*);
+    nUsage += tx.vin.capacity() * sizeof(CTxIn) + tx.vout.capacity() * sizeof(CTxOut);
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        nUsage += txin.scriptSig.capacity() + sizeof(COutPoint) + sizeof(CInPoint) + 4 * sizeof(void*);
+    BOOST_FOREACH(const CTxOut& txout, tx.vout)
+        nUsage += txout.scriptPubKey.capacity();
+    nUsage += 4 * (sizeof(std::pair<double, uint256>) + 4 * sizeof(void*));
+    return nUsage;
+}
+
+CTxMemPoolEntry::CTxMemPoolEntry()
+{
+    nFee = 0;
+    nTxSize = 0;
+    nTime = 0;
+    nHeight = 0;
+    dPriority = 0.0;
+    nValueInChain = 0;
+    nUsageSize = 0;
+    nFeesWithDescendants = 0;
+    nSizeWithDescendants = 0;
+}
+
+CTxMemPoolEntry::CTxMemPoolEntry(const CTransaction& txIn, int64_t nFeeIn, int64_t nTimeIn,
+                                 int nHeightIn, double dPriorityIn, int64_t nValueInChainIn):
+    tx(txIn), nFee(nFeeIn), nTime(nTimeIn), nHeight(nHeightIn),
+    dPriority(dPriorityIn), nValueInChain(nValueInChainIn)
+{
+    nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+    nUsageSize = GetEntryUsage(tx);
+    nFeesWithDescendants = nFee;
+    nSizeWithDescendants = nTxSize;
+}
+
+double CTxMemPoolEntry::GetPriority(int nCurrentHeight) const
+{
+    if (nTxSize == 0)
+        return 0.0;
+    return dPriority + (double)nValueInChain * (nCurrentHeight - nHeight) / nTxSize;
+}
+
+double CTxMemPoolEntry::GetFeePerKb() const
+{
+    if (nTxSize == 0)
+        return 0.0;
+    return (double)nFee * 1000 / nTxSize;
+}
+
+double CTxMemPoolEntry::GetDescendantScore() const
+{
+    if (nSizeWithDescendants == 0)
+        return GetFeePerKb();
+    return std::max(GetFeePerKb(), (double)nFeesWithDescendants * 1000 / nSizeWithDescendants);
+}
+
 CTxMemPool::CTxMemPool()
 {
+    nTransactionsUpdated = 0;
+    nTotalTxSize = 0;
+    nTotalUsage = 0;
+    nEvicted = 0;
+    nExpired = 0;
+    dRollingMinFee = 0;
+    nLastRollingFeeUpdate = 0;
+}
+
+void CTxMemPool::UpdateDescendantState(const uint256& hash, int64_t nFeeDelta, int64_t nSizeDelta)
+{
+    // Move the entry in the score index along with its package totals
+    CTxMemPoolEntry& entry = mapTx[hash];
+    setByDescendantScore.erase(make_pair(entry.GetDescendantScore(), hash));
+    entry.nFeesWithDescendants += nFeeDelta;
+    entry.nSizeWithDescendants += nSizeDelta;
+    setByDescendantScore.insert(make_pair(entry.GetDescendantScore(), hash));
 }
 
 unsigned int CTxMemPool::GetTransactionsUpdated() const
@@ -25,21 +106,220 @@ void CTxMemPool::AddTransactionsUpdated(unsigned int n)
     nTransactionsUpdated += n;
 }
 
-bool CTxMemPool::addUnchecked(const uint256& hash, CTransaction &tx)
+bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry)
 {
     // Add to memory pool without checking anything.
     // Used by main.cpp AcceptToMemoryPool(), which DOES do
     // all the appropriate checks.
     LOCK(cs);
     {
-        mapTx[hash] = tx;
+        if (mapTx.count(hash))
+            removeUnchecked(hash);
+        CTxMemPoolEntry& entryNew = mapTx[hash];
+        entryNew = entry;
+        entryNew.setParents.clear();
+        entryNew.setChildren.clear();
+
+        const CTransaction& tx = entryNew.tx;
         for (unsigned int i = 0; i < tx.vin.size(); i++)
-            mapNextTx[tx.vin[i].prevout] = CInPoint(&mapTx[hash], i);
+        {
+            const COutPoint& prevout = tx.vin[i].prevout;
+            mapNextTx[prevout] = CInPoint(&entryNew.tx, i);
+            std::map<uint256, CTxMemPoolEntry>::iterator mi = mapTx.find(prevout.hash);
+            if (mi != mapTx.end())
+            {
+                if (entryNew.setParents.insert(prevout.hash).second)
+                    nTotalUsage += LINK_USAGE;
+                mi->second.setChildren.insert(hash);
+            }
+        }
+
+        // Transactions put back by a reorganization may already have spenders here
+        for (unsigned int i = 0; i < tx.vout.size(); i++)
+        {
+            std::map<COutPoint, CInPoint>::iterator it = mapNextTx.find(COutPoint(hash, i));
+            if (it == mapNextTx.end())
+                continue;
+            uint256 hashChild = it->second.ptx->GetHash();
+            std::map<uint256, CTxMemPoolEntry>::iterator mi = mapTx.find(hashChild);
+            if (mi != mapTx.end())
+            {
+                if (entryNew.setChildren.insert(hashChild).second)
+                    nTotalUsage += LINK_USAGE;
+                mi->second.setParents.insert(hash);
+            }
+        }
+
+        // Package totals: a brand new transaction only adds itself to its
+        // ancestors, one put back under existing spenders is recounted
+        entryNew.nFeesWithDescendants = entryNew.nFee;
+        entryNew.nSizeWithDescendants = entryNew.nTxSize;
+        setByDescendantScore.insert(make_pair(entryNew.GetDescendantScore(), hash));
+        std::set<uint256> setAncestors;
+        CalculateAncestors(hash, setAncestors);
+        setAncestors.erase(hash);
+        if (entryNew.setChildren.empty())
+        {
+            BOOST_FOREACH(const uint256& hashAncestor, setAncestors)
+                UpdateDescendantState(hashAncestor, entryNew.nFee, entryNew.nTxSize);
+        }
+        else
+        {
+            setAncestors.insert(hash);
+            BOOST_FOREACH(const uint256& hashAncestor, setAncestors)
+            {
+                std::set<uint256> setDescendants;
+                CalculateDescendants(hashAncestor, setDescendants);
+                int64_t nFees = 0;
+                int64_t nSize = 0;
+                BOOST_FOREACH(const uint256& hashDescendant, setDescendants)
+                {
+                    const CTxMemPoolEntry& entryDescendant = mapTx[hashDescendant];
+                    nFees += entryDescendant.nFee;
+                    nSize += entryDescendant.nTxSize;
+                }
+                const CTxMemPoolEntry& entryAncestor = mapTx[hashAncestor];
+                UpdateDescendantState(hashAncestor, nFees - entryAncestor.nFeesWithDescendants,
+                                      nSize - (int64_t)entryAncestor.nSizeWithDescendants);
+            }
+        }
+
+        setByFeeRate.insert(make_pair(entryNew.GetFeePerKb(), hash));
+        setByTime.insert(make_pair(entryNew.nTime, hash));
+        nTotalTxSize += entryNew.nTxSize;
+        nTotalUsage += entryNew.nUsageSize;
         nTransactionsUpdated++;
     }
     return true;
 }
 
+void CTxMemPool::removeUnchecked(const uint256& hash)
+{
+    // Unlink a single entry from its relatives and the indexes; cs must be held.
+    // Ancestors stop counting it, so descendants have to go before it.
+    std::map<uint256, CTxMemPoolEntry>::iterator it = mapTx.find(hash);
+    if (it == mapTx.end())
+        return;
+    const CTxMemPoolEntry& entry = it->second;
+
+    std::set<uint256> setAncestors;
+    CalculateAncestors(hash, setAncestors);
+    setAncestors.erase(hash);
+    BOOST_FOREACH(const uint256& hashAncestor, setAncestors)
+        UpdateDescendantState(hashAncestor, -entry.nFee, -(int64_t)entry.nTxSize);
+
+    BOOST_FOREACH(const CTxIn& txin, entry.tx.vin)
+        mapNextTx.erase(txin.prevout);
+    BOOST_FOREACH(const uint256& hashParent, entry.setParents)
+    {
+        std::map<uint256, CTxMemPoolEntry>::iterator mi = mapTx.find(hashParent);
+        if (mi != mapTx.end())
+            mi->second.setChildren.erase(hash);
+    }
+    BOOST_FOREACH(const uint256& hashChild, entry.setChildren)
+    {
+        std::map<uint256, CTxMemPoolEntry>::iterator mi = mapTx.find(hashChild);
+        if (mi != mapTx.end())
+            mi->second.setParents.erase(hash);
+    }
+
+    setByFeeRate.erase(make_pair(entry.GetFeePerKb(), hash));
+    setByTime.erase(make_pair(entry.nTime, hash));
+    setByDescendantScore.erase(make_pair(entry.GetDescendantScore(), hash));
+    nTotalTxSize -= entry.nTxSize;
+    nTotalUsage -= entry.nUsageSize + LINK_USAGE * (entry.setParents.size() + entry.setChildren.size());
+    mapTx.erase(it);
+    nTransactionsUpdated++;
+}
+
+void CTxMemPool::removeStaged(const std::set<uint256>& setRemove)
+{
+    // Leaves first, so each removal still reaches every ancestor counting it
+    std::set<uint256> setLeft(setRemove);
+    while (!setLeft.empty())
+    {
+        size_t nLeft = setLeft.size();
+        for (std::set<uint256>::iterator it = setLeft.begin(); it != setLeft.end(); )
+        {
+            std::map<uint256, CTxMemPoolEntry>::iterator mi = mapTx.find(*it);
+            if (mi != mapTx.end() && !mi->second.setChildren.empty())
+            {
+                ++it;
+                continue;
+            }
+            removeUnchecked(*it);
+            setLeft.erase(it++);
+        }
+        if (setLeft.size() == nLeft)
+        {
+            // Children outside the set; can't happen for a set of descendants
+            BOOST_FOREACH(const uint256& hash, setLeft)
+                removeUnchecked(hash);
+            break;
+        }
+    }
+}
+
+unsigned int CTxMemPool::TrimToSize(uint64_t nSizeLimit)
+{
+    LOCK(cs);
+    unsigned int nRemoved = 0;
+    while (!mapTx.empty() && nTotalUsage > nSizeLimit)
+    {
+        // Evict the lowest scoring transaction and everything spending it
+        std::pair<double, uint256> lowest = *setByDescendantScore.begin();
+        std::set<uint256> setRemove;
+        CalculateDescendants(lowest.second, setRemove);
+        removeStaged(setRemove);
+        nRemoved += setRemove.size();
+
+        // Newcomers have to pay more than what was just evicted
+        dRollingMinFee = std::max(dRollingMinFee, lowest.first + MIN_RELAY_TX_FEE);
+        nLastRollingFeeUpdate = GetTime();
+    }
+    nEvicted += nRemoved;
+    return nRemoved;
+}
+
+unsigned int CTxMemPool::Expire(int64_t nTime)
+{
+    LOCK(cs);
+    std::set<uint256> setRemove;
+    for (std::set<std::pair<int64_t, uint256> >::iterator it = setByTime.begin();
+         it != setByTime.end() && it->first < nTime; ++it)
+        CalculateDescendants(it->second, setRemove);
+    removeStaged(setRemove);
+    nExpired += setRemove.size();
+    return setRemove.size();
+}
+
+int64_t CTxMemPool::GetMinFee(uint64_t nSizeLimit) const
+{
+    LOCK(cs);
+    if (dRollingMinFee == 0)
+        return 0;
+
+    int64_t nNow = GetTime();
+    if (nNow > nLastRollingFeeUpdate + 10)
+    {
+        // Decay faster once the pool has room again
+        double dHalfLife = ROLLING_FEE_HALFLIFE;
+        if (nTotalUsage < nSizeLimit / 4)
+            dHalfLife /= 4;
+        else if (nTotalUsage < nSizeLimit / 2)
+            dHalfLife /= 2;
+        dRollingMinFee /= pow(2.0, (nNow - nLastRollingFeeUpdate) / dHalfLife);
+        nLastRollingFeeUpdate = nNow;
+
+        if (dRollingMinFee < MIN_RELAY_TX_FEE / 2)
+        {
+            dRollingMinFee = 0;
+            return 0;
+        }
+    }
+    return (int64_t)dRollingMinFee;
+}
+
 bool CTxMemPool::remove(const CTransaction &tx, bool fRecursive)
 {
     // Remove transaction from memory pool
@@ -48,17 +328,14 @@ bool CTxMemPool::remove(const CTransaction &tx, bool fRecursive)
         uint256 hash = tx.GetHash();
         if (mapTx.count(hash))
         {
-            if (fRecursive) {
-                for (unsigned int i = 0; i < tx.vout.size(); i++) {
-                    std::map<COutPoint, CInPoint>::iterator it = mapNextTx.find(COutPoint(hash, i));
-                    if (it != mapNextTx.end())
-                        remove(*it->second.ptx, true);
-                }
+            if (fRecursive)
+            {
+                std::set<uint256> setDescendants;
+                CalculateDescendants(hash, setDescendants);
+                removeStaged(setDescendants);
             }
-            BOOST_FOREACH(const CTxIn& txin, tx.vin)
-                mapNextTx.erase(txin.prevout);
-            mapTx.erase(hash);
-            nTransactionsUpdated++;
+            else
+                removeUnchecked(hash);
         }
     }
     return true;
@@ -84,6 +361,11 @@ void CTxMemPool::clear()
     LOCK(cs);
     mapTx.clear();
     mapNextTx.clear();
+    setByFeeRate.clear();
+    setByTime.clear();
+    setByDescendantScore.clear();
+    nTotalTxSize = 0;
+    nTotalUsage = 0;
     ++nTransactionsUpdated;
 }
 
@@ -93,15 +375,49 @@ void CTxMemPool::queryHashes(std::vector<uint256>& vtxid)
 
     LOCK(cs);
     vtxid.reserve(mapTx.size());
-    for (map<uint256, CTransaction>::iterator mi = mapTx.begin(); mi != mapTx.end(); ++mi)
+    for (map<uint256, CTxMemPoolEntry>::iterator mi = mapTx.begin(); mi != mapTx.end(); ++mi)
         vtxid.push_back((*mi).first);
 }
 
+void CTxMemPool::CalculateDescendants(const uint256& hash, std::set<uint256>& setDescendants) const
+{
+    // The transaction itself and everything in the pool spending it, directly or not
+    LOCK(cs);
+    std::vector<uint256> vStack(1, hash);
+    while (!vStack.empty())
+    {
+        uint256 hashNext = vStack.back();
+        vStack.pop_back();
+        std::map<uint256, CTxMemPoolEntry>::const_iterator mi = mapTx.find(hashNext);
+        if (mi == mapTx.end() || !setDescendants.insert(hashNext).second)
+            continue;
+        BOOST_FOREACH(const uint256& hashChild, mi->second.setChildren)
+            vStack.push_back(hashChild);
+    }
+}
+
+void CTxMemPool::CalculateAncestors(const uint256& hash, std::set<uint256>& setAncestors) const
+{
+    // The transaction itself and every pool transaction it depends on
+    LOCK(cs);
+    std::vector<uint256> vStack(1, hash);
+    while (!vStack.empty())
+    {
+        uint256 hashNext = vStack.back();
+        vStack.pop_back();
+        std::map<uint256, CTxMemPoolEntry>::const_iterator mi = mapTx.find(hashNext);
+        if (mi == mapTx.end() || !setAncestors.insert(hashNext).second)
+            continue;
+        BOOST_FOREACH(const uint256& hashParent, mi->second.setParents)
+            vStack.push_back(hashParent);
+    }
+}
+
 bool CTxMemPool::lookup(uint256 hash, CTransaction& result) const
 {
     LOCK(cs);
-    std::map<uint256, CTransaction>::const_iterator i = mapTx.find(hash);
+    std::map<uint256, CTxMemPoolEntry>::const_iterator i = mapTx.find(hash);
     if (i == mapTx.end()) return false;
-    result = i->second;
+    result = i->second.tx;
     return true;
 }
@@ -5,7 +5,43 @@
 #ifndef COIN_TXMEMPOOL_H
 #define COIN_TXMEMPOOL_H
 
-#include "core.h"
+#include "main.h"
+
+/*
+ * CTxMemPoolEntry stores a pool transaction together with the data
+ * measured when it was accepted: its fee, serialized size, arrival
+ * time and height, and the inputs that determine its priority.
+ * Links to the in-pool transactions it spends and that spend it are
+ * kept up to date by the pool, so block assembly and eviction can
+ * walk dependencies without searching the pool.
+ */
+class CTxMemPoolEntry
+{
+public:
+    CTransaction tx;
+    int64_t nFee;               // Fee paid by the transaction
+    unsigned int nTxSize;       // Serialized size
+    int64_t nTime;              // Local time when entering the pool
+    int nHeight;                // Chain height when entering the pool
+    double dPriority;           // Priority at nHeight
+    int64_t nValueInChain;      // Value of the inputs confirmed in the chain
+    size_t nUsageSize;          // Estimated memory held by the entry in the pool
+    int64_t nFeesWithDescendants;           // Fees of this one and everything spending it
+    uint64_t nSizeWithDescendants;          // Size of this one and everything spending it
+    std::set<uint256> setParents;   // In-pool transactions this one spends
+    std::set<uint256> setChildren;  // In-pool transactions spending this one
+
+    CTxMemPoolEntry();
+    CTxMemPoolEntry(const CTransaction& txIn, int64_t nFeeIn, int64_t nTimeIn,
+                    int nHeightIn, double dPriorityIn, int64_t nValueInChainIn);
+
+    // Chain inputs gain one confirmation per block, pool inputs count nothing
+    double GetPriority(int nCurrentHeight) const;
+    double GetFeePerKb() const;
+    // Fee rate the transaction is worth keeping for: its own, or that of
+    // the package it forms with its descendants if higher
+    double GetDescendantScore() const;
+};
 
 /*
  * CTxMemPool stores valid-according-to-the-current-best-chain
@@ -21,19 +57,44 @@ class CTxMemPool
 {
 private:
     unsigned int nTransactionsUpdated;
+    uint64_t nTotalTxSize;
+    uint64_t nTotalUsage;
+    uint64_t nEvicted;
+    uint64_t nExpired;
+    mutable double dRollingMinFee;      // Fee per kB needed to get in after evictions
+    mutable int64_t nLastRollingFeeUpdate;
+
+    void UpdateDescendantState(const uint256& hash, int64_t nFeeDelta, int64_t nSizeDelta);
+    void removeUnchecked(const uint256& hash);
+    void removeStaged(const std::set<uint256>& setRemove);
 
 public:
+    // Half-life of the rolling minimum fee while the pool stays full
+    static const int ROLLING_FEE_HALFLIFE = 60 * 60 * 12;
+
     mutable CCriticalSection cs;
-    std::map<uint256, CTransaction> mapTx;
+    std::map<uint256, CTxMemPoolEntry> mapTx;
     std::map<COutPoint, CInPoint> mapNextTx;
+    // Secondary indexes over mapTx, lowest first
+    std::set<std::pair<double, uint256> > setByFeeRate;
+    std::set<std::pair<int64_t, uint256> > setByTime;
+    std::set<std::pair<double, uint256> > setByDescendantScore;
 
     CTxMemPool();
 
-    bool addUnchecked(const uint256& hash, CTransaction &tx);
+    bool addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry);
     bool remove(const CTransaction &tx, bool fRecursive = false);
     bool removeConflicts(const CTransaction &tx);
     void clear();
     void queryHashes(std::vector<uint256>& vtxid);
+    void CalculateDescendants(const uint256& hash, std::set<uint256>& setDescendants) const;
+    void CalculateAncestors(const uint256& hash, std::set<uint256>& setAncestors) const;
+    // Drop the lowest scoring packages until the pool uses at most nSizeLimit bytes
+    unsigned int TrimToSize(uint64_t nSizeLimit);
+    // Drop transactions that entered before nTime, with their descendants
+    unsigned int Expire(int64_t nTime);
+    // Fee per kB a new transaction must pay, decaying back to zero after evictions
+    int64_t GetMinFee(uint64_t nSizeLimit) const;
     unsigned int GetTransactionsUpdated() const;
     void AddTransactionsUpdated(unsigned int n);
 
@@ -43,6 +104,25 @@ public:
         return mapTx.size();
     }
 
+    uint64_t GetTotalTxSize() const
+    {
+        LOCK(cs);
+        return nTotalTxSize;
+    }
+
+    uint64_t DynamicMemoryUsage() const
+    {
+        LOCK(cs);
+        return nTotalUsage;
+    }
+
+    void GetEvictionCounts(uint64_t& nEvictedRet, uint64_t& nExpiredRet) const
+    {
+        LOCK(cs);
+        nEvictedRet = nEvicted;
+        nExpiredRet = nExpired;
+    }
+
     bool exists(uint256 hash) const
     {
         LOCK(cs);
@@ -7,6 +7,7 @@
 
 #include "base58.h"
 #include "coincontrol.h"
+#include "init.h"
 #include "kernel.h"
 #include "net.h"
 #include "timedata.h"
@@ -17,6 +18,7 @@
 #include <boost/algorithm/string/replace.hpp>
 #include <boost/range/algorithm.hpp>
 #include <boost/numeric/ublas/matrix.hpp>
+#include <boost/thread.hpp>
 
 using namespace std;
 
@@ -78,11 +80,133 @@ bool CWallet::AddKeyPubKey(const CKey& secret, const CPubKey &pubkey)
     if (!fFileBacked)
         return true;
     if (!IsCrypted()) {
-        return CWalletDB(strWalletFile).WriteKey(pubkey, secret.GetPrivKey(), mapKeyMetadata[pubkey.GetID()]);
+        if (pwalletdbEncryption)
+            return pwalletdbEncryption->WriteKey(pubkey, secret.GetPrivKey(), mapKeyMetadata[pubkey.GetID()]);
+        else
+            return CWalletDB(strWalletFile).WriteKey(pubkey, secret.GetPrivKey(), mapKeyMetadata[pubkey.GetID()]);
     }
     return true;
 }
 
+// Keys already in the wallet are skipped. Either all the new keys and labels
+// are written, or none are and they are taken out of memory again.
+CRescanReservation::CRescanReservation(CWallet& walletIn)
+    : wallet(walletIn), lockRescan(walletIn.cs_rescan, "cs_rescan", __FILE__, __LINE__, true), fOwner(false)
+{
+    if (lockRescan && !wallet.fRescanReserved)
+    {
+        wallet.fAbortRescan = false;
+        wallet.fRescanReserved = true;
+        fOwner = true;
+    }
+}
+
+CRescanReservation::~CRescanReservation()
+{
+    if (fOwner)
+        wallet.fRescanReserved = false;
+}
+
+bool CWallet::ImportKeys(const vector<CKeyImport>& vImport, int& nImportedRet)
+{
+    AssertLockHeld(cs_wallet);
+    nImportedRet = 0;
+
+    if (fFileBacked)
+    {
+        pwalletdbEncryption = new CWalletDB(strWalletFile);
+        if (!pwalletdbEncryption->TxnBegin())
+        {
+            delete pwalletdbEncryption;
+            pwalletdbEncryption = NULL;
+            return false;
+        }
+    }
+
+    bool fOk = true;
+    vector<pair<CTxDestination, pair<string, ChangeType> > > vNotify;
+    // What to undo if the batch can't be written: the added keys, and the
+    // address book entries and metadata they had before
+    vector<CKeyID> vAdded;
+    map<CKeyID, string> mapLabelsBefore;
+    map<CKeyID, CKeyMetadata> mapMetadataBefore;
+    int64_t nTimeFirstKeyBefore = nTimeFirstKey;
+    BOOST_FOREACH(const CKeyImport& import, vImport)
+    {
+        CPubKey pubkey = import.key.GetPubKey();
+        CKeyID keyID = pubkey.GetID();
+        if (HaveKey(keyID))
+            continue;
+
+        vAdded.push_back(keyID);
+        std::map<CTxDestination, std::string>::iterator mi = mapAddressBook.find(keyID);
+        if (mi != mapAddressBook.end())
+            mapLabelsBefore[keyID] = mi->second;
+        std::map<CKeyID, CKeyMetadata>::iterator mm = mapKeyMetadata.find(keyID);
+        if (mm != mapKeyMetadata.end())
+            mapMetadataBefore[keyID] = mm->second;
+
+        mapKeyMetadata[keyID].nCreateTime = import.nCreateTime;
+        if (!AddKeyPubKey(import.key, pubkey))
+        {
+            fOk = false;
+            break;
+        }
+        if (import.nCreateTime && (!nTimeFirstKey || import.nCreateTime < nTimeFirstKey))
+            nTimeFirstKey = import.nCreateTime;
+
+        if (import.fLabel)
+        {
+            ChangeType status = mapLabelsBefore.count(keyID) ? CT_UPDATED : CT_NEW;
+            mapAddressBook[keyID] = import.strLabel;
+            vNotify.push_back(make_pair(CTxDestination(keyID), make_pair(import.strLabel, status)));
+            if (fFileBacked && !pwalletdbEncryption->WriteName(CCoinAddress(keyID).ToString(), import.strLabel))
+            {
+                fOk = false;
+                break;
+            }
+        }
+        nImportedRet++;
+    }
+
+    if (fFileBacked)
+    {
+        if (fOk)
+            fOk = pwalletdbEncryption->TxnCommit();
+        else
+            pwalletdbEncryption->TxnAbort();
+        delete pwalletdbEncryption;
+        pwalletdbEncryption = NULL;
+    }
+
+    if (!fOk)
+    {
+        BOOST_FOREACH(const CKeyID& keyID, vAdded)
+        {
+            EraseKey(keyID);
+
+            std::map<CKeyID, string>::iterator mi = mapLabelsBefore.find(keyID);
+            if (mi != mapLabelsBefore.end())
+                mapAddressBook[keyID] = mi->second;
+            else
+                mapAddressBook.erase(keyID);
+
+            std::map<CKeyID, CKeyMetadata>::iterator mm = mapMetadataBefore.find(keyID);
+            if (mm != mapMetadataBefore.end())
+                mapKeyMetadata[keyID] = mm->second;
+            else
+                mapKeyMetadata.erase(keyID);
+        }
+        nTimeFirstKey = nTimeFirstKeyBefore;
+        nImportedRet = 0;
+        return false;
+    }
+
+    for (unsigned int i = 0; i < vNotify.size(); i++)
+        NotifyAddressBookChanged(this, vNotify[i].first, vNotify[i].second.first, true, vNotify[i].second.second);
+    return true;
+}
+
 bool CWallet::AddCryptedKey(const CPubKey &vchPubKey, const vector<unsigned char> &vchCryptedSecret)
 {
     if (!CCryptoKeyStore::AddCryptedKey(vchPubKey, vchCryptedSecret))
@@ -348,29 +472,12 @@ int64_t CWallet::IncOrderPosNext(CWalletDB *pwalletdb)
     return nRet;
 }
 
-CWallet::TxItems CWallet::OrderedTxItems(std::list<CAccountingEntry>& acentries, std::string strAccount)
+void CWallet::AddAccountingEntry(const CAccountingEntry& acentry)
 {
-    AssertLockHeld(cs_wallet); // mapWallet
-    CWalletDB walletdb(strWalletFile);
-
-    // First: get all CWalletTx and CAccountingEntry into a sorted-by-order multimap.
-    TxItems txOrdered;
-
-    // Note: maintaining indices in the database of (account,time) --> txid and (account, time) --> acentry
-    // would make this much faster for applications that do this a lot.
-    for (map<uint256, CWalletTx>::iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-    {
-        CWalletTx* wtx = &((*it).second);
-        txOrdered.insert(make_pair(wtx->nOrderPos, TxPair(wtx, (CAccountingEntry*)0)));
-    }
-    acentries.clear();
-    walletdb.ListAccountCreditDebit(strAccount, acentries);
-    BOOST_FOREACH(CAccountingEntry& entry, acentries)
-    {
-        txOrdered.insert(make_pair(entry.nOrderPos, TxPair((CWalletTx*)0, &entry)));
-    }
-
-    return txOrdered;
+    AssertLockHeld(cs_wallet); // laccentries, wtxOrdered
+    laccentries.push_back(acentry);
+    CAccountingEntry& entry = laccentries.back();
+    wtxOrdered.insert(make_pair(entry.nOrderPos, TxPair((CWalletTx*)0, &entry)));
 }
 
 void CWallet::WalletUpdateSpent(const CTransaction &tx, bool fBlock)
@@ -424,7 +531,109 @@ void CWallet::MarkDirty()
         LOCK(cs_wallet);
         BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
             item.second.MarkDirty();
+        fUnspentIndexStale = true;
+    }
+}
+
+void CWallet::MarkUnspentDirty(const uint256& hash) const
+{
+    LOCK(cs_wallet);
+    setUnspentDirtyTx.insert(hash);
+}
+
+// Bring the unspent sets and balance totals up to date; cs_main and cs_wallet must be held
+void CWallet::UpdateUnspentIndex() const
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+
+    // A block that left the main chain may have taken any of our
+    // transactions with it, so a reorganization recounts everything
+    uint256 hashBest = pindexBest ? pindexBest->GetBlockHash() : 0;
+    bool fNewBlock = (hashBest != hashBalanceBlock);
+    if (fNewBlock && hashBalanceBlock != 0)
+    {
+        map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBalanceBlock);
+        if (mi == mapBlockIndex.end() || !(*mi).second->IsInMainChain())
+            fUnspentIndexStale = true;
     }
+    hashBalanceBlock = hashBest;
+
+    if (fUnspentIndexStale)
+    {
+        // Full pass after loading the wallet, adding keys, a rescan or a reorganization
+        setUnspentTx.clear();
+        setImmatureTx.clear();
+        setPendingTx.clear();
+        mapBalanceContrib.clear();
+        balanceTotal.SetNull();
+        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+            setUnspentDirtyTx.insert((*it).first);
+        fUnspentIndexStale = false;
+    }
+    else if (fNewBlock)
+    {
+        // Only maturity, confirmation and finality move with the chain
+        setUnspentDirtyTx.insert(setImmatureTx.begin(), setImmatureTx.end());
+        setUnspentDirtyTx.insert(setPendingTx.begin(), setPendingTx.end());
+    }
+
+    BOOST_FOREACH(const uint256& hash, setUnspentDirtyTx)
+    {
+        setUnspentTx.erase(hash);
+        setImmatureTx.erase(hash);
+        setPendingTx.erase(hash);
+        map<uint256, CWalletBalance>::iterator mb = mapBalanceContrib.find(hash);
+        if (mb != mapBalanceContrib.end())
+        {
+            balanceTotal -= (*mb).second;
+            mapBalanceContrib.erase(mb);
+        }
+
+        map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(hash);
+        if (mi == mapWallet.end())
+            continue;
+        const CWalletTx& wtx = (*mi).second;
+        int nDepth = wtx.GetDepthInMainChain();
+        CWalletBalance balance;
+
+        for (unsigned int i = 0; i < wtx.vout.size(); i++)
+        {
+            if (!wtx.IsSpent(i) && IsMine(wtx.vout[i]))
+            {
+                setUnspentTx.insert(hash);
+                break;
+            }
+        }
+        if (setUnspentTx.count(hash))
+        {
+            bool fFinal = IsFinalTx(wtx);
+            bool fTrusted = wtx.IsTrusted();
+            if (nDepth < 1 || !fFinal)
+                setPendingTx.insert(hash);
+            if (fTrusted)
+                balance.nConfirmed = wtx.GetAvailableCredit();
+            if (!fFinal || (!fTrusted && nDepth == 0))
+                balance.nUnconfirmed = wtx.GetAvailableCredit();
+        }
+
+        if ((wtx.IsCoinBase() || wtx.IsCoinStake()) && nDepth > 0 && wtx.GetBlocksToMaturity() > 0 && IsMine(wtx))
+        {
+            setImmatureTx.insert(hash);
+            int64_t nCredit = GetCredit(wtx);
+            if (wtx.IsCoinBase())
+                balance.nImmature = balance.nNewMint = nCredit;
+            else
+                balance.nStake = nCredit;
+        }
+
+        if (!balance.IsNull())
+        {
+            mapBalanceContrib[hash] = balance;
+            balanceTotal += balance;
+        }
+    }
+    setUnspentDirtyTx.clear();
 }
 
 bool CWallet::AddToWallet(const CWalletTx& wtxIn)
@@ -441,6 +650,7 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn)
         {
             wtx.nTimeReceived = GetAdjustedTime();
             wtx.nOrderPos = IncOrderPosNext();
+            wtxOrdered.insert(make_pair(wtx.nOrderPos, TxPair(&wtx, (CAccountingEntry*)0)));
 
             wtx.nTimeSmart = wtx.nTimeReceived;
             if (wtxIn.hashBlock != 0)
@@ -452,9 +662,7 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn)
                     {
                         // Tolerate times up to the last timestamp in the wallet not more than 5 minutes into the future
                         int64_t latestTolerated = latestNow + 300;
-                        std::list<CAccountingEntry> acentries;
-                        TxItems txOrdered = OrderedTxItems(acentries);
-                        for (TxItems::reverse_iterator it = txOrdered.rbegin(); it != txOrdered.rend(); ++it)
+                        for (TxItems::reverse_iterator it = wtxOrdered.rbegin(); it != wtxOrdered.rend(); ++it)
                         {
                             CWalletTx *const pwtx = (*it).second.first;
                             if (pwtx == &wtx)
@@ -541,6 +749,7 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn)
         }
         // since AddToWallet is called directly for self-originating transactions, check for consumption of own coins
         WalletUpdateSpent(wtx, (wtxIn.hashBlock != 0));
+        MarkUnspentDirty(hash);
 
         // Notify UI of new or updated transaction
         NotifyTransactionChanged(this, hash, fInsertedNew ? CT_NEW : CT_UPDATED);
@@ -591,6 +800,12 @@ void CWallet::SyncTransaction(const CTransaction& tx, const CBlock* pblock, bool
             if (IsFromMe(tx))
                 DisableTransaction(tx);
         }
+
+        // Coins of a disconnected block may be immature again
+        LOCK(cs_wallet);
+        uint256 hash = tx.GetHash();
+        if (mapWallet.count(hash))
+            MarkUnspentDirty(hash);
         return;
     }
 
@@ -603,8 +818,22 @@ void CWallet::EraseFromWallet(const uint256 &hash)
         return;
     {
         LOCK(cs_wallet);
-        if (mapWallet.erase(hash))
+        map<uint256, CWalletTx>::iterator mi = mapWallet.find(hash);
+        if (mi != mapWallet.end())
+        {
+            pair<TxItems::iterator, TxItems::iterator> range = wtxOrdered.equal_range((*mi).second.nOrderPos);
+            for (TxItems::iterator it = range.first; it != range.second; ++it)
+            {
+                if ((*it).second.first == &(*mi).second)
+                {
+                    wtxOrdered.erase(it);
+                    break;
+                }
+            }
+            mapWallet.erase(mi);
             CWalletDB(strWalletFile).EraseTx(hash);
+        }
+        MarkUnspentDirty(hash);
     }
     return;
 }
@@ -864,36 +1093,265 @@ bool CWalletTx::WriteToDisk()
     return CWalletDB(pwallet->strWalletFile).WriteTx(GetHash(), *this);
 }
 
+namespace {
+
+// Whether an output pays to one of the keys or scripts in the sets. Multisig
+// outputs match on any single key, so this lets through a superset of what
+// IsMine() accepts; the wallet makes the final call.
+bool IsRescanCandidate(const CTxOut& txout, const set<CKeyID>& setKeyIDs, const set<CScriptID>& setScriptIDs)
+{
+    vector<valtype> vSolutions;
+    txnouttype whichType;
+    if (!Solver(txout.scriptPubKey, whichType, vSolutions))
+        return false;
+
+    switch (whichType)
+    {
+    case TX_PUBKEY:
+        return setKeyIDs.count(CPubKey(vSolutions[0]).GetID()) > 0;
+    case TX_PUBKEYHASH:
+        return setKeyIDs.count(CKeyID(uint160(vSolutions[0]))) > 0;
+    case TX_SCRIPTHASH:
+        return setScriptIDs.count(CScriptID(uint160(vSolutions[0]))) > 0;
+    case TX_MULTISIG:
+        for (unsigned int i = 1; i + 1 < vSolutions.size(); i++)
+            if (setKeyIDs.count(CPubKey(vSolutions[i]).GetID()))
+                return true;
+        return false;
+    default:
+        return false;
+    }
+}
+
+// Reads the blocks of a rescan on a few worker threads, at most nWindow
+// blocks ahead of the caller, and flags the transactions that may involve
+// the wallet: those paying to its keys or scripts, and those already in or
+// spending from the wallet as it was when the scan started. The caller takes
+// the results in chain order.
+class CRescanPool
+{
+public:
+    struct CResult
+    {
+        CBlock block;
+        bool fRead;
+        vector<bool> vMatch;
+    };
+
+private:
+    const vector<CBlockIndex*>& vIndex;
+    const set<CKeyID>& setKeyIDs;
+    const set<CScriptID>& setScriptIDs;
+    const set<uint256>& setWalletTx;
+    unsigned int nWindow;
+
+    boost::mutex mutex;
+    boost::condition_variable condWorker;
+    boost::condition_variable condMaster;
+    vector<CResult*> vResult;
+    unsigned int nNext;     // next block handed to a worker
+    unsigned int nConsumed; // number of results taken by the caller
+    bool fQuit;
+    boost::thread_group threadGroup;
+
+    bool IsCandidate(const CTransaction& tx) const
+    {
+        if (setWalletTx.count(tx.GetHash()))
+            return true;
+        BOOST_FOREACH(const CTxIn& txin, tx.vin)
+            if (setWalletTx.count(txin.prevout.hash))
+                return true;
+        BOOST_FOREACH(const CTxOut& txout, tx.vout)
+            if (IsRescanCandidate(txout, setKeyIDs, setScriptIDs))
+                return true;
+        return false;
+    }
+
+    void Thread()
+    {
+        while (true)
+        {
+            unsigned int i;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (!fQuit && nNext < vIndex.size() && nNext >= nConsumed + nWindow)
+                    condWorker.wait(lock);
+                if (fQuit || nNext >= vIndex.size())
+                    return;
+                i = nNext++;
+            }
+
+            CResult* presult = new CResult();
+            presult->fRead = presult->block.ReadFromDisk(vIndex[i], true);
+            presult->vMatch.resize(presult->block.vtx.size());
+            for (unsigned int n = 0; n < presult->block.vtx.size(); n++)
+                presult->vMatch[n] = IsCandidate(presult->block.vtx[n]);
+
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                vResult[i] = presult;
+            }
+            condMaster.notify_all();
+        }
+    }
+
+public:
+    CRescanPool(const vector<CBlockIndex*>& vIndexIn, const set<CKeyID>& setKeyIDsIn,
+                const set<CScriptID>& setScriptIDsIn, const set<uint256>& setWalletTxIn, int nThreads) :
+        vIndex(vIndexIn), setKeyIDs(setKeyIDsIn), setScriptIDs(setScriptIDsIn), setWalletTx(setWalletTxIn),
+        nWindow(nThreads * 8), vResult(vIndexIn.size(), (CResult*)NULL), nNext(0), nConsumed(0), fQuit(false)
+    {
+        for (int i = 0; i < nThreads; i++)
+            threadGroup.create_thread(boost::bind(&CRescanPool::Thread, this));
+    }
+
+    ~CRescanPool()
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            fQuit = true;
+        }
+        condWorker.notify_all();
+        threadGroup.join_all();
+        BOOST_FOREACH(CResult* presult, vResult)
+            delete presult;
+    }
+
+    // Wait for the result of block i, which the caller then owns. Results
+    // have to be taken in order.
+    CResult* Get(unsigned int i)
+    {
+        CResult* presult;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            while (vResult[i] == NULL)
+                condMaster.wait(lock);
+            presult = vResult[i];
+            vResult[i] = NULL;
+            nConsumed = i + 1;
+        }
+        condWorker.notify_all();
+        return presult;
+    }
+};
+
+} // anon namespace
+
 // Scan the block chain (starting in pindexStart) for transactions
 // from or to us. If fUpdate is true, found transactions that already
 // exist in the wallet will be updated.
-int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
+//
+// Blocks are read and matched against the wallet's keys and scripts on
+// -par worker threads; the wallet lock is only taken for the transactions
+// they flag. The scan stops early on shutdown or AbortRescan(). Progress
+// goes to the log, and to the splash screen if fShowProgress is set.
+int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate, bool fShowProgress)
 {
+    TRY_LOCK(cs_rescan, lockRescan);
+    if (!lockRescan)
+    {
+        LogPrintf("ScanForWalletTransactions() : another rescan is running\n");
+        return -1;
+    }
+
     int ret = 0;
+    bool fAborted = false;
 
-    CBlockIndex* pindex = pindexStart;
+    vector<CBlockIndex*> vBlocks;
+    set<CKeyID> setKeyIDs;
+    set<CScriptID> setScriptIDs;
+    set<uint256> setWalletTx;
     {
         LOCK2(cs_main, cs_wallet);
-        while (pindex)
+        for (CBlockIndex* pindex = pindexStart; pindex; pindex = pindex->pnext)
         {
             // no need to read and scan block, if block was created before
             // our wallet birthday (as adjusted for block time variability)
-            if (nTimeFirstKey && (pindex->nTime < (nTimeFirstKey - 7200))) {
-                pindex = pindex->pnext;
+            if (nTimeFirstKey && (pindex->nTime < (nTimeFirstKey - 7200)))
                 continue;
+            vBlocks.push_back(pindex);
+        }
+
+        GetKeys(setKeyIDs);
+        GetCScripts(setScriptIDs);
+        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+            setWalletTx.insert((*it).first);
+    }
+
+    bool fWasScanning = fScanningWallet;
+    fScanningWallet = true;
+    // Under a reservation the abort flag was cleared when it was taken, and
+    // an abort since then is meant for this scan
+    if (!fRescanReserved)
+        fAbortRescan = false;
+    if (!vBlocks.empty())
+        LogPrintf("Rescanning %u blocks from height %d\n", vBlocks.size(), vBlocks[0]->nHeight);
+
+    // Transactions added by this scan, whose spends the workers don't know of
+    set<uint256> setFound;
+    {
+        CRescanPool pool(vBlocks, setKeyIDs, setScriptIDs, setWalletTx, std::max(nScriptCheckThreads, 1));
+        int nLastProgress = -1;
+        int64_t nLastLog = GetTime();
+        for (unsigned int i = 0; i < vBlocks.size(); i++)
+        {
+            CBlockIndex* pindex = vBlocks[i];
+            if (fAbortRescan || ShutdownRequested())
+            {
+                LogPrintf("Rescan aborted at block %d\n", pindex->nHeight);
+                fAborted = true;
+                break;
             }
 
-            CBlock block;
-            block.ReadFromDisk(pindex, true);
-            BOOST_FOREACH(CTransaction& tx, block.vtx)
+            int nProgress = i * 100 / vBlocks.size();
+            if (fShowProgress && nProgress != nLastProgress)
+            {
+                uiInterface.InitMessage(strprintf(_("Rescanning... %d%%"), nProgress));
+                nLastProgress = nProgress;
+            }
+            if (GetTime() - nLastLog >= 60)
             {
+                LogPrintf("Still rescanning. At block %d. Progress=%d%%\n", pindex->nHeight, nProgress);
+                nLastLog = GetTime();
+            }
+
+            auto_ptr<CRescanPool::CResult> presult(pool.Get(i));
+            const CBlock& block = presult->block;
+            for (unsigned int n = 0; n < block.vtx.size(); n++)
+            {
+                const CTransaction& tx = block.vtx[n];
+                bool fMatch = presult->vMatch[n];
+                if (!fMatch && !setFound.empty())
+                {
+                    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+                    {
+                        if (setFound.count(txin.prevout.hash))
+                        {
+                            fMatch = true;
+                            break;
+                        }
+                    }
+                }
+                if (!fMatch)
+                    continue;
+
+                LOCK2(cs_main, cs_wallet);
                 if (AddToWalletIfInvolvingMe(tx, &block, fUpdate))
+                {
+                    setFound.insert(tx.GetHash());
                     ret++;
+                }
             }
-            pindex = pindex->pnext;
         }
     }
-    return ret;
+    fScanningWallet = fWasScanning;
+
+    {
+        LOCK(cs_wallet);
+        // Recount the balances from scratch after a rescan
+        fUnspentIndexStale = true;
+    }
+    return fAborted ? -1 : ret;
 }
 
 void CWallet::ReacceptWalletTransactions()
@@ -949,7 +1407,7 @@ void CWallet::ReacceptWalletTransactions()
         if (!vMissingTx.empty())
         {
             // TODO: optimize this to scan just part of the block chain?
-            if (ScanForWalletTransactions(pindexGenesisBlock))
+            if (ScanForWalletTransactions(pindexGenesisBlock) > 0)
                 fRepeat = true;  // Found missing transactions: re-do re-accept.
         }
     }
@@ -1043,48 +1501,23 @@ void CWallet::ResendWalletTransactions(bool fForce)
 
 int64_t CWallet::GetBalance() const
 {
-    int64_t nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            if (pcoin->IsTrusted())
-                nTotal += pcoin->GetAvailableCredit();
-        }
-    }
-
-    return nTotal;
+    LOCK2(cs_main, cs_wallet);
+    UpdateUnspentIndex();
+    return balanceTotal.nConfirmed;
 }
 
 int64_t CWallet::GetUnconfirmedBalance() const
 {
-    int64_t nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            if (!IsFinalTx(*pcoin) || (!pcoin->IsTrusted() && pcoin->GetDepthInMainChain() == 0))
-                nTotal += pcoin->GetAvailableCredit();
-        }
-    }
-    return nTotal;
+    LOCK2(cs_main, cs_wallet);
+    UpdateUnspentIndex();
+    return balanceTotal.nUnconfirmed;
 }
 
 int64_t CWallet::GetImmatureBalance() const
 {
-    int64_t nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx& pcoin = (*it).second;
-            if (pcoin.IsCoinBase() && pcoin.GetBlocksToMaturity() > 0 && pcoin.IsInMainChain())
-                nTotal += GetCredit(pcoin);
-        }
-    }
-    return nTotal;
+    LOCK2(cs_main, cs_wallet);
+    UpdateUnspentIndex();
+    return balanceTotal.nImmature;
 }
 
 // populate vCoins with vector of spendable COutputs
@@ -1094,9 +1527,10 @@ void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const
 
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        UpdateUnspentIndex();
+        BOOST_FOREACH(const uint256& hash, setUnspentTx)
         {
-            const CWalletTx* pcoin = &(*it).second;
+            const CWalletTx* pcoin = &mapWallet.find(hash)->second;
 
             if (!IsFinalTx(*pcoin))
                 continue;
@@ -1116,7 +1550,7 @@ void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const
 
             for (unsigned int i = 0; i < pcoin->vout.size(); i++)
                 if (!(pcoin->IsSpent(i)) && IsMine(pcoin->vout[i]) && pcoin->vout[i].nValue >= nMinimumInputValue &&
-                (!coinControl || !coinControl->HasSelected() || coinControl->IsSelected((*it).first, i)))
+                (!coinControl || !coinControl->HasSelected() || coinControl->IsSelected(hash, i)))
                     vCoins.push_back(COutput(pcoin, i, nDepth));
 
         }
@@ -1129,9 +1563,10 @@ void CWallet::AvailableCoinsForStaking(vector<COutput>& vCoins, unsigned int nSp
 
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        UpdateUnspentIndex();
+        BOOST_FOREACH(const uint256& hash, setUnspentTx)
         {
-            const CWalletTx* pcoin = &(*it).second;
+            const CWalletTx* pcoin = &mapWallet.find(hash)->second;
 
             // Filtering by tx timestamp instead of block timestamp may give false positives but never false negatives
             if (pcoin->nTime + Params().StakeMinAge() > nSpendTime)
@@ -1200,28 +1635,16 @@ static void ApproximateBestSubset(vector<pair<int64_t, pair<const CWalletTx*,uns
 // ppcoin: total coins staked (non-spendable until maturity)
 int64_t CWallet::GetStake() const
 {
-    int64_t nTotal = 0;
     LOCK2(cs_main, cs_wallet);
-    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-    {
-        const CWalletTx* pcoin = &(*it).second;
-        if (pcoin->IsCoinStake() && pcoin->GetBlocksToMaturity() > 0 && pcoin->GetDepthInMainChain() > 0)
-            nTotal += CWallet::GetCredit(*pcoin);
-    }
-    return nTotal;
+    UpdateUnspentIndex();
+    return balanceTotal.nStake;
 }
 
 int64_t CWallet::GetNewMint() const
 {
-    int64_t nTotal = 0;
     LOCK2(cs_main, cs_wallet);
-    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-    {
-        const CWalletTx* pcoin = &(*it).second;
-        if (pcoin->IsCoinBase() && pcoin->GetBlocksToMaturity() > 0 && pcoin->GetDepthInMainChain() > 0)
-            nTotal += CWallet::GetCredit(*pcoin);
-    }
-    return nTotal;
+    UpdateUnspentIndex();
+    return balanceTotal.nNewMint;
 }
 
 struct LargerOrEqualThanThreshold
@@ -1606,8 +2029,6 @@ bool CWallet::GetStakeWeight(const CKeyStore& keystore, uint64_t& nMinWeight, ui
 bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int64_t nSearchInterval, int64_t nFees, CTransaction& txNew, CKey& key)
 {
     CBlockIndex* pindexPrev = pindexBest;
-    CBigNum bnTargetPerCoinDay;
-    bnTargetPerCoinDay.SetCompact(nBits);
 
     txNew.vin.clear();
     txNew.vout.clear();
@@ -1638,80 +2059,96 @@ bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int
     int64_t nCredit = 0;
     CScript scriptPubKeyKernel;
     CTxDB txdb("r");
-    BOOST_FOREACH(PAIRTYPE(const CWalletTx*, unsigned int) pcoin, setCoins)
+
+    // Kernel inputs of the selected coins, in setCoins order. Entries are read
+    // from disk only for new coins or when their block left the main chain.
+    vector<CStakeCandidate> vCandidates;
+    vector<PAIRTYPE(const CWalletTx*, unsigned int) > vCandidateCoins;
     {
-        static int nMaxStakeSearchInterval = 60;
-        bool fKernelFound = false;
-        for (unsigned int n=0; n<min(nSearchInterval,(int64_t)nMaxStakeSearchInterval) && !fKernelFound && pindexPrev == pindexBest; n++)
+        LOCK2(cs_main, cs_wallet);
+        map<COutPoint, CStakeCandidate> mapCandidates;
+        BOOST_FOREACH(PAIRTYPE(const CWalletTx*, unsigned int) pcoin, setCoins)
         {
-            boost::this_thread::interruption_point();
-            // Search backward in time from the given txNew timestamp 
-            // Search nSearchInterval seconds back up to nMaxStakeSearchInterval
             COutPoint prevoutStake = COutPoint(pcoin.first->GetHash(), pcoin.second);
-            int64_t nBlockTime;
-            if (CheckKernel(pindexPrev, nBits, txNew.nTime - n, prevoutStake, &nBlockTime))
+            CStakeCandidate candidate;
+            map<COutPoint, CStakeCandidate>::iterator mi = mapStakeCandidates.find(prevoutStake);
+            if (mi != mapStakeCandidates.end() && mi->second.pindexFrom->IsInMainChain())
+                candidate = mi->second;
+            else if (!GetStakeCandidate(txdb, prevoutStake, candidate))
+                continue;
+            mapCandidates[prevoutStake] = candidate;
+            vCandidates.push_back(candidate);
+            vCandidateCoins.push_back(pcoin);
+        }
+        mapStakeCandidates.swap(mapCandidates);
+    }
+
+    static int nMaxStakeSearchInterval = 60;
+    unsigned int nCandidate;
+    unsigned int nTimeTx;
+    // Search backward in time from the given txNew timestamp
+    // Search nSearchInterval seconds back up to nMaxStakeSearchInterval
+    while (SearchStakeKernel(pindexPrev, nBits, vCandidates, txNew.nTime, min(nSearchInterval,(int64_t)nMaxStakeSearchInterval), nCandidate, nTimeTx))
+    {
+        // Found a kernel; drop the coin from the search if it cannot be used
+        PAIRTYPE(const CWalletTx*, unsigned int) pcoin = vCandidateCoins[nCandidate];
+        int64_t nBlockTime = vCandidates[nCandidate].nTimeBlockFrom;
+        vCandidates.erase(vCandidates.begin() + nCandidate);
+        vCandidateCoins.erase(vCandidateCoins.begin() + nCandidate);
+        LogPrint("coinstake", "CreateCoinStake : kernel found\n");
+        vector<valtype> vSolutions;
+        txnouttype whichType;
+        CScript scriptPubKeyOut;
+        scriptPubKeyKernel = pcoin.first->vout[pcoin.second].scriptPubKey;
+        if (!Solver(scriptPubKeyKernel, whichType, vSolutions))
+        {
+            LogPrint("coinstake", "CreateCoinStake : failed to parse kernel\n");
+            continue;
+        }
+        LogPrint("coinstake", "CreateCoinStake : parsed kernel type=%d\n", whichType);
+        if (whichType != TX_PUBKEY && whichType != TX_PUBKEYHASH)
+        {
+            LogPrint("coinstake", "CreateCoinStake : no support for kernel type=%d\n", whichType);
+            continue;  // only support pay to public key and pay to address
+        }
+        if (whichType == TX_PUBKEYHASH) // pay to address type
+        {
+            // convert to pay to public key type
+            if (!keystore.GetKey(uint160(vSolutions[0]), key))
             {
-                // Found a kernel
-                LogPrint("coinstake", "CreateCoinStake : kernel found\n");
-                vector<valtype> vSolutions;
-                txnouttype whichType;
-                CScript scriptPubKeyOut;
-                scriptPubKeyKernel = pcoin.first->vout[pcoin.second].scriptPubKey;
-                if (!Solver(scriptPubKeyKernel, whichType, vSolutions))
-                {
-                    LogPrint("coinstake", "CreateCoinStake : failed to parse kernel\n");
-                    break;
-                }
-                LogPrint("coinstake", "CreateCoinStake : parsed kernel type=%d\n", whichType);
-                if (whichType != TX_PUBKEY && whichType != TX_PUBKEYHASH)
-                {
-                    LogPrint("coinstake", "CreateCoinStake : no support for kernel type=%d\n", whichType);
-                    break;  // only support pay to public key and pay to address
-                }
-                if (whichType == TX_PUBKEYHASH) // pay to address type
-                {
-                    // convert to pay to public key type
-                    if (!keystore.GetKey(uint160(vSolutions[0]), key))
-                    {
-                        LogPrint("coinstake", "CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
-                        break;  // unable to find corresponding public key
-                    }
-                    scriptPubKeyOut << key.GetPubKey() << OP_CHECKSIG;
-                }
-                if (whichType == TX_PUBKEY)
-                {
-                    valtype& vchPubKey = vSolutions[0];
-                    if (!keystore.GetKey(Hash160(vchPubKey), key))
-                    {
-                        LogPrint("coinstake", "CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
-                        break;  // unable to find corresponding public key
-                    }
-
-                    if (key.GetPubKey() != vchPubKey)
-                    {
-                        LogPrint("coinstake", "CreateCoinStake : invalid key for kernel type=%d\n", whichType);
-                        break; // keys mismatch
-                    }
-
-                    scriptPubKeyOut = scriptPubKeyKernel;
-                }
-
-                txNew.nTime -= n;
-                txNew.vin.push_back(CTxIn(pcoin.first->GetHash(), pcoin.second));
-                nCredit += pcoin.first->vout[pcoin.second].nValue;
-                vwtxPrev.push_back(pcoin.first);
-                txNew.vout.push_back(CTxOut(0, scriptPubKeyOut));
+                LogPrint("coinstake", "CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
+                continue;  // unable to find corresponding public key
+            }
+            scriptPubKeyOut << key.GetPubKey() << OP_CHECKSIG;
+        }
+        if (whichType == TX_PUBKEY)
+        {
+            valtype& vchPubKey = vSolutions[0];
+            if (!keystore.GetKey(Hash160(vchPubKey), key))
+            {
+                LogPrint("coinstake", "CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
+                continue;  // unable to find corresponding public key
+            }
 
-                if (GetWeight(nBlockTime, (int64_t)txNew.nTime) < GetStakeSplitAge())
-                    txNew.vout.push_back(CTxOut(0, scriptPubKeyOut)); //split stake
-                LogPrint("coinstake", "CreateCoinStake : added kernel type=%d\n", whichType);
-                fKernelFound = true;
-                break;
+            if (key.GetPubKey() != vchPubKey)
+            {
+                LogPrint("coinstake", "CreateCoinStake : invalid key for kernel type=%d\n", whichType);
+                continue; // keys mismatch
             }
+
+            scriptPubKeyOut = scriptPubKeyKernel;
         }
 
-        if (fKernelFound)
-            break; // if kernel is found stop searching
+        txNew.nTime = nTimeTx;
+        txNew.vin.push_back(CTxIn(pcoin.first->GetHash(), pcoin.second));
+        nCredit += pcoin.first->vout[pcoin.second].nValue;
+        vwtxPrev.push_back(pcoin.first);
+        txNew.vout.push_back(CTxOut(0, scriptPubKeyOut));
+
+        if (GetWeight(nBlockTime, (int64_t)txNew.nTime) < GetStakeSplitAge())
+            txNew.vout.push_back(CTxOut(0, scriptPubKeyOut)); //split stake
+        LogPrint("coinstake", "CreateCoinStake : added kernel type=%d\n", whichType);
+        break; // if kernel is found stop searching
     }
 
     if (nCredit == 0 || nCredit > nBalance - nReserveBalance)
@@ -1916,11 +2353,28 @@ DBErrors CWallet::LoadWallet(bool& fFirstRunRet)
         }
     }
 
-    if (nLoadWalletRet != DB_LOAD_OK)
+    if (nLoadWalletRet != DB_LOAD_OK && nLoadWalletRet != DB_NONCRITICAL_ERROR)
         return nLoadWalletRet;
-    fFirstRunRet = !vchDefaultKey.IsValid();
+    if (nLoadWalletRet == DB_LOAD_OK)
+        fFirstRunRet = !vchDefaultKey.IsValid();
+
+    // Build the activity log once; AddToWallet and AddAccountingEntry extend it.
+    // The wallet is still used after a noncritical error, so it needs one too.
+    {
+        LOCK(cs_wallet);
+        wtxOrdered.clear();
+        laccentries.clear();
+        CWalletDB(strWalletFile).ListAccountCreditDebit("*", laccentries);
+        for (map<uint256, CWalletTx>::iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        {
+            CWalletTx* wtx = &((*it).second);
+            wtxOrdered.insert(make_pair(wtx->nOrderPos, TxPair(wtx, (CAccountingEntry*)0)));
+        }
+        BOOST_FOREACH(CAccountingEntry& entry, laccentries)
+            wtxOrdered.insert(make_pair(entry.nOrderPos, TxPair((CWalletTx*)0, &entry)));
+    }
 
-    return DB_LOAD_OK;
+    return nLoadWalletRet;
 }
 
 
@@ -14,6 +14,7 @@
 
 #include "crypter.h"
 #include "main.h"
+#include "kernel.h"
 #include "key.h"
 #include "keystore.h"
 #include "script.h"
@@ -31,6 +32,7 @@ class CAccountingEntry;
 class CCoinControl;
 class CWalletTx;
 class CReserveKey;
+class CRescanReservation;
 class COutput;
 class CWalletDB;
 
@@ -72,6 +74,66 @@ public:
     )
 };
 
+/** Amounts in each balance state, of one wallet transaction or the whole wallet */
+class CWalletBalance
+{
+public:
+    int64_t nConfirmed;
+    int64_t nUnconfirmed;
+    int64_t nImmature;
+    int64_t nStake;
+    int64_t nNewMint;
+
+    CWalletBalance()
+    {
+        SetNull();
+    }
+
+    void SetNull()
+    {
+        nConfirmed = nUnconfirmed = nImmature = nStake = nNewMint = 0;
+    }
+
+    bool IsNull() const
+    {
+        return nConfirmed == 0 && nUnconfirmed == 0 && nImmature == 0 && nStake == 0 && nNewMint == 0;
+    }
+
+    CWalletBalance& operator+=(const CWalletBalance& b)
+    {
+        nConfirmed += b.nConfirmed;
+        nUnconfirmed += b.nUnconfirmed;
+        nImmature += b.nImmature;
+        nStake += b.nStake;
+        nNewMint += b.nNewMint;
+        return *this;
+    }
+
+    CWalletBalance& operator-=(const CWalletBalance& b)
+    {
+        nConfirmed -= b.nConfirmed;
+        nUnconfirmed -= b.nUnconfirmed;
+        nImmature -= b.nImmature;
+        nStake -= b.nStake;
+        nNewMint -= b.nNewMint;
+        return *this;
+    }
+};
+
+/** A key to add with CWallet::ImportKeys(), with its birthday and address book label */
+class CKeyImport
+{
+public:
+    CKey key;
+    int64_t nCreateTime;
+    bool fLabel;
+    std::string strLabel;
+
+    CKeyImport(const CKey& keyIn, int64_t nCreateTimeIn) : key(keyIn), nCreateTime(nCreateTimeIn), fLabel(false)
+    {
+    }
+};
+
 /** A CWallet is an extension of a keystore, which also maintains a set of transactions and balances,
  * and provides the ability to create new transactions.
  */
@@ -81,6 +143,8 @@ private:
     bool SelectCoinsForStaking(int64_t nTargetValue, unsigned int nSpendTime, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64_t& nValueRet) const;
     bool SelectCoins(int64_t nTargetValue, unsigned int nSpendTime, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64_t& nValueRet, const CCoinControl *coinControl=NULL) const;
 
+    // Open database transaction that key writes go to while the wallet is
+    // being encrypted or a batch of keys imported
     CWalletDB *pwalletdbEncryption;
 
     // the current wallet version: clients below this version are not able to load the wallet
@@ -89,6 +153,35 @@ private:
     // the maximum wallet format version: memory-only variable that specifies to what version this wallet may be upgraded
     int nWalletMaxVersion;
 
+    // Kernel inputs of coins tried by CreateCoinStake(), kept across calls
+    std::map<COutPoint, CStakeCandidate> mapStakeCandidates;
+
+    // Transactions with outputs of ours not spent yet, so balances and coin
+    // selection don't walk all of mapWallet
+    mutable std::set<uint256> setUnspentTx;
+    // Our coinbase and coinstake transactions that haven't matured yet
+    mutable std::set<uint256> setImmatureTx;
+    // Unspent transactions not yet confirmed or final
+    mutable std::set<uint256> setPendingTx;
+    // Transactions to re-sort before the sets are next used
+    mutable std::set<uint256> setUnspentDirtyTx;
+    mutable bool fUnspentIndexStale;
+
+    // Running balance totals, and what each transaction adds to them
+    mutable CWalletBalance balanceTotal;
+    mutable std::map<uint256, CWalletBalance> mapBalanceContrib;
+    // Best block the totals were last brought up to
+    mutable uint256 hashBalanceBlock;
+
+    void UpdateUnspentIndex() const;
+
+    // Set while ScanForWalletTransactions() runs, and to ask it to stop early
+    volatile bool fScanningWallet;
+    volatile bool fAbortRescan;
+    // Set while a CRescanReservation is held
+    volatile bool fRescanReserved;
+    friend class CRescanReservation;
+
 public:
     /// Main wallet lock.
     /// This lock protects all the fields added by CWallet
@@ -97,6 +190,11 @@ public:
     ///      strWalletFile (immutable after instantiation)
     mutable CCriticalSection cs_wallet;
 
+    /// Held for the length of a rescan. Only ever taken with TRY_LOCK, so a
+    /// second rescan gives up instead of waiting, while the thread holding
+    /// it (an import reserving the rescan it is about to run) can re-enter.
+    mutable CCriticalSection cs_rescan;
+
     bool fFileBacked;
     std::string strWalletFile;
 
@@ -128,6 +226,10 @@ public:
         pwalletdbEncryption = NULL;
         nOrderPosNext = 0;
         nTimeFirstKey = 0;
+        fUnspentIndexStale = true;
+        fScanningWallet = false;
+        fAbortRescan = false;
+        fRescanReserved = false;
     }
 
     std::map<uint256, CWalletTx> mapWallet;
@@ -156,6 +258,8 @@ public:
     bool LoadKey(const CKey& key, const CPubKey &pubkey) { return CCryptoKeyStore::AddKeyPubKey(key, pubkey); }
     // Load metadata (used by LoadWallet)
     bool LoadKeyMetadata(const CPubKey &pubkey, const CKeyMetadata &metadata);
+    // Adds keys and their labels in a single database transaction
+    bool ImportKeys(const std::vector<CKeyImport>& vImport, int& nImportedRet);
 
     bool LoadMinVersion(int nVersion) { AssertLockHeld(cs_wallet); nWalletVersion = nVersion; nWalletMaxVersion = std::max(nWalletMaxVersion, nVersion); return true; }
 
@@ -181,19 +285,28 @@ public:
     typedef std::pair<CWalletTx*, CAccountingEntry*> TxPair;
     typedef std::multimap<int64_t, TxPair > TxItems;
 
-    /** Get the wallet's activity log
-        @return multimap of ordered transactions and accounting entries
-        @warning Returned pointers are *only* valid within the scope of passed acentries
+    /** The wallet's activity log: transactions and accounting entries by
+        nOrderPos, built on load and kept up to date as entries are added
      */
-    TxItems OrderedTxItems(std::list<CAccountingEntry>& acentries, std::string strAccount = "");
+    TxItems wtxOrdered;
+    std::list<CAccountingEntry> laccentries;
+
+    /** Add an accounting entry to the activity log once it has been committed to the wallet file */
+    void AddAccountingEntry(const CAccountingEntry& acentry);
 
     void MarkDirty();
+    void MarkUnspentDirty(const uint256& hash) const;
     bool AddToWallet(const CWalletTx& wtxIn);
     void SyncTransaction(const CTransaction& tx, const CBlock* pblock, bool fConnect = true);
     bool AddToWalletIfInvolvingMe(const CTransaction& tx, const CBlock* pblock, bool fUpdate);
     void EraseFromWallet(const uint256 &hash);
     void WalletUpdateSpent(const CTransaction& prevout, bool fBlock = false);
-    int ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate = false);
+    // Returns the number of transactions found, or -1 if the scan didn't
+    // run to the end: it was aborted, or another thread holds cs_rescan
+    int ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate = false, bool fShowProgress = false);
+    bool IsScanning() const { return fScanningWallet; }
+    bool IsRescanReserved() const { return fRescanReserved; }
+    void AbortRescan() { fAbortRescan = true; }
     void ReacceptWalletTransactions();
     void ResendWalletTransactions(bool fForce = false);
     int64_t GetBalance() const;
@@ -338,6 +451,23 @@ public:
     boost::signals2::signal<void (CWallet *wallet, const uint256 &hashTx, ChangeType status)> NotifyTransactionChanged;
 };
 
+/** Holds cs_rescan for the rescan an import is about to run, from before its
+ *  keys are written until the rescan is done. AbortRescan() requests made in
+ *  that time stop the rescan. */
+class CRescanReservation
+{
+private:
+    CWallet& wallet;
+    CCriticalBlock lockRescan;
+    bool fOwner;
+public:
+    CRescanReservation(CWallet& walletIn);
+    ~CRescanReservation();
+
+    // False if another thread is rescanning
+    bool IsReserved() { return lockRescan; }
+};
+
 /** A key allocated from the key pool. */
 class CReserveKey
 {
@@ -532,6 +662,8 @@ public:
                 fAvailableCreditCached = false;
             }
         }
+        if (fReturn && pwallet)
+            pwallet->MarkUnspentDirty(GetHash());
         return fReturn;
     }
 
@@ -559,6 +691,8 @@ public:
         {
             vfSpent[nOut] = true;
             fAvailableCreditCached = false;
+            if (pwallet)
+                pwallet->MarkUnspentDirty(GetHash());
         }
     }
 
@@ -571,6 +705,8 @@ public:
         {
             vfSpent[nOut] = false;
             fAvailableCreditCached = false;
+            if (pwallet)
+                pwallet->MarkUnspentDirty(GetHash());
         }
     }
 